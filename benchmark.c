@@ -0,0 +1,830 @@
+// This program measures the throughput of the color conversion code. The
+// first part times every conversion variant over a set of standard
+// resolutions, with both tightly packed and padded rows, and with both cold
+// and warm caches. The second part compares ways of splitting stereo frames,
+// the third compares downscaled preview conversions with a full conversion,
+// the fourth compares GREY, I420 and NV12 output with RGBA output, the fifth
+// times the RGBA conversion for every color encoding, the sixth measures the
+// cost of gathering frame statistics during the conversion, the seventh
+// compares incremental conversions of partly changed frames with full
+// conversions, and the last part measures how well the parallel conversion
+// scales with the number of threads, using frames from large cameras.
+//
+// Usage:
+//    ./benchmark [-o <CSV output path>] [-t <maximum thread count>]
+//
+// The CSV file gets one line per measurement, so results can be compared
+// between releases. The maximum thread count defaults to the number of CPUs.
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "webcam_lib.h"
+
+// The number of times each conversion is timed in the scaling benchmark. The
+// fastest time is reported.
+#define ITERATIONS (20)
+
+// Each measurement in the suite is repeated at least MIN_RUNS times, and
+// until MIN_SECONDS have passed (including the time spent evicting the caches
+// for cold runs), up to MAX_RUNS times.
+#define MIN_RUNS (20)
+#define MAX_RUNS (1000)
+#define MIN_SECONDS (0.2)
+
+// The number of bytes added to the end of each row in the padded-pitch tests.
+// Drivers commonly pad rows to a multiple of 64 or 128 bytes.
+#define PITCH_PADDING (128)
+
+// The amount of memory written between runs to evict the frames from the
+// cache, if the size of the last-level cache can't be determined.
+#define DEFAULT_EVICTION_SIZE (64 * 1024 * 1024)
+#define MAX_EVICTION_SIZE (128 * 1024 * 1024)
+
+typedef struct {
+  const char *name;
+  int w;
+  int h;
+} BenchmarkResolution;
+
+static const BenchmarkResolution resolutions[] = {
+  {"VGA", 640, 480},
+  {"720p", 1280, 720},
+  {"1080p", 1920, 1080},
+  {"4K", 3840, 2160},
+  {"Zed VGA", 2560, 720},
+  {"Zed 2.2K", 4416, 1242},
+};
+
+// The side-by-side resolutions used by the stereo splitting benchmark.
+static const BenchmarkResolution stereo_resolutions[] = {
+  {"Zed VGA", 2560, 720},
+  {"Zed 2.2K", 4416, 1242},
+};
+
+// The resolutions used by the downscaling benchmark.
+static const BenchmarkResolution downscale_resolutions[] = {
+  {"1080p", 1920, 1080},
+  {"4K", 3840, 2160},
+};
+
+// The resolutions used by the output format benchmark.
+static const BenchmarkResolution output_format_resolutions[] = {
+  {"1080p", 1920, 1080},
+  {"4K", 3840, 2160},
+};
+
+// The resolutions used by the color encoding benchmark.
+static const BenchmarkResolution color_encoding_resolutions[] = {
+  {"1080p", 1920, 1080},
+};
+
+// The resolutions used by the frame statistics benchmark.
+static const BenchmarkResolution statistics_resolutions[] = {
+  {"1080p", 1920, 1080},
+  {"4K", 3840, 2160},
+};
+
+// The resolutions used by the incremental conversion benchmark.
+static const BenchmarkResolution incremental_resolutions[] = {
+  {"1080p", 1920, 1080},
+  {"4K", 3840, 2160},
+};
+
+// The percentages of each frame changed in the incremental conversion
+// benchmark.
+static const int incremental_change_percentages[] = {0, 10, 50, 100};
+
+// The resolutions used by the scaling benchmark.
+static const BenchmarkResolution scaling_resolutions[] = {
+  {"4K", 3840, 2160},
+  {"Zed 2.2K", 4416, 1242},
+};
+
+// A function that converts a YUYV frame, with the same arguments as
+// ConvertYUYVToRGBA apart from the variant's context. Returns 0 on error.
+typedef int (*BenchmarkFunction)(void *context, uint8_t *input,
+  uint8_t *output, int w, int h, int input_pitch, int output_pitch);
+
+// One of the conversion implementations being compared.
+typedef struct {
+  char name[32];
+  BenchmarkFunction convert;
+  void *context;
+  // If nonzero, the output is compared to the fixed-point kernel's output.
+  int exact;
+} BenchmarkVariant;
+
+// The buffers and settings for one set of runs.
+typedef struct {
+  const BenchmarkResolution *resolution;
+  const BenchmarkVariant *variant;
+  uint8_t *input;
+  uint8_t *output;
+  int input_pitch;
+  int output_pitch;
+  int cold;
+} BenchmarkCase;
+
+// The kernels, in the order of the ConversionKernel enum, so variants can
+// point at them.
+static ConversionKernel kernels[CONVERSION_KERNEL_COUNT];
+
+// The memory written to flush the caches before cold runs.
+static uint8_t *eviction_buffer = NULL;
+static size_t eviction_size = 0;
+
+// Returns the current time in seconds. Exits if an error occurs while getting
+// the time.
+static double CurrentSeconds(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+    printf("Error getting time.\n");
+    exit(1);
+  }
+  return ((double) ts.tv_sec) + (((double) ts.tv_nsec) / 1e9);
+}
+
+// Allocates a buffer of the given size, exiting on error.
+static uint8_t* AllocateOrExit(size_t size) {
+  uint8_t *buffer = (uint8_t *) malloc(size);
+  if (!buffer) {
+    printf("Failed allocating %lu bytes.\n", (unsigned long) size);
+    exit(1);
+  }
+  return buffer;
+}
+
+// Fills the buffer with pseudorandom bytes.
+static void FillRandom(uint8_t *buffer, size_t size) {
+  size_t i;
+  for (i = 0; i < size; i++) {
+    buffer[i] = rand();
+  }
+}
+
+static int ConvertWithKernel(void *context, uint8_t *input, uint8_t *output,
+    int w, int h, int input_pitch, int output_pitch) {
+  ConversionKernel kernel = *((ConversionKernel *) context);
+  return ConvertYUYVToRGBAWithKernel(kernel, input, output, w, h,
+    input_pitch, output_pitch);
+}
+
+static int ConvertWithPool(void *context, uint8_t *input, uint8_t *output,
+    int w, int h, int input_pitch, int output_pitch) {
+  return ConvertYUYVToRGBAParallel((ConversionPool *) context, input, output,
+    w, h, input_pitch, output_pitch);
+}
+
+// Fills in the list of variants to benchmark: every kernel supported by this
+// CPU, followed by the parallel conversion if more than one thread is
+// available. Returns the number of variants.
+static int GetVariants(BenchmarkVariant *variants, ConversionPool *pool) {
+  BenchmarkVariant *variant;
+  int i, count = 0;
+  for (i = 0; i < CONVERSION_KERNEL_COUNT; i++) {
+    kernels[i] = (ConversionKernel) i;
+    if (!ConversionKernelSupported(kernels[i])) continue;
+    variant = variants + count;
+    snprintf(variant->name, sizeof(variant->name), "%s",
+      ConversionKernelName(kernels[i]));
+    variant->convert = ConvertWithKernel;
+    variant->context = kernels + i;
+    variant->exact = kernels[i] != CONVERSION_KERNEL_REFERENCE;
+    count++;
+  }
+  if (pool && (GetConversionPoolThreadCount(pool) > 1)) {
+    variant = variants + count;
+    snprintf(variant->name, sizeof(variant->name), "%s x%d",
+      ConversionKernelName(GetBestConversionKernel()),
+      GetConversionPoolThreadCount(pool));
+    variant->convert = ConvertWithPool;
+    variant->context = pool;
+    variant->exact = 1;
+    count++;
+  }
+  return count;
+}
+
+// Allocates the buffer used to evict frames from the caches, which is twice
+// the size of the last-level cache, up to MAX_EVICTION_SIZE.
+static void AllocateEvictionBuffer(void) {
+  long cache_size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  cache_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (cache_size <= 0) cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  if (cache_size > 0) {
+    eviction_size = ((size_t) cache_size) * 2;
+    if (eviction_size > MAX_EVICTION_SIZE) eviction_size = MAX_EVICTION_SIZE;
+  } else {
+    eviction_size = DEFAULT_EVICTION_SIZE;
+  }
+  eviction_buffer = AllocateOrExit(eviction_size);
+}
+
+// Writes to enough memory to push the frames out of the CPU's caches.
+static void EvictCaches(void) {
+  static uint8_t value = 0;
+  value++;
+  memset(eviction_buffer, value, eviction_size);
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+  double x = *((const double *) a), y = *((const double *) b);
+  if (x < y) return -1;
+  if (x > y) return 1;
+  return 0;
+}
+
+// Returns the value at the given percentile of the sorted times, using the
+// nearest-rank method.
+static double Percentile(double *sorted, int count, int percentile) {
+  int rank = (count * percentile + 99) / 100;
+  if (rank < 1) rank = 1;
+  return sorted[rank - 1];
+}
+
+// Returns nonzero if the visible part of every row of the output matches the
+// tightly-packed expected output.
+static int OutputMatches(BenchmarkCase *c, uint8_t *expected) {
+  int w = c->resolution->w, y;
+  for (y = 0; y < c->resolution->h; y++) {
+    if (memcmp(c->output + y * c->output_pitch, expected + y * w * 4,
+      w * 4) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Runs one benchmark case repeatedly, storing the time taken by each run in
+// times. Returns the number of runs, or 0 on error.
+static int TimeCase(BenchmarkCase *c, double *times) {
+  const BenchmarkVariant *variant = c->variant;
+  int w = c->resolution->w, h = c->resolution->h;
+  double start = 0, end;
+  int runs = 0;
+  // Do one untimed run, so the warm runs really start with a warm cache.
+  if (!variant->convert(variant->context, c->input, c->output, w, h,
+    c->input_pitch, c->output_pitch)) {
+    return 0;
+  }
+  end = CurrentSeconds() + MIN_SECONDS;
+  while ((runs < MAX_RUNS) && ((runs < MIN_RUNS) || (start < end))) {
+    if (c->cold) EvictCaches();
+    start = CurrentSeconds();
+    variant->convert(variant->context, c->input, c->output, w, h,
+      c->input_pitch, c->output_pitch);
+    times[runs] = CurrentSeconds() - start;
+    runs++;
+  }
+  return runs;
+}
+
+// Writes one row of results to the CSV file, if one was given. times must be
+// sorted, and bytes is the number of bytes read and written by each run.
+static void WriteCSVRow(FILE *csv, const char *variant,
+    const BenchmarkResolution *resolution, int input_pitch, int output_pitch,
+    int cold, double *times, int runs, double bytes) {
+  double pixels = ((double) resolution->w) * resolution->h;
+  double median = Percentile(times, runs, 50);
+  if (!csv) return;
+  fprintf(csv, "%s,%d,%d,%s,%d,%d,%s,%d,%.0f,%.0f,%.0f,%.4f,%.3f,%.2f\n",
+    variant, resolution->w, resolution->h, resolution->name, input_pitch,
+    output_pitch, cold ? "cold" : "warm", runs, times[0] * 1e9,
+    median * 1e9, Percentile(times, runs, 99) * 1e9,
+    (median * 1e9) / pixels, bytes / median / 1e9, 1.0 / median);
+}
+
+// Times one benchmark case and prints the results, also writing them to the
+// CSV file if one was given. Returns 0 on error.
+static int RunCase(BenchmarkCase *c, uint8_t *expected, FILE *csv) {
+  double times[MAX_RUNS];
+  double min, median, p99, pixels, bytes;
+  const char *pitch_name, *cache_name;
+  int w = c->resolution->w, h = c->resolution->h;
+  int runs = TimeCase(c, times);
+  if (runs == 0) {
+    printf("%s conversion failed at %dx%d.\n", c->variant->name, w, h);
+    return 0;
+  }
+  if (c->variant->exact && !OutputMatches(c, expected)) {
+    printf("%s output at %dx%d differs from the fixed-point output!\n",
+      c->variant->name, w, h);
+    return 0;
+  }
+  qsort(times, runs, sizeof(double), CompareDoubles);
+  min = times[0];
+  median = Percentile(times, runs, 50);
+  p99 = Percentile(times, runs, 99);
+  pixels = ((double) w) * h;
+  // Count the bytes read and written, not including padding.
+  bytes = pixels * (2 + 4);
+  pitch_name = (c->input_pitch == (w * 2)) ? "tight" : "padded";
+  cache_name = c->cold ? "cold" : "warm";
+  printf("  %-14s %-6s %-4s %8.3f %8.3f %8.3f %7.3f %7.2f %8.1f\n",
+    c->variant->name, pitch_name, cache_name, min * 1e3, median * 1e3,
+    p99 * 1e3, (median * 1e9) / pixels, bytes / median / 1e9, 1.0 / median);
+  WriteCSVRow(csv, c->variant->name, c->resolution, c->input_pitch,
+    c->output_pitch, c->cold, times, runs, bytes);
+  return 1;
+}
+
+// Runs every variant at one resolution, with each combination of pitch and
+// cache state. Returns 0 on error.
+static int BenchmarkResolutionSuite(const BenchmarkResolution *resolution,
+    BenchmarkVariant *variants, int variant_count, FILE *csv) {
+  BenchmarkCase c;
+  int w = resolution->w, h = resolution->h;
+  int padded_input_pitch = w * 2 + PITCH_PADDING;
+  int padded_output_pitch = w * 4 + PITCH_PADDING;
+  uint8_t *input = AllocateOrExit(((size_t) padded_input_pitch) * h);
+  uint8_t *output = AllocateOrExit(((size_t) padded_output_pitch) * h);
+  uint8_t *expected = AllocateOrExit(((size_t) w) * h * 4);
+  int i, padded, cold, result = 1;
+  FillRandom(input, ((size_t) padded_input_pitch) * h);
+  printf("%s (%dx%d):\n", resolution->name, w, h);
+  printf("  %-14s %-6s %-4s %8s %8s %8s %7s %7s %8s\n", "variant", "pitch",
+    "cache", "min ms", "med ms", "p99 ms", "ns/px", "GB/s", "frames/s");
+  c.resolution = resolution;
+  c.input = input;
+  c.output = output;
+  for (padded = 0; padded < 2; padded++) {
+    c.input_pitch = padded ? padded_input_pitch : (w * 2);
+    c.output_pitch = padded ? padded_output_pitch : (w * 4);
+    // Both pitches read the same rows, so they share the expected output.
+    if (!ConvertYUYVToRGBAWithKernel(CONVERSION_KERNEL_FIXED_POINT, input,
+      expected, w, h, c.input_pitch, w * 4)) {
+      printf("Fixed-point conversion failed.\n");
+      result = 0;
+      goto done;
+    }
+    for (cold = 0; cold < 2; cold++) {
+      c.cold = cold;
+      for (i = 0; i < variant_count; i++) {
+        c.variant = variants + i;
+        if (!RunCase(&c, expected, csv)) {
+          result = 0;
+          goto done;
+        }
+      }
+    }
+  }
+done:
+  free(input);
+  free(output);
+  free(expected);
+  return result;
+}
+
+// Times the parallel conversion of one resolution using every thread count
+// from 1 to max_threads, and checks that the output matches the serial
+// conversion. Returns 0 on error.
+static int BenchmarkScaling(const BenchmarkResolution *resolution,
+    int max_threads) {
+  ConversionPool pool;
+  int w = resolution->w, h = resolution->h;
+  size_t input_size = ((size_t) w) * h * 2;
+  size_t output_size = ((size_t) w) * h * 4;
+  uint8_t *input = AllocateOrExit(input_size);
+  uint8_t *expected = AllocateOrExit(output_size);
+  uint8_t *output = AllocateOrExit(output_size);
+  double start, elapsed, best, single_thread = 0;
+  int threads, i, result = 1;
+  FillRandom(input, input_size);
+  if (!ConvertYUYVToRGBA(input, expected, w, h, w * 2, w * 4)) {
+    printf("Serial conversion failed.\n");
+    result = 0;
+    goto done;
+  }
+  printf("%s (%dx%d), %s kernel:\n", resolution->name, w, h,
+    ConversionKernelName(GetBestConversionKernel()));
+  for (threads = 1; threads <= max_threads; threads++) {
+    if (!CreateConversionPool(&pool, threads, 0)) {
+      printf("Failed creating a pool with %d threads: %s\n", threads,
+        strerror(errno));
+      result = 0;
+      goto done;
+    }
+    memset(output, 0, output_size);
+    best = 1e9;
+    for (i = 0; i < ITERATIONS; i++) {
+      start = CurrentSeconds();
+      ConvertYUYVToRGBAParallel(&pool, input, output, w, h, w * 2, w * 4);
+      elapsed = CurrentSeconds() - start;
+      if (elapsed < best) best = elapsed;
+    }
+    DestroyConversionPool(&pool);
+    if (memcmp(output, expected, output_size) != 0) {
+      printf("Output with %d threads differs from the serial output!\n",
+        threads);
+      result = 0;
+      goto done;
+    }
+    if (threads == 1) single_thread = best;
+    printf("  %2d threads: %8.3f ms/frame, %7.1f frames/s, %5.2fx speedup\n",
+      threads, best * 1e3, 1.0 / best, single_thread / best);
+  }
+done:
+  free(input);
+  free(expected);
+  free(output);
+  return result;
+}
+
+// Splits a stereo frame by converting the whole frame, then copying each half
+// into its own buffer, as applications had to before ConvertStereoYUYV.
+static void SplitStereoByCopying(uint8_t *input, uint8_t *full,
+    StereoEyeOutput *left, StereoEyeOutput *right, int w, int h) {
+  int eye_bytes = (w / 2) * 4, y;
+  ConvertYUYVToRGBA(input, full, w, h, w * 2, w * 4);
+  for (y = 0; y < h; y++) {
+    memcpy(left->data + y * left->pitch, full + y * w * 4, eye_bytes);
+    memcpy(right->data + y * right->pitch, full + y * w * 4 + eye_bytes,
+      eye_bytes);
+  }
+}
+
+// Compares splitting a side-by-side stereo frame in one pass against
+// converting it and then copying out each eye, printing the median time of
+// each approach.
+static void BenchmarkStereoSplit(const BenchmarkResolution *resolution) {
+  StereoEyeOutput left, right;
+  int w = resolution->w, h = resolution->h, approach, i;
+  uint8_t *input = AllocateOrExit(((size_t) w) * h * 2);
+  uint8_t *full = AllocateOrExit(((size_t) w) * h * 4);
+  double times[ITERATIONS], start;
+  const char *names[] = {"convert + copy", "fused RGBA", "fused luma"};
+  FillRandom(input, ((size_t) w) * h * 2);
+  left.data = AllocateOrExit(((size_t) w / 2) * h * 4);
+  right.data = AllocateOrExit(((size_t) w / 2) * h * 4);
+  left.encoding = NULL;
+  right.encoding = NULL;
+  printf("%s (%dx%d):\n", resolution->name, w, h);
+  for (approach = 0; approach < 3; approach++) {
+    left.format = (approach == 2) ? V4L2_PIX_FMT_GREY : RGBA_FORMAT_CODE;
+    right.format = left.format;
+    left.pitch = (approach == 2) ? (w / 2) : (w / 2) * 4;
+    right.pitch = left.pitch;
+    for (i = 0; i < ITERATIONS; i++) {
+      start = CurrentSeconds();
+      if (approach == 0) {
+        SplitStereoByCopying(input, full, &left, &right, w, h);
+      } else {
+        ConvertStereoYUYV(input, w, h, w * 2, &left, &right);
+      }
+      times[i] = CurrentSeconds() - start;
+    }
+    qsort(times, ITERATIONS, sizeof(double), CompareDoubles);
+    printf("  %-14s %8.3f ms/frame (median)\n", names[approach],
+      Percentile(times, ITERATIONS, 50) * 1e3);
+  }
+  free(input);
+  free(full);
+  free(left.data);
+  free(right.data);
+}
+
+// Compares downscaled conversions, of the whole frame and of its central
+// quarter, with converting the whole frame at full resolution, printing the
+// median time of each.
+static void BenchmarkDownscale(const BenchmarkResolution *resolution) {
+  int w = resolution->w, h = resolution->h, approach, i;
+  uint8_t *input = AllocateOrExit(((size_t) w) * h * 2);
+  uint8_t *output = AllocateOrExit(((size_t) w) * h * 4);
+  FrameRegion center = {w / 4, h / 4, w / 2, h / 2};
+  double times[ITERATIONS], start;
+  const char *names[] = {"full", "1/2", "1/3", "1/4", "1/8",
+    "1/2 of center"};
+  int factors[] = {1, 2, 3, 4, 8, 2};
+  FrameRegion *regions[] = {NULL, NULL, NULL, NULL, NULL, &center};
+  FillRandom(input, ((size_t) w) * h * 2);
+  printf("%s (%dx%d):\n", resolution->name, w, h);
+  for (approach = 0; approach < 6; approach++) {
+    for (i = 0; i < ITERATIONS; i++) {
+      start = CurrentSeconds();
+      if (approach == 0) {
+        ConvertYUYVToRGBA(input, output, w, h, w * 2, w * 4);
+      } else {
+        ConvertYUYVToRGBADownscaled(input, w, h, w * 2, regions[approach],
+          factors[approach], output, w * 4);
+      }
+      times[i] = CurrentSeconds() - start;
+    }
+    qsort(times, ITERATIONS, sizeof(double), CompareDoubles);
+    printf("  %-14s %8.3f ms/frame (median)\n", names[approach],
+      Percentile(times, ITERATIONS, 50) * 1e3);
+  }
+  free(input);
+  free(output);
+}
+
+// Compares converting a frame to GREY, I420 and NV12 with converting it to
+// RGBA, printing the median time of each along with the size of its output,
+// and writing each to the CSV file as an "output <format>" variant.
+static void BenchmarkOutputFormats(const BenchmarkResolution *resolution,
+    FILE *csv) {
+  int w = resolution->w, h = resolution->h, format, i;
+  size_t pixels = ((size_t) w) * h;
+  uint8_t *input = AllocateOrExit(pixels * 2);
+  uint8_t *output = AllocateOrExit(pixels * 4);
+  uint8_t *u_plane = output + pixels;
+  uint8_t *v_plane = u_plane + pixels / 4;
+  double times[ITERATIONS], start;
+  const char *names[] = {"RGBA", "GREY", "I420", "NV12"};
+  size_t output_sizes[] = {pixels * 4, pixels, pixels * 3 / 2,
+    pixels * 3 / 2};
+  char name[32];
+  FillRandom(input, pixels * 2);
+  printf("%s (%dx%d):\n", resolution->name, w, h);
+  for (format = 0; format < 4; format++) {
+    for (i = 0; i < ITERATIONS; i++) {
+      start = CurrentSeconds();
+      switch (format) {
+      case 0:
+        ConvertYUYVToRGBA(input, output, w, h, w * 2, w * 4);
+        break;
+      case 1:
+        ConvertYUYVToGrey(input, output, w, h, w * 2, w);
+        break;
+      case 2:
+        ConvertYUYVToI420(input, w, h, w * 2, output, w, u_plane, v_plane,
+          w / 2);
+        break;
+      default:
+        ConvertYUYVToNV12(input, w, h, w * 2, output, w, u_plane, w);
+        break;
+      }
+      times[i] = CurrentSeconds() - start;
+    }
+    qsort(times, ITERATIONS, sizeof(double), CompareDoubles);
+    printf("  %-14s %8.3f ms/frame (median), %5.2f MB output\n",
+      names[format], Percentile(times, ITERATIONS, 50) * 1e3,
+      output_sizes[format] / 1e6);
+    snprintf(name, sizeof(name), "output %s", names[format]);
+    // The luma plane's pitch stands in for the planar formats' pitch.
+    WriteCSVRow(csv, name, resolution, w * 2, (format == 0) ? (w * 4) : w,
+      0, times, ITERATIONS, (double) (pixels * 2 + output_sizes[format]));
+  }
+  free(input);
+  free(output);
+}
+
+// Times converting a frame to RGBA with each color encoding, printing the
+// median time of each. These should all be about the same, since every
+// encoding gets its own copy of the kernel.
+static void BenchmarkColorEncodings(const BenchmarkResolution *resolution) {
+  int w = resolution->w, h = resolution->h, i;
+  size_t pixels = ((size_t) w) * h;
+  uint8_t *input = AllocateOrExit(pixels * 2);
+  uint8_t *output = AllocateOrExit(pixels * 4);
+  double times[ITERATIONS], start;
+  ColorEncoding encoding;
+  char name[32];
+  FillRandom(input, pixels * 2);
+  printf("%s (%dx%d):\n", resolution->name, w, h);
+  for (encoding.matrix = 0; encoding.matrix < COLOR_MATRIX_COUNT;
+    encoding.matrix++) {
+    for (encoding.range = 0; encoding.range < COLOR_RANGE_COUNT;
+      encoding.range++) {
+      for (i = 0; i < ITERATIONS; i++) {
+        start = CurrentSeconds();
+        ConvertYUYVToRGBAWithEncoding(&encoding, input, output, w, h, w * 2,
+          w * 4);
+        times[i] = CurrentSeconds() - start;
+      }
+      qsort(times, ITERATIONS, sizeof(double), CompareDoubles);
+      snprintf(name, sizeof(name), "%s %s", ColorMatrixName(encoding.matrix),
+        ColorRangeName(encoding.range));
+      printf("  %-14s %8.3f ms/frame (median)\n", name,
+        Percentile(times, ITERATIONS, 50) * 1e3);
+    }
+  }
+  free(input);
+  free(output);
+}
+
+// Compares converting a frame to RGBA on its own, followed by a separate
+// GetYUYVFrameStatistics pass, and with the statistics gathered during the
+// conversion, printing the median time of each and its overhead over the
+// plain conversion, and writing each to the CSV file as a "statistics
+// <approach>" variant. The caches are evicted before each run, like a frame
+// freshly written to a capture buffer.
+static void BenchmarkStatistics(const BenchmarkResolution *resolution,
+    FILE *csv) {
+  int w = resolution->w, h = resolution->h, approach, i;
+  size_t pixels = ((size_t) w) * h;
+  uint8_t *input = AllocateOrExit(pixels * 2);
+  uint8_t *output = AllocateOrExit(pixels * 4);
+  FrameStatistics statistics;
+  double times[ITERATIONS], start, median, baseline = 0;
+  const char *names[] = {"convert only", "separate pass", "fused"};
+  char name[32];
+  FillRandom(input, pixels * 2);
+  memset(&statistics, 0, sizeof(statistics));
+  statistics.tile_columns = 8;
+  statistics.tile_rows = 8;
+  printf("%s (%dx%d):\n", resolution->name, w, h);
+  for (approach = 0; approach < 3; approach++) {
+    for (i = 0; i < ITERATIONS; i++) {
+      EvictCaches();
+      start = CurrentSeconds();
+      switch (approach) {
+      case 0:
+        ConvertYUYVToRGBA(input, output, w, h, w * 2, w * 4);
+        break;
+      case 1:
+        ConvertYUYVToRGBA(input, output, w, h, w * 2, w * 4);
+        GetYUYVFrameStatistics(input, w, h, w * 2, NULL, &statistics);
+        break;
+      default:
+        ConvertYUYVToRGBAWithStatistics(NULL, input, output, w, h, w * 2,
+          w * 4, &statistics);
+        break;
+      }
+      times[i] = CurrentSeconds() - start;
+    }
+    qsort(times, ITERATIONS, sizeof(double), CompareDoubles);
+    median = Percentile(times, ITERATIONS, 50);
+    if (approach == 0) baseline = median;
+    printf("  %-14s %8.3f ms/frame (median), %+6.1f%%\n", names[approach],
+      median * 1e3, ((median / baseline) - 1.0) * 100.0);
+    snprintf(name, sizeof(name), "statistics %s", names[approach]);
+    WriteCSVRow(csv, name, resolution, w * 2, w * 4, 1, times, ITERATIONS,
+      (double) (pixels * (2 + 4)));
+  }
+  free(input);
+  free(output);
+}
+
+// Changes the given percentage of a YUYV frame, as a band of rows starting at
+// a position that moves with each call, so the tracker sees new changes each
+// time.
+static void ChangeFrame(uint8_t *frame, int w, int h, int percentage,
+    int call) {
+  int rows = (h * percentage) / 100, first_row, i;
+  size_t offset;
+  if (rows == 0) return;
+  first_row = (call * DIRTY_TILE_HEIGHT * 3) % (h - rows + 1);
+  offset = ((size_t) first_row) * w * 2;
+  for (i = 0; i < (rows * w * 2); i++) {
+    frame[offset + i] += 101;
+  }
+}
+
+// Compares incremental conversions of frames with different fractions
+// changed from the previous frame against converting the whole frame,
+// printing the median time of each and the fraction of tiles skipped.
+static void BenchmarkIncremental(const BenchmarkResolution *resolution) {
+  int w = resolution->w, h = resolution->h, approach, i, percentage;
+  size_t pixels = ((size_t) w) * h;
+  uint8_t *input = AllocateOrExit(pixels * 2);
+  uint8_t *output = AllocateOrExit(pixels * 4);
+  DirtyTileTracker tracker;
+  double times[ITERATIONS], start, skipped;
+  uint64_t first_frame_tiles;
+  char name[32];
+  int approach_count = sizeof(incremental_change_percentages) /
+    sizeof(incremental_change_percentages[0]);
+  FillRandom(input, pixels * 2);
+  printf("%s (%dx%d):\n", resolution->name, w, h);
+  for (i = 0; i < ITERATIONS; i++) {
+    start = CurrentSeconds();
+    ConvertYUYVToRGBA(input, output, w, h, w * 2, w * 4);
+    times[i] = CurrentSeconds() - start;
+  }
+  qsort(times, ITERATIONS, sizeof(double), CompareDoubles);
+  printf("  %-14s %8.3f ms/frame (median)\n", "full",
+    Percentile(times, ITERATIONS, 50) * 1e3);
+  for (approach = 0; approach < approach_count; approach++) {
+    percentage = incremental_change_percentages[approach];
+    if (!CreateDirtyTileTracker(&tracker, w, h, 0, NULL)) {
+      printf("Failed creating a dirty tile tracker: %s\n", strerror(errno));
+      break;
+    }
+    // The first frame is always converted in full, so leave it out of the
+    // fraction skipped.
+    ConvertYUYVToRGBAIncremental(&tracker, input, output, w * 2, w * 4);
+    first_frame_tiles = tracker.tile_count;
+    for (i = 0; i < ITERATIONS; i++) {
+      ChangeFrame(input, w, h, percentage, i);
+      start = CurrentSeconds();
+      ConvertYUYVToRGBAIncremental(&tracker, input, output, w * 2, w * 4);
+      times[i] = CurrentSeconds() - start;
+    }
+    qsort(times, ITERATIONS, sizeof(double), CompareDoubles);
+    skipped = 1.0 - ((double) (tracker.converted_tile_count -
+      first_frame_tiles)) / (tracker.tile_count - first_frame_tiles);
+    snprintf(name, sizeof(name), "%d%% changed", percentage);
+    printf("  %-14s %8.3f ms/frame (median), %5.1f%% of tiles skipped\n",
+      name, Percentile(times, ITERATIONS, 50) * 1e3, skipped * 100.0);
+    DestroyDirtyTileTracker(&tracker);
+  }
+  free(input);
+  free(output);
+}
+
+static void PrintUsage(char *program) {
+  printf("Usage: %s [-o <CSV output path>] [-t <maximum thread count>]\n",
+    program);
+}
+
+int main(int argc, char **argv) {
+  BenchmarkVariant variants[CONVERSION_KERNEL_COUNT + 1];
+  ConversionPool pool;
+  FILE *csv = NULL;
+  char *csv_path = NULL;
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int option, variant_count, i, result = 0;
+  while ((option = getopt(argc, argv, "o:t:")) != -1) {
+    switch (option) {
+    case 'o':
+      csv_path = optarg;
+      break;
+    case 't':
+      max_threads = atoi(optarg);
+      break;
+    default:
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  if (max_threads < 1) max_threads = 1;
+  if (csv_path) {
+    csv = fopen(csv_path, "w");
+    if (!csv) {
+      printf("Failed opening %s: %s\n", csv_path, strerror(errno));
+      return 1;
+    }
+    fprintf(csv, "variant,width,height,resolution,input_pitch,output_pitch,"
+      "cache,runs,min_ns,median_ns,p99_ns,ns_per_pixel,gb_per_s,"
+      "frames_per_s\n");
+  }
+  if (!CreateConversionPool(&pool, max_threads, 0)) {
+    printf("Failed creating a pool with %d threads: %s\n", max_threads,
+      strerror(errno));
+    return 1;
+  }
+  AllocateEvictionBuffer();
+  variant_count = GetVariants(variants, &pool);
+  printf("Conversion throughput, using the median time for ns/px, GB/s and "
+    "frames/s:\n");
+  for (i = 0; i < (sizeof(resolutions) / sizeof(resolutions[0])); i++) {
+    if (!BenchmarkResolutionSuite(resolutions + i, variants, variant_count,
+      csv)) {
+      result = 1;
+      goto done;
+    }
+  }
+  printf("\nStereo splitting:\n");
+  for (i = 0; i < (sizeof(stereo_resolutions) /
+    sizeof(stereo_resolutions[0])); i++) {
+    BenchmarkStereoSplit(stereo_resolutions + i);
+  }
+  printf("\nDownscaled conversion:\n");
+  for (i = 0; i < (sizeof(downscale_resolutions) /
+    sizeof(downscale_resolutions[0])); i++) {
+    BenchmarkDownscale(downscale_resolutions + i);
+  }
+  printf("\nOutput formats:\n");
+  for (i = 0; i < (sizeof(output_format_resolutions) /
+    sizeof(output_format_resolutions[0])); i++) {
+    BenchmarkOutputFormats(output_format_resolutions + i, csv);
+  }
+  printf("\nColor encodings:\n");
+  for (i = 0; i < (sizeof(color_encoding_resolutions) /
+    sizeof(color_encoding_resolutions[0])); i++) {
+    BenchmarkColorEncodings(color_encoding_resolutions + i);
+  }
+  printf("\nFrame statistics:\n");
+  for (i = 0; i < (sizeof(statistics_resolutions) /
+    sizeof(statistics_resolutions[0])); i++) {
+    BenchmarkStatistics(statistics_resolutions + i, csv);
+  }
+  printf("\nIncremental conversion:\n");
+  for (i = 0; i < (sizeof(incremental_resolutions) /
+    sizeof(incremental_resolutions[0])); i++) {
+    BenchmarkIncremental(incremental_resolutions + i);
+  }
+  printf("\nParallel conversion scaling:\n");
+  for (i = 0; i < (sizeof(scaling_resolutions) /
+    sizeof(scaling_resolutions[0])); i++) {
+    if (!BenchmarkScaling(scaling_resolutions + i, max_threads)) {
+      result = 1;
+      goto done;
+    }
+  }
+done:
+  DestroyConversionPool(&pool);
+  free(eviction_buffer);
+  if (csv) fclose(csv);
+  return result;
+}
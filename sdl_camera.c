@@ -1,29 +1,96 @@
 // This is a simple program which will display webcam video in a window.
 //
 // Usage:
-//    ./sdl_camera <device path e.g. "/dev/video0">
+//    ./sdl_camera <device path e.g. "/dev/video0"> [<min width>x<min height>]
+//      [rgba | yuy2 | tiles]
+//
+// The camera mode with the highest frame rate that's at least the given
+// resolution is used. Without a minimum resolution, this is simply the
+// fastest mode.
+//
+// YUYV frames are normally uploaded to a YUY2 texture as they are, so the
+// renderer does the color conversion. Passing "rgba" converts them to RGBA on
+// the CPU instead, which is also what happens for other formats or if the
+// renderer can't create YUY2 textures. Passing "yuy2" makes it an error for
+// the YUY2 texture to be unavailable. Passing "tiles" also converts YUYV
+// frames on the CPU, but only the tiles that changed since the previous
+// frame, and uploads only those parts of the texture; this suits cameras
+// watching mostly static scenes. The CPU time spent per frame is printed on
+// exit, to compare the modes.
+//
+// Colors are decoded using the encoding the driver reports for the format.
+// SDL's renderers only handle BT.601 and BT.709 limited range and BT.601
+// full range, so frames in other encodings are converted on the CPU.
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <SDL2/SDL.h>
 #include <time.h>
-#include <unistd.h>
 #include "webcam_lib.h"
 
-// The number of webcam resolutions to enumerate when checking resolutions.
-#define MAX_RESOLUTION_COUNT (8)
+// The longest time, in nanoseconds, for the capture thread to wait for a
+// frame before checking whether it should exit.
+#define FRAME_WAIT_TIMEOUT_NS (50 * 1000 * 1000)
+
+// The mean difference per sample a tile must have, compared with when it was
+// last displayed, to be updated in the "tiles" display mode. This is enough
+// to ignore typical sensor noise.
+#define DIRTY_TILE_THRESHOLD (2)
 
-// The number of seconds to wait between attempting to poll for frames.
-#define SECONDS_PER_FRAME (1.0 / 10.0)
+// Selects how frames get into the texture.
+typedef enum {
+  // Use DISPLAY_YUY2 if possible, otherwise DISPLAY_RGBA.
+  DISPLAY_AUTO,
+  // Convert frames to RGBA on the CPU, writing directly into the texture.
+  DISPLAY_RGBA,
+  // Upload YUYV frames unmodified, leaving the conversion to the renderer.
+  DISPLAY_YUY2,
+  // Convert the tiles of YUYV frames that changed to RGBA on the CPU, in a
+  // staging buffer, and upload only the changed parts.
+  DISPLAY_TILES,
+} DisplayMode;
 
 static struct {
   WebcamInfo webcam;
   SDL_Window *window;
   SDL_Renderer *renderer;
   SDL_Texture *texture;
+  FrameConverter converter;
+  // The display mode requested on the command line, and the one in use once
+  // the texture has been created (never DISPLAY_AUTO).
+  DisplayMode requested_display;
+  DisplayMode display;
+  // The captured pixel format, and its color encoding.
+  uint32_t pixel_format;
+  ColorEncoding encoding;
   uint32_t w;
   uint32_t h;
+  // Used by DISPLAY_TILES. The staging buffer holds the whole RGBA image,
+  // since unchanged tiles are never converted again.
+  DirtyTileTracker tracker;
+  uint8_t *staging;
+  // Frames are handed from the capture thread to the render thread as
+  // handles from the pool. The capture thread publishes each frame it
+  // dequeues in newest_frame, replacing (and releasing) any frame the render
+  // thread hasn't picked up yet, so the render thread always gets the newest
+  // frame and never holds up capture. The render thread releases the frames
+  // it takes itself, which returns their buffers to the driver.
+  FramePool pool;
+  FrameHandle *newest_frame;
+  // The SDL event type the capture thread uses to wake the render thread.
+  uint32_t frame_event_type;
+  pthread_t capture_thread;
+  // Set by the render thread to stop the capture thread.
+  int quit;
+  // Set by the capture thread if it exits due to an error, along with
+  // capture_errno.
+  int capture_failed;
+  int capture_errno;
+  // Written by the capture thread, and only read after it has been joined.
+  unsigned long long skipped_count;
+  unsigned long long timeout_count;
 } g;
 
 static char* ErrorString(void) {
@@ -43,58 +110,55 @@ static void CleanupSDL(void) {
     SDL_DestroyTexture(g.texture);
     g.texture = NULL;
   }
+  if (g.staging) {
+    DestroyDirtyTileTracker(&(g.tracker));
+    free(g.staging);
+    g.staging = NULL;
+  }
 }
 
-// Returns the current system time in seconds. Exits if an error occurs while
-// getting the time.
+// Returns the current time in seconds. Exits if an error occurs while getting
+// the time.
 static double CurrentSeconds(void) {
   struct timespec ts;
-  if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
     printf("Error getting time.\n");
     exit(1);
   }
   return ((double) ts.tv_sec) + (((double) ts.tv_nsec) / 1e9);
 }
 
-// Sleeps for the given floating-point number of seconds.
-static void SleepSeconds(double to_sleep) {
-  if (to_sleep <= 0) return;
-  usleep(to_sleep * 1e6);
-}
-
-// Enumerates the resolutions provided by the webcam and selects the smallest
-// available one.
-static void SelectResolution(void) {
-  WebcamResolution resolutions[MAX_RESOLUTION_COUNT];
-  WebcamInfo *webcam = &(g.webcam);
-  int selected_index = -1;
-  int selected_size = 0x7fffffff;
-  int current_size, i;
-  memset(resolutions, 0, sizeof(resolutions));
-  if (!GetSupportedResolutions(webcam, resolutions, MAX_RESOLUTION_COUNT)) {
-    printf("Error getting supported resolutions: %s\n", ErrorString());
-    CloseWebcam(webcam);
+// Returns the CPU time used by the calling thread, or the whole process, in
+// nanoseconds. Exits if an error occurs while getting the time.
+static int64_t CPUTime(clockid_t clock) {
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) != 0) {
+    printf("Error getting CPU time.\n");
     exit(1);
   }
-  for (i = 0; i < MAX_RESOLUTION_COUNT; i++) {
-    current_size = resolutions[i].width * resolutions[i].height;
-    if (current_size == 0) break;
-    if (current_size > selected_size) continue;
-    selected_size = current_size;
-    selected_index = i;
-  }
-  if (selected_index < 0) {
-    printf("Error: Found no valid resolutions.\n");
-    CloseWebcam(webcam);
-    exit(1);
+  return ((int64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static const char* DisplayModeName(DisplayMode mode) {
+  switch (mode) {
+  case DISPLAY_AUTO:
+    return "auto";
+  case DISPLAY_RGBA:
+    return "RGBA (converted on the CPU)";
+  case DISPLAY_YUY2:
+    return "YUY2 (converted by the renderer)";
+  case DISPLAY_TILES:
+    return "RGBA (changed tiles converted on the CPU)";
   }
-  g.w = resolutions[selected_index].width;
-  g.h = resolutions[selected_index].height;
+  return "unknown";
 }
 
-// Initializes the webcam struct. Exits on error.
-static void SetupWebcam(char *path) {
+// Initializes the webcam struct, capturing in the fastest mode with at least
+// the given resolution. Exits on error.
+static void SetupWebcam(char *path, uint32_t min_width, uint32_t min_height) {
   WebcamInfo *webcam = &(g.webcam);
+  WebcamMode mode;
+  uint32_t numerator, denominator;
   if (!OpenWebcam(path, webcam)) {
     printf("Error opening webcam: %s\n", ErrorString());
     exit(1);
@@ -107,17 +171,65 @@ static void SetupWebcam(char *path) {
     printf("Error printing video format details: %s\n", ErrorString());
     goto error_exit;
   }
-  SelectResolution();
-  if (!SetResolution(webcam, g.w, g.h)) {
+  // Only consider modes in formats we can convert to the texture's RGBA
+  // format.
+  if (!SelectFastestMode(webcam, min_width, min_height, RGBA_FORMAT_CODE,
+    &mode)) {
+    printf("Error: found no mode of at least %dx%d that can be converted to "
+      "RGBA: %s\n", (int) min_width, (int) min_height, ErrorString());
+    goto error_exit;
+  }
+  SetPixelFormat(webcam, mode.pixel_format);
+  g.pixel_format = mode.pixel_format;
+  // Drivers without frame rate control still capture at their default rate.
+  if ((mode.interval_numerator != 0) && !SetFrameInterval(webcam,
+    mode.interval_numerator, mode.interval_denominator) &&
+    (errno != ENOTSUP)) {
+    printf("Error setting frame interval: %s\n", ErrorString());
+    goto error_exit;
+  }
+  if (!SetResolution(webcam, mode.resolution.width,
+    mode.resolution.height)) {
     printf("Error setting video resolution: %s\n", ErrorString());
     goto error_exit;
   }
+  // The color encoding is only known once the driver has accepted the format.
+  g.encoding = GetColorEncoding(webcam);
+  printf("Color encoding: %s, %s range.\n", ColorMatrixName(g.encoding.matrix),
+    ColorRangeName(g.encoding.range));
+  g.converter = GetFrameConverterForEncoding(mode.pixel_format,
+    RGBA_FORMAT_CODE, &(g.encoding));
+  // The driver may have adjusted the resolution and frame rate.
+  GetResolution(webcam, &g.w, &g.h);
+  if (!GetFrameInterval(webcam, &numerator, &denominator)) {
+    printf("Error getting frame interval: %s\n", ErrorString());
+    goto error_exit;
+  }
+  if (numerator != 0) {
+    printf("Capturing at %.2f FPS.\n", ((double) denominator) / numerator);
+  }
   return;
 error_exit:
   CloseWebcam(webcam);
   exit(1);
 }
 
+// Tells SDL how to decode the frames' YUV colors. Returns 0 if SDL doesn't
+// support the frames' color encoding.
+static int SetYUVConversionMode(void) {
+  if (g.encoding.matrix == COLOR_MATRIX_BT601) {
+    SDL_SetYUVConversionMode(g.encoding.range == COLOR_RANGE_FULL ?
+      SDL_YUV_CONVERSION_JPEG : SDL_YUV_CONVERSION_BT601);
+    return 1;
+  }
+  if ((g.encoding.matrix == COLOR_MATRIX_BT709) &&
+    (g.encoding.range == COLOR_RANGE_LIMITED)) {
+    SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_BT709);
+    return 1;
+  }
+  return 0;
+}
+
 // Once the webcam has been opened, call this to set up the SDL info necessary
 // for displaying the image.
 static void SetupSDL(void) {
@@ -138,8 +250,51 @@ static void SetupSDL(void) {
     printf("Failed creating SDL renderer: %s\n", SDL_GetError());
     goto error_exit;
   }
-  g.texture = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_RGBA8888,
-    SDL_TEXTUREACCESS_STREAMING, g.w, g.h);
+  g.display = DISPLAY_RGBA;
+  if (g.requested_display == DISPLAY_TILES) {
+    if (g.pixel_format != YUYV_FORMAT_CODE) {
+      printf("Error: tiles display requires a camera capturing YUYV "
+        "frames.\n");
+      goto error_exit;
+    }
+    g.staging = (uint8_t *) malloc(((size_t) g.w) * g.h * 4);
+    if (!g.staging) {
+      printf("Failed allocating the staging buffer.\n");
+      goto error_exit;
+    }
+    if (!CreateDirtyTileTracker(&(g.tracker), g.w, g.h, DIRTY_TILE_THRESHOLD,
+      &(g.encoding))) {
+      printf("Failed creating the dirty tile tracker: %s\n", ErrorString());
+      free(g.staging);
+      g.staging = NULL;
+      goto error_exit;
+    }
+    g.display = DISPLAY_TILES;
+  } else if ((g.requested_display != DISPLAY_RGBA) &&
+    (g.pixel_format == YUYV_FORMAT_CODE)) {
+    if (!SetYUVConversionMode()) {
+      printf("The renderer can't decode %s %s range colors.\n",
+        ColorMatrixName(g.encoding.matrix), ColorRangeName(g.encoding.range));
+    } else {
+      g.texture = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_YUY2,
+        SDL_TEXTUREACCESS_STREAMING, g.w, g.h);
+      if (g.texture) {
+        g.display = DISPLAY_YUY2;
+      } else {
+        printf("Failed creating YUY2 texture: %s\n", SDL_GetError());
+      }
+    }
+  }
+  if ((g.requested_display == DISPLAY_YUY2) && !g.texture) {
+    printf("Error: YUY2 display requires a renderer supporting YUY2 "
+      "textures and the camera's color encoding, and a camera capturing "
+      "YUYV frames.\n");
+    goto error_exit;
+  }
+  if (!g.texture) {
+    g.texture = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_RGBA8888,
+      SDL_TEXTUREACCESS_STREAMING, g.w, g.h);
+  }
   if (!g.texture) {
     printf("Failed getting SDL texture: %s\n", SDL_GetError());
     goto error_exit;
@@ -151,85 +306,284 @@ error_exit:
   exit(1);
 }
 
-// Copy images from the camera to the window, until an SDL quit event is
-// detected.
-static void MainLoop(void) {
+// Called on the capture thread. Publishes the frame as the newest one for the
+// render thread, and returns the frame it replaced, or NULL if the render
+// thread had already taken the previous one.
+static FrameHandle *PublishFrame(FrameHandle *handle) {
+  return __atomic_exchange_n(&(g.newest_frame), handle, __ATOMIC_ACQ_REL);
+}
+
+// Called on the render thread. Returns the newest published frame, or NULL if
+// no frame has been published since the last call. The caller must release
+// the frame.
+static FrameHandle *TakeNewestFrame(void) {
+  return __atomic_exchange_n(&(g.newest_frame), NULL, __ATOMIC_ACQ_REL);
+}
+
+// Wakes the render thread by sending it an SDL event. Returns 0 on error.
+static int WakeRenderThread(void) {
   SDL_Event event;
-  size_t frame_size = 0;
-  void *frame_bytes = NULL;
-  void *texture_pixels = NULL;
-  int texture_pitch = 0;
-  int quit = 0;
-  unsigned long long dropped_count = 0;
-  unsigned long long total_count = 0;
-  FrameBufferState frame_state;
-  double overall_start, last_frame_start;
-  WebcamInfo *webcam = &(g.webcam);
-  // Load the first frame and sleep for the duration of a full cycle in order
-  // to (hopefully) have a frame loaded on the first loop iteration.
-  if (!BeginLoadingNextFrame(webcam)) {
-    printf("Error loading initial frame: %s\n", ErrorString());
-    goto error_exit;
-  }
-  SleepSeconds(SECONDS_PER_FRAME);
-  last_frame_start = CurrentSeconds();
-  overall_start = last_frame_start;
-  while (!quit) {
-    total_count++;
-    while (SDL_PollEvent(&event)) {
-      if (event.type == SDL_QUIT) {
-        quit = 1;
-        break;
+  memset(&event, 0, sizeof(event));
+  event.type = g.frame_event_type;
+  return SDL_PushEvent(&event) >= 0;
+}
+
+// The capture thread's main loop: dequeues frames as soon as the driver
+// finishes them, and publishes them to the render thread. Runs until the quit
+// flag is set or an error occurs.
+static void *CaptureThread(void *arg) {
+  FrameBufferState state;
+  struct timespec buffer_wait = {0, 1000 * 1000};
+  FrameHandle *handle, *replaced;
+  while (!__atomic_load_n(&g.quit, __ATOMIC_ACQUIRE)) {
+    state = WaitForPoolFrame(&(g.pool), FRAME_WAIT_TIMEOUT_NS);
+    if (state == DEVICE_ERROR) {
+      // Every buffer is waiting to be displayed. This only happens if the
+      // driver provided very few buffers, and resolves itself once the render
+      // thread catches up.
+      if (errno == ENOBUFS) {
+        nanosleep(&buffer_wait, NULL);
+        continue;
       }
-    }
-    frame_state = GetFrameBuffer(webcam, &frame_bytes, &frame_size);
-    if (frame_state == DEVICE_ERROR) {
-      printf("Error getting frame from webcam: %s\n", ErrorString());
       goto error_exit;
     }
-    // Drop this frame if the frame isn't ready--don't update the display.
-    if (frame_state == FRAME_NOT_READY) {
-      dropped_count++;
-      // Sleep for the remaining time in this frame, then reset the sleep timer
-      SleepSeconds(SECONDS_PER_FRAME - (CurrentSeconds() - last_frame_start));
-      last_frame_start = CurrentSeconds();
+    if (state == FRAME_NOT_READY) {
+      g.timeout_count++;
       continue;
     }
-    // The device didn't give an error and the frame was ready, so we can now
-    // enqueue the next frame and update the displayed image.
-    if (!BeginLoadingNextFrame(webcam)) {
-      printf("Error getting webcam frame: %s\n", ErrorString());
-      goto error_exit;
-    }
-    // To re-draw the window, "lock" the texture, update its pixel data,
-    // "unlock" the texture, re-draw the texture, then re-draw the window.
-    if (SDL_LockTexture(g.texture, NULL, &texture_pixels, &texture_pitch)
-      < 0) {
-      printf("Error locking SDL texture: %s\n", SDL_GetError());
-      goto error_exit;
+    state = GetFrameHandle(&(g.pool), &handle);
+    if (state == DEVICE_ERROR) goto error_exit;
+    if (state == FRAME_NOT_READY) continue;
+    replaced = PublishFrame(handle);
+    if (replaced) {
+      // The render thread never saw the older frame, and doesn't need waking
+      // since it hasn't handled the previous wakeup yet.
+      if (!ReleaseFrameHandle(replaced)) goto error_exit;
+      g.skipped_count++;
+      continue;
     }
-    // The color conversion will write the RGBA pixel data directly into the
-    // texture's buffer.
-    if (!ConvertYUYVToRGBA(frame_bytes, texture_pixels, g.w, g.h, g.w * 2,
-      texture_pitch)) {
-      printf("Failed converting YUYV to RGBA color.\n");
+    if (!WakeRenderThread()) {
+      errno = EIO;
       goto error_exit;
     }
-    // Finalize the texture changes, re-draw the texture, re-draw the window
+  }
+  return NULL;
+error_exit:
+  g.capture_errno = errno;
+  __atomic_store_n(&g.capture_failed, 1, __ATOMIC_RELEASE);
+  // Wake the render thread so it notices the error.
+  WakeRenderThread();
+  return NULL;
+}
+
+// Stops the capture thread and waits for it to exit, then releases any frame
+// that was never displayed and destroys the frame pool.
+static void StopCaptureThread(void) {
+  FrameHandle *handle;
+  __atomic_store_n(&g.quit, 1, __ATOMIC_RELEASE);
+  pthread_join(g.capture_thread, NULL);
+  handle = TakeNewestFrame();
+  if (handle) ReleaseFrameHandle(handle);
+  DestroyFramePool(&(g.pool));
+}
+
+// Queues the capture buffers and starts the capture thread. Returns 0 on
+// error.
+static int StartCaptureThread(void) {
+  WebcamInfo *webcam = &(g.webcam);
+  int result;
+  g.frame_event_type = SDL_RegisterEvents(1);
+  if (g.frame_event_type == ((uint32_t) -1)) {
+    printf("Error registering SDL event: %s\n", SDL_GetError());
+    return 0;
+  }
+  // Queue up every capture buffer so the driver can start filling them.
+  if (!BeginLoadingNextFrame(webcam)) {
+    printf("Error loading initial frame: %s\n", ErrorString());
+    return 0;
+  }
+  if (!CreateFramePool(&(g.pool), webcam)) {
+    printf("Error creating frame pool: %s\n", ErrorString());
+    return 0;
+  }
+  result = pthread_create(&g.capture_thread, NULL, CaptureThread, NULL);
+  if (result != 0) {
+    printf("Error starting capture thread: %s\n", strerror(result));
+    DestroyFramePool(&(g.pool));
+    return 0;
+  }
+  return 1;
+}
+
+// Converts the frame to RGBA directly in the texture's buffer. Returns 0 on
+// error.
+static int ConvertToTexture(WebcamFrame *frame) {
+  void *texture_pixels = NULL;
+  int texture_pitch = 0;
+  // "Lock" the texture, update its pixel data, then "unlock" it.
+  if (SDL_LockTexture(g.texture, NULL, &texture_pixels, &texture_pitch)
+    < 0) {
+    printf("Error locking SDL texture: %s\n", SDL_GetError());
+    return 0;
+  }
+  if (!g.converter(frame->data, frame->size, texture_pixels, g.w, g.h,
+    GetBytesPerLine(&(g.webcam)), texture_pitch)) {
+    printf("Failed converting the frame to RGBA color.\n");
     SDL_UnlockTexture(g.texture);
-    if (SDL_RenderCopy(g.renderer, g.texture, NULL, NULL) < 0) {
-      printf("Error rendering texture: %s\n", SDL_GetError());
-      goto error_exit;
+    return 0;
+  }
+  SDL_UnlockTexture(g.texture);
+  return 1;
+}
+
+// Copies the YUYV frame into the texture unmodified, straight from the
+// capture buffer. Returns 0 on error.
+static int UploadToTexture(WebcamFrame *frame) {
+  if (SDL_UpdateTexture(g.texture, NULL, frame->data,
+    GetBytesPerLine(&(g.webcam))) < 0) {
+    printf("Error updating SDL texture: %s\n", SDL_GetError());
+    return 0;
+  }
+  return 1;
+}
+
+// Converts the tiles of the frame that changed into the staging buffer, and
+// uploads just those parts of it to the texture. Returns 0 on error.
+static int UpdateChangedTiles(WebcamFrame *frame) {
+  const FrameRegion *regions;
+  SDL_Rect rect;
+  int pitch = g.w * 4, count, i;
+  if (!ConvertYUYVToRGBAIncremental(&(g.tracker), frame->data, g.staging,
+    GetBytesPerLine(&(g.webcam)), pitch)) {
+    printf("Failed converting the frame's changed tiles to RGBA color.\n");
+    return 0;
+  }
+  count = GetDirtyRegions(&(g.tracker), &regions);
+  for (i = 0; i < count; i++) {
+    rect.x = regions[i].x;
+    rect.y = regions[i].y;
+    rect.w = regions[i].w;
+    rect.h = regions[i].h;
+    if (SDL_UpdateTexture(g.texture, &rect, g.staging + rect.y * pitch +
+      rect.x * 4, pitch) < 0) {
+      printf("Error updating SDL texture: %s\n", SDL_GetError());
+      return 0;
     }
-    SDL_RenderPresent(g.renderer);
-    // Finally, sleep for the remainder of the time in this frame.
-    SleepSeconds(SECONDS_PER_FRAME - (CurrentSeconds() - last_frame_start));
-    last_frame_start = CurrentSeconds();
-  }
-  printf("Attempted to display %llu frames in %f seconds (wanted %f FPS). "
-    "Dropped %llu.\n", total_count, CurrentSeconds() - overall_start,
-    1 / SECONDS_PER_FRAME, dropped_count);
+  }
+  return 1;
+}
+
+// Copies the frame into the texture and draws it. Releases the frame as soon
+// as it's been copied. The render thread's CPU time for the upload and for
+// the whole frame are recorded in upload_cpu and frame_cpu. Returns 0 on
+// error.
+static int DrawFrame(FrameHandle *handle, FrameLatencyStats *latency,
+    LatencyHistogram *upload_cpu, LatencyHistogram *frame_cpu) {
+  int64_t converted_ns, start_cpu_ns, uploaded_cpu_ns;
+  // The handle is reused for a new frame once it's released, so keep a copy
+  // of the timestamps.
+  WebcamFrame frame_copy = handle->frame;
+  WebcamFrame *frame = &frame_copy;
+  int result;
+  start_cpu_ns = CPUTime(CLOCK_THREAD_CPUTIME_ID);
+  if (g.display == DISPLAY_YUY2) {
+    result = UploadToTexture(frame);
+  } else if (g.display == DISPLAY_TILES) {
+    result = UpdateChangedTiles(frame);
+  } else {
+    result = ConvertToTexture(frame);
+  }
+  converted_ns = GetMonotonicTime();
+  uploaded_cpu_ns = CPUTime(CLOCK_THREAD_CPUTIME_ID);
+  // The frame has been copied out of the capture buffer, so the driver can
+  // start filling it again while we draw.
+  if (!ReleaseFrameHandle(handle)) {
+    printf("Error releasing frame: %s\n", ErrorString());
+    return 0;
+  }
+  if (!result) return 0;
+  // Re-draw the texture, then re-draw the window.
+  if (SDL_RenderCopy(g.renderer, g.texture, NULL, NULL) < 0) {
+    printf("Error rendering texture: %s\n", SDL_GetError());
+    return 0;
+  }
+  SDL_RenderPresent(g.renderer);
+  RecordFrameLatency(latency, frame, converted_ns, GetMonotonicTime());
+  RecordLatency(upload_cpu, uploaded_cpu_ns - start_cpu_ns);
+  RecordLatency(frame_cpu, CPUTime(CLOCK_THREAD_CPUTIME_ID) - start_cpu_ns);
+  return 1;
+}
+
+// Copy images from the camera to the window, until an SDL quit event is
+// detected. Capture runs on its own thread, so this only wakes up for window
+// events and new frames.
+static void MainLoop(void) {
+  SDL_Event event;
+  FrameHandle *handle;
+  FrameLatencyStats latency;
+  LatencyHistogram upload_cpu, frame_cpu;
+  int quit = 0;
+  unsigned long long displayed_count = 0;
+  double overall_start, elapsed;
+  int64_t process_cpu_ns;
+  WebcamInfo *webcam = &(g.webcam);
+  ResetFrameLatencyStats(&latency);
+  memset(&upload_cpu, 0, sizeof(upload_cpu));
+  memset(&frame_cpu, 0, sizeof(frame_cpu));
+  if (!StartCaptureThread()) goto error_exit;
+  overall_start = CurrentSeconds();
+  process_cpu_ns = CPUTime(CLOCK_PROCESS_CPUTIME_ID);
+  while (!quit) {
+    if (!SDL_WaitEvent(&event)) {
+      printf("Error waiting for SDL events: %s\n", SDL_GetError());
+      goto stop_capture;
+    }
+    do {
+      if (event.type == SDL_QUIT) quit = 1;
+    } while (SDL_PollEvent(&event));
+    if (quit) break;
+    if (__atomic_load_n(&g.capture_failed, __ATOMIC_ACQUIRE)) {
+      errno = g.capture_errno;
+      printf("Error capturing webcam frames: %s\n", ErrorString());
+      goto stop_capture;
+    }
+    // Several wakeups may have been handled at once above, but there's at
+    // most one frame to draw.
+    handle = TakeNewestFrame();
+    if (!handle) continue;
+    if (!DrawFrame(handle, &latency, &upload_cpu, &frame_cpu)) {
+      goto stop_capture;
+    }
+    displayed_count++;
+  }
+  elapsed = CurrentSeconds() - overall_start;
+  StopCaptureThread();
+  process_cpu_ns = CPUTime(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_ns;
+  printf("Displayed %llu frames in %f seconds (%f FPS). Timed out waiting "
+    "for a frame %llu times.\n", displayed_count, elapsed,
+    ((double) displayed_count) / elapsed, g.timeout_count);
+  printf("The driver dropped %llu frames, and %llu were skipped because a "
+    "newer frame was ready.\n",
+    (unsigned long long) GetDroppedFrameCount(webcam), g.skipped_count);
+  PrintFrameLatencyStats(&latency);
+  printf("CPU time per frame (ms):     p50      p99      max\n");
+  printf("  %-24s %8.3f %8.3f %8.3f\n", "texture upload",
+    GetLatencyPercentile(&upload_cpu, 50.0) / 1e6,
+    GetLatencyPercentile(&upload_cpu, 99.0) / 1e6, upload_cpu.max_ns / 1e6);
+  printf("  %-24s %8.3f %8.3f %8.3f\n", "render thread",
+    GetLatencyPercentile(&frame_cpu, 50.0) / 1e6,
+    GetLatencyPercentile(&frame_cpu, 99.0) / 1e6, frame_cpu.max_ns / 1e6);
+  if (displayed_count != 0) {
+    printf("The process used %.3f ms of CPU time per displayed frame, "
+      "including capture.\n", (process_cpu_ns / 1e6) / displayed_count);
+  }
+  if (g.display == DISPLAY_TILES) {
+    printf("%.1f%% of tiles were unchanged, and skipped.\n",
+      GetSkippedTileFraction(&(g.tracker)) * 100.0);
+  }
   return;
+stop_capture:
+  StopCaptureThread();
 error_exit:
   CloseWebcam(webcam);
   CleanupSDL();
@@ -237,14 +591,32 @@ error_exit:
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    printf("Usage: %s <device path e.g. \"/dev/video0\">\n", argv[0]);
+  unsigned int min_width = 0, min_height = 0;
+  DisplayMode display = DISPLAY_AUTO;
+  int i, usage_error = (argc < 2) || (argc > 4);
+  // The optional arguments may be given in either order.
+  for (i = 2; (i < argc) && !usage_error; i++) {
+    if (strcmp(argv[i], "rgba") == 0) {
+      display = DISPLAY_RGBA;
+    } else if (strcmp(argv[i], "yuy2") == 0) {
+      display = DISPLAY_YUY2;
+    } else if (strcmp(argv[i], "tiles") == 0) {
+      display = DISPLAY_TILES;
+    } else if (sscanf(argv[i], "%ux%u", &min_width, &min_height) != 2) {
+      usage_error = 1;
+    }
+  }
+  if (usage_error) {
+    printf("Usage: %s <device path e.g. \"/dev/video0\"> "
+      "[<min width>x<min height>] [rgba | yuy2 | tiles]\n", argv[0]);
     return 1;
   }
   memset(&g, 0, sizeof(g));
-  SetupWebcam(argv[1]);
+  g.requested_display = display;
+  SetupWebcam(argv[1], min_width, min_height);
   SetupSDL();
-  printf("Showing %dx%d video.\n", (int) g.w, (int) g.h);
+  printf("Showing %dx%d video, displayed as %s.\n", (int) g.w, (int) g.h,
+    DisplayModeName(g.display));
   MainLoop();
   CloseWebcam(&(g.webcam));
   CleanupSDL();
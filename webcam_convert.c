@@ -0,0 +1,3037 @@
+// This file implements the color conversion functions defined in
+// webcam_lib.h.
+//
+// Each conversion kernel is built around a function that converts a single
+// row of pixels, so the frame-level functions only need to walk the rows and
+// apply the input and output pitches. The SIMD kernels compute in 13-bit
+// fixed point and hand any leftover pixels at the end of a row to a scalar
+// function that performs exactly the same integer arithmetic, so a row's
+// output doesn't depend on where the vector loop stops. That scalar function
+// is also the CONVERSION_KERNEL_FIXED_POINT kernel; it looks up each sample's
+// contribution to each color channel in precomputed tables, so it doesn't need
+// floating point or a multiplier.
+//
+// Every row function that does color math is written once, as an
+// always-inline function taking the index of a color encoding, and compiled
+// into a separate copy for each encoding (see SPECIALIZE_FOR_ENCODINGS). Each
+// copy's coefficients are constants, so the inner loops are the same as if
+// they'd been written for a single encoding.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "webcam_lib.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+// The fixed-point coefficients are scaled by 2^FIXED_POINT_SHIFT. They must
+// fit in a signed 16-bit integer for the SIMD multiply-add instructions.
+#define FIXED_POINT_SHIFT (13)
+
+// Converts a coefficient to fixed point, rounding to nearest.
+#define TO_FIXED_POINT(c) ((int32_t) ((c) * (1 << FIXED_POINT_SHIFT) + \
+  (((c) < 0) ? -0.5 : 0.5)))
+
+// The number of combinations of ColorMatrix and ColorRange. Each combination
+// is identified by its index, matrix * COLOR_RANGE_COUNT + range.
+#define COLOR_ENCODING_COUNT (COLOR_MATRIX_COUNT * COLOR_RANGE_COUNT)
+
+// The index of BT.601 limited range, which the functions that don't take a
+// ColorEncoding use.
+#define DEFAULT_COLOR_ENCODING (0)
+
+// Holds the coefficients for converting one color encoding's samples to RGB.
+// luma_bias is subtracted from Y, and 128 from U and V, before multiplying.
+// The floating-point values are used by the reference kernel, and the rest
+// are the same values in fixed point.
+typedef struct {
+  int luma_bias;
+  double y;
+  double v_to_r;
+  double u_to_g;
+  double v_to_g;
+  double u_to_b;
+  int32_t fixed_y;
+  int32_t fixed_v_to_r;
+  int32_t fixed_u_to_g;
+  int32_t fixed_v_to_g;
+  int32_t fixed_u_to_b;
+} ColorCoefficients;
+
+#define COLOR_COEFFICIENTS(luma_bias, y, v_to_r, u_to_g, v_to_g, u_to_b) \
+  {luma_bias, y, v_to_r, u_to_g, v_to_g, u_to_b, TO_FIXED_POINT(y), \
+    TO_FIXED_POINT(v_to_r), TO_FIXED_POINT(u_to_g), TO_FIXED_POINT(v_to_g), \
+    TO_FIXED_POINT(u_to_b)}
+
+// The coefficients for each color encoding, indexed as described above. They
+// follow from each matrix's red and blue luma weights, rounded to three
+// decimal places; limited-range encodings also stretch Y from 16-235 and
+// chroma from 16-240 to the full 0-255 range. BT.601 limited range keeps the
+// commonly published values the library has always used, which differ from
+// the derived ones by 0.001 in two places.
+static const ColorCoefficients color_coefficients[COLOR_ENCODING_COUNT] = {
+  COLOR_COEFFICIENTS(16, 1.164, 1.596, -0.391, -0.813, 2.018),
+  COLOR_COEFFICIENTS(0, 1.0, 1.402, -0.344, -0.714, 1.772),
+  COLOR_COEFFICIENTS(16, 1.164, 1.793, -0.213, -0.533, 2.112),
+  COLOR_COEFFICIENTS(0, 1.0, 1.575, -0.187, -0.468, 1.856),
+  COLOR_COEFFICIENTS(16, 1.164, 1.679, -0.187, -0.650, 2.142),
+  COLOR_COEFFICIENTS(0, 1.0, 1.475, -0.165, -0.571, 1.881),
+};
+
+// Expands F once for each color encoding, passing the encoding's index
+// followed by the remaining arguments.
+#define FOR_EACH_COLOR_ENCODING(F, ...) F(0, __VA_ARGS__) F(1, __VA_ARGS__) \
+  F(2, __VA_ARGS__) F(3, __VA_ARGS__) F(4, __VA_ARGS__) F(5, __VA_ARGS__)
+_Static_assert(COLOR_ENCODING_COUNT == 6,
+  "FOR_EACH_COLOR_ENCODING must cover every color encoding");
+
+#define DEFINE_ENCODING_SPECIALIZATION(encoding, attributes, name, params, \
+    ...) \
+  attributes static void name##_##encoding params { \
+    name(__VA_ARGS__, encoding); \
+  }
+#define ENCODING_SPECIALIZATION_ENTRY(encoding, name) name##_##encoding,
+
+// Defines a copy of the always-inline function name for each color encoding,
+// which takes the given parameters and passes the given arguments on to name,
+// followed by the encoding's index. Also defines name##ForEncoding, an array
+// of the given function pointer type holding the copies. attributes must
+// include name's target attribute, if it has one, so it can be inlined.
+#define SPECIALIZE_FOR_ENCODINGS(type, attributes, name, params, ...) \
+  FOR_EACH_COLOR_ENCODING(DEFINE_ENCODING_SPECIALIZATION, attributes, name, \
+    params, __VA_ARGS__) \
+  static const type name##ForEncoding[COLOR_ENCODING_COUNT] = { \
+    FOR_EACH_COLOR_ENCODING(ENCODING_SPECIALIZATION_ENTRY, name) \
+  }
+
+// The lookup tables add CLAMP_TABLE_BIAS to every fixed-point sum, so the
+// shifted sums are always valid, non-negative indices into the clamp table.
+// The limits on the sums follow from the coefficients: none of them can be
+// below -293 or above 551 once shifted.
+#define CLAMP_TABLE_BIAS (512)
+#define CLAMP_TABLE_SIZE (1536)
+
+// Holds one color encoding's per-sample contributions to each color channel,
+// in fixed point.
+typedef struct {
+  int32_t luma[256];
+  int32_t v_to_r[256];
+  int32_t u_to_g[256];
+  int32_t v_to_g[256];
+  int32_t u_to_b[256];
+} FixedPointTables;
+
+static FixedPointTables fixed_tables[COLOR_ENCODING_COUNT];
+// Clamps the shifted sums to bytes.
+static uint8_t clamp_table[CLAMP_TABLE_SIZE];
+static pthread_once_t fixed_tables_once = PTHREAD_ONCE_INIT;
+
+// Fills in fixed_tables and clamp_table. Only call this through
+// InitFixedPointTables.
+static void BuildFixedPointTables(void) {
+  const ColorCoefficients *c;
+  FixedPointTables *t;
+  int encoding, i, v;
+  for (encoding = 0; encoding < COLOR_ENCODING_COUNT; encoding++) {
+    c = color_coefficients + encoding;
+    t = fixed_tables + encoding;
+    for (i = 0; i < 256; i++) {
+      t->luma[i] = c->fixed_y * (i - c->luma_bias) +
+        (CLAMP_TABLE_BIAS << FIXED_POINT_SHIFT);
+      t->v_to_r[i] = c->fixed_v_to_r * (i - 128);
+      t->u_to_g[i] = c->fixed_u_to_g * (i - 128);
+      t->v_to_g[i] = c->fixed_v_to_g * (i - 128);
+      t->u_to_b[i] = c->fixed_u_to_b * (i - 128);
+    }
+  }
+  for (i = 0; i < CLAMP_TABLE_SIZE; i++) {
+    v = i - CLAMP_TABLE_BIAS;
+    if (v < 0) v = 0;
+    if (v > 255) v = 255;
+    clamp_table[i] = v;
+  }
+}
+
+// Ensures the fixed-point tables have been built. This is cheap once the
+// tables exist, and must be called before converting any frame.
+static void InitFixedPointTables(void) {
+  pthread_once(&fixed_tables_once, BuildFixedPointTables);
+}
+
+// Returns the index of the given color encoding, or -1 if it isn't valid.
+static int ColorEncodingIndex(const ColorEncoding *encoding) {
+  if (((unsigned int) encoding->matrix >= COLOR_MATRIX_COUNT) ||
+    ((unsigned int) encoding->range >= COLOR_RANGE_COUNT)) {
+    return -1;
+  }
+  return encoding->matrix * COLOR_RANGE_COUNT + encoding->range;
+}
+
+// The encoding at DEFAULT_COLOR_ENCODING, for functions that accept a NULL
+// encoding.
+static const ColorEncoding default_color_encoding = {COLOR_MATRIX_BT601,
+  COLOR_RANGE_LIMITED};
+
+// Converts one row of w YUYV pixels to RGBA.
+typedef void (*RGBARowConverter)(const uint8_t *input, uint8_t *output,
+  int w);
+
+#define SPECIALIZE_RGBA_ROW_CONVERTER(attributes, name) \
+  SPECIALIZE_FOR_ENCODINGS(RGBARowConverter, attributes, name, \
+    (const uint8_t *input, uint8_t *output, int w), input, output, w)
+
+// Converts v to a byte, clamping it between 0 and 255.
+static uint8_t Clamp(float v) {
+  if (v < 0) return 0;
+  if (v > 255) return 255;
+  return (uint8_t) v;
+}
+
+// Reads the two pixels contained in the first four bytes of the input buffer
+// and writes the two pixels located in the first 8 bytes of the output vuffer.
+static inline __attribute__((always_inline)) void ConvertTwoPixels(
+    const uint8_t *input, uint8_t *output, const ColorCoefficients *c) {
+  float y_1, y_2, u, v;
+  uint8_t r1, g1, b1, r2, g2, b2;
+  y_1 = input[0];
+  u = input[1];
+  y_2 = input[2];
+  v = input[3];
+  r1 = Clamp(c->y * (y_1 - c->luma_bias) + c->v_to_r * (v - 128));
+  g1 = Clamp(c->y * (y_1 - c->luma_bias) + c->v_to_g * (v - 128) +
+    c->u_to_g * (u - 128));
+  b1 = Clamp(c->y * (y_1 - c->luma_bias) + c->u_to_b * (u - 128));
+  r2 = Clamp(c->y * (y_2 - c->luma_bias) + c->v_to_r * (v - 128));
+  g2 = Clamp(c->y * (y_2 - c->luma_bias) + c->v_to_g * (v - 128) +
+    c->u_to_g * (u - 128));
+  b2 = Clamp(c->y * (y_2 - c->luma_bias) + c->u_to_b * (u - 128));
+  output[0] = 0xff;
+  output[1] = b1;
+  output[2] = g1;
+  output[3] = r1;
+  output[4] = 0xff;
+  output[5] = b2;
+  output[6] = g2;
+  output[7] = r2;
+}
+
+// Writes a single RGBA pixel with the given luma and chroma, using the tables
+// for one color encoding. Shifting the biased sums rounds toward negative
+// infinity, like the SIMD kernels' shifts, and the clamp table saturates them
+// the same way the SIMD packs do.
+static inline void WriteFixedPixel(const FixedPointTables *t, int y, int u,
+    int v, uint8_t *output) {
+  int32_t luma = t->luma[y];
+  output[0] = 0xff;
+  output[1] = clamp_table[(luma + t->u_to_b[u]) >> FIXED_POINT_SHIFT];
+  output[2] = clamp_table[(luma + t->u_to_g[u] + t->v_to_g[v]) >>
+    FIXED_POINT_SHIFT];
+  output[3] = clamp_table[(luma + t->v_to_r[v]) >> FIXED_POINT_SHIFT];
+}
+
+// Converts the last pixel in a row with an odd width. YUYV stores chroma for
+// pairs of pixels, so a lone pixel borrows the V sample of the preceding pair
+// if there is one and is otherwise treated as having neutral chroma.
+static void ConvertLonePixelFixed(const FixedPointTables *t,
+    const uint8_t *input, uint8_t *output, int has_previous_pair) {
+  int v = has_previous_pair ? input[-1] : 128;
+  WriteFixedPixel(t, input[0], input[1], v, output);
+}
+
+// Converts w pixels of a row using the scalar fixed-point code. This is used
+// for whatever the SIMD kernels leave over at the end of each row.
+// has_previous_pair must be nonzero if input isn't the start of the row.
+static inline void ConvertRowTailFixed(const FixedPointTables *t,
+    const uint8_t *input, uint8_t *output, int w, int has_previous_pair) {
+  int x;
+  for (x = 0; (x + 1) < w; x += 2) {
+    WriteFixedPixel(t, input[0], input[1], input[3], output);
+    WriteFixedPixel(t, input[2], input[1], input[3], output + 4);
+    input += 4;
+    output += 8;
+    has_previous_pair = 1;
+  }
+  if (x < w) ConvertLonePixelFixed(t, input, output, has_previous_pair);
+}
+
+static inline __attribute__((always_inline)) void ConvertRowFixed(
+    const uint8_t *input, uint8_t *output, int w, int encoding) {
+  ConvertRowTailFixed(fixed_tables + encoding, input, output, w, 0);
+}
+
+SPECIALIZE_RGBA_ROW_CONVERTER(, ConvertRowFixed);
+
+// Copies the Y samples out of a row of w YUYV pixels, producing one byte per
+// pixel.
+typedef void (*LumaRowConverter)(const uint8_t *input, uint8_t *output,
+  int w);
+
+static void ExtractLumaRow(const uint8_t *input, uint8_t *output, int w) {
+  int x;
+  for (x = 0; x < w; x++) {
+    output[x] = input[x * 2];
+  }
+}
+
+// Returns the sum of the Y samples of w YUYV pixels. This is used for the
+// per-tile means in FrameStatistics.
+typedef uint32_t (*LumaSummer)(const uint8_t *input, int w);
+
+static uint32_t SumRowLuma(const uint8_t *input, int w) {
+  uint32_t sum = 0;
+  int x;
+  for (x = 0; x < w; x++) {
+    sum += input[x * 2];
+  }
+  return sum;
+}
+
+// Returns the sum of the absolute differences between two rows of bytes. This
+// is used to find the tiles that changed between frames.
+typedef uint32_t (*RowDifferencer)(const uint8_t *a, const uint8_t *b,
+  int bytes);
+
+static uint32_t SumRowDifferences(const uint8_t *a, const uint8_t *b,
+    int bytes) {
+  uint32_t sum = 0;
+  int i;
+  for (i = 0; i < bytes; i++) {
+    sum += (a[i] > b[i]) ? (a[i] - b[i]) : (b[i] - a[i]);
+  }
+  return sum;
+}
+
+// Sums each of the first bytes columns over rows rows of the input, which
+// are input_pitch bytes apart, storing the 16-bit totals in sums. This is the
+// vertical half of a downscaled conversion. rows is at most
+// MAX_DOWNSCALE_FACTOR, so the totals can't overflow.
+typedef void (*ColumnSummer)(const uint8_t *input, int input_pitch, int rows,
+  uint16_t *sums, int bytes);
+
+// restrict tells the compiler the byte input can't alias the sums, so it can
+// vectorize the loops over each row.
+static void SumColumns(const uint8_t *restrict input, int input_pitch,
+    int rows, uint16_t *restrict sums, int bytes) {
+  int i, row;
+  for (i = 0; i < bytes; i++) {
+    sums[i] = input[i];
+  }
+  for (row = 1; row < rows; row++) {
+    input += input_pitch;
+    for (i = 0; i < bytes; i++) {
+      sums[i] += input[i];
+    }
+  }
+}
+
+// Returns the rounded average of a block's samples, given their sum. When
+// factor is a compile-time constant, the division is by a constant, so the
+// compiler replaces it with a multiply or shift.
+static inline __attribute__((always_inline)) int BlockAverage(uint32_t sum,
+    int factor, uint64_t reciprocal) {
+  uint32_t area = factor * factor;
+  if (__builtin_constant_p(area)) return (sum + area / 2) / area;
+  return (int) (((sum + area / 2) * reciprocal) >> 32);
+}
+
+// Averages each of count blocks of whole YUYV pixel pairs, factor / 2 pairs
+// wide, in the 16-bit column sums of a downscaled conversion, storing each
+// block's average Y, U and V samples. Both pixels of a pair share its chroma,
+// so a block's U and V sums count each pair's samples twice. reciprocal is
+// the one BlockAverage takes, and factor must be even and above 2.
+typedef void (*PairBlockReducer)(const uint16_t *sums, int factor,
+  uint64_t reciprocal, uint8_t *y, uint8_t *u, uint8_t *v, int count);
+
+static void ReducePairBlocks(const uint16_t *sums, int factor,
+    uint64_t reciprocal, uint8_t *y, uint8_t *u, uint8_t *v, int count) {
+  uint32_t y_sum, u_sum, v_sum;
+  int i, k;
+  for (i = 0; i < count; i++) {
+    y_sum = 0;
+    u_sum = 0;
+    v_sum = 0;
+    for (k = 0; k < (factor / 2); k++) {
+      y_sum += sums[0] + sums[2];
+      u_sum += sums[1];
+      v_sum += sums[3];
+      sums += 4;
+    }
+    y[i] = BlockAverage(y_sum, factor, reciprocal);
+    u[i] = BlockAverage(u_sum * 2, factor, reciprocal);
+    v[i] = BlockAverage(v_sum * 2, factor, reciprocal);
+  }
+}
+
+// Averages the chroma of two YUYV rows holding the given number of pixel
+// pairs, producing one U and one V sample per pair, for 4:2:0 output. The
+// average rounds up, like the SIMD average instructions. The I420 versions
+// write the U and V samples to separate rows, while the NV12 versions write
+// them interleaved to u and ignore v.
+typedef void (*ChromaRowConverter)(const uint8_t *first_row,
+  const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs);
+
+static void AverageChromaRowI420(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  int x;
+  for (x = 0; x < pairs; x++) {
+    u[x] = (first_row[1] + second_row[1] + 1) >> 1;
+    v[x] = (first_row[3] + second_row[3] + 1) >> 1;
+    first_row += 4;
+    second_row += 4;
+  }
+}
+
+static void AverageChromaRowNV12(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  int x;
+  for (x = 0; x < pairs; x++) {
+    u[x * 2] = (first_row[1] + second_row[1] + 1) >> 1;
+    u[x * 2 + 1] = (first_row[3] + second_row[3] + 1) >> 1;
+    first_row += 4;
+    second_row += 4;
+  }
+}
+
+// Converts w pixels whose Y, U and V samples are in separate arrays, with
+// one of each per pixel. This is used after operations like downscaling,
+// which leave every pixel with its own chroma.
+typedef void (*YUVPixelConverter)(const uint8_t *y, const uint8_t *u,
+  const uint8_t *v, uint8_t *output, int w);
+
+#define SPECIALIZE_YUV_PIXEL_CONVERTER(attributes, name) \
+  SPECIALIZE_FOR_ENCODINGS(YUVPixelConverter, attributes, name, \
+    (const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *output, \
+    int w), y, u, v, output, w)
+
+static inline void ConvertYUVPixelsTailFixed(const FixedPointTables *t,
+    const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *output,
+    int w) {
+  int x;
+  for (x = 0; x < w; x++) {
+    WriteFixedPixel(t, y[x], u[x], v[x], output + x * 4);
+  }
+}
+
+static inline __attribute__((always_inline)) void ConvertYUVPixelsFixed(
+    const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *output,
+    int w, int encoding) {
+  ConvertYUVPixelsTailFixed(fixed_tables + encoding, y, u, v, output, w);
+}
+
+SPECIALIZE_YUV_PIXEL_CONVERTER(, ConvertYUVPixelsFixed);
+
+// Converts two YUYV rows, starting on a pixel pair, to one RGBA row of half
+// the width, where each output pixel is the rounded average of a 2x2 block.
+// A block is one pixel pair in each row, so its average chroma is just the
+// average of the two rows' chroma samples.
+typedef void (*HalvingRowConverter)(const uint8_t *first_row,
+  const uint8_t *second_row, uint8_t *output, int output_w);
+
+#define SPECIALIZE_HALVING_ROW_CONVERTER(attributes, name) \
+  SPECIALIZE_FOR_ENCODINGS(HalvingRowConverter, attributes, name, \
+    (const uint8_t *first_row, const uint8_t *second_row, uint8_t *output, \
+    int output_w), first_row, second_row, output, output_w)
+
+static inline void HalveRowTailFixed(const FixedPointTables *t,
+    const uint8_t *first_row, const uint8_t *second_row, uint8_t *output,
+    int output_w) {
+  int x, y;
+  for (x = 0; x < output_w; x++) {
+    y = (first_row[0] + first_row[2] + second_row[0] + second_row[2] + 2) >>
+      2;
+    WriteFixedPixel(t, y, (first_row[1] + second_row[1] + 1) >> 1,
+      (first_row[3] + second_row[3] + 1) >> 1, output);
+    first_row += 4;
+    second_row += 4;
+    output += 4;
+  }
+}
+
+static inline __attribute__((always_inline)) void HalveRowFixed(
+    const uint8_t *first_row, const uint8_t *second_row, uint8_t *output,
+    int output_w, int encoding) {
+  HalveRowTailFixed(fixed_tables + encoding, first_row, second_row, output,
+    output_w);
+}
+
+SPECIALIZE_HALVING_ROW_CONVERTER(, HalveRowFixed);
+
+// Converts four YUYV rows, input_pitch bytes apart and starting on a pixel
+// pair, to one RGBA row of a quarter of the width, where each output pixel is
+// the rounded average of a 4x4 block. A block is two pixel pairs in each row,
+// and both pixels of a pair share its chroma, so the block's average chroma
+// is the average of its eight U (or V) samples.
+typedef void (*QuarteringRowConverter)(const uint8_t *input, int input_pitch,
+  uint8_t *output, int output_w);
+
+#define SPECIALIZE_QUARTERING_ROW_CONVERTER(attributes, name) \
+  SPECIALIZE_FOR_ENCODINGS(QuarteringRowConverter, attributes, name, \
+    (const uint8_t *input, int input_pitch, uint8_t *output, int output_w), \
+    input, input_pitch, output, output_w)
+
+static inline void QuarterRowTailFixed(const FixedPointTables *t,
+    const uint8_t *input, int input_pitch, uint8_t *output, int output_w) {
+  const uint8_t *row;
+  int x, i, y_sum, u_sum, v_sum;
+  for (x = 0; x < output_w; x++) {
+    y_sum = 0;
+    u_sum = 0;
+    v_sum = 0;
+    row = input;
+    for (i = 0; i < 4; i++) {
+      y_sum += row[0] + row[2] + row[4] + row[6];
+      u_sum += row[1] + row[5];
+      v_sum += row[3] + row[7];
+      row += input_pitch;
+    }
+    WriteFixedPixel(t, (y_sum + 8) >> 4, (u_sum + 4) >> 3, (v_sum + 4) >> 3,
+      output);
+    input += 8;
+    output += 4;
+  }
+}
+
+static inline __attribute__((always_inline)) void QuarterRowFixed(
+    const uint8_t *input, int input_pitch, uint8_t *output, int output_w,
+    int encoding) {
+  QuarterRowTailFixed(fixed_tables + encoding, input, input_pitch, output,
+    output_w);
+}
+
+SPECIALIZE_QUARTERING_ROW_CONVERTER(, QuarterRowFixed);
+
+// Converts a row using the original floating-point code.
+static inline __attribute__((always_inline)) void ConvertRowReference(
+    const uint8_t *input, uint8_t *output, int w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  int x;
+  uint8_t last_pair[8];
+  for (x = 0; (x + 1) < w; x += 2) {
+    ConvertTwoPixels(input, output, c);
+    input += 4;
+    output += 8;
+  }
+  if (x >= w) return;
+  // Avoid reading or writing past the end of a row with an odd width.
+  memset(last_pair, 0, sizeof(last_pair));
+  last_pair[0] = input[0];
+  last_pair[1] = input[1];
+  last_pair[3] = (x > 0) ? input[-1] : 128;
+  ConvertTwoPixels(last_pair, last_pair, c);
+  memcpy(output, last_pair, 4);
+}
+
+SPECIALIZE_RGBA_ROW_CONVERTER(, ConvertRowReference);
+
+#ifdef X86_KERNELS
+
+// Builds a 32-bit vector lane holding two signed 16-bit values, with low in
+// the lower half. This matches the operand layout of _mm_madd_epi16.
+#define COEFFICIENT_PAIR(low, high) ((int32_t) ((((uint32_t) (high)) << 16) | \
+  (((uint32_t) (low)) & 0xffff)))
+
+// The bias subtracted from each (Y, U) or (Y, V) pair of samples.
+#define BIAS_PAIR(c) COEFFICIENT_PAIR((c)->luma_bias, 128)
+
+// Takes pairs of (Y, V) and (Y, U) samples for four pixels, as 16-bit values
+// with the bias already subtracted, and returns the four pixels' R, G and B
+// values as 32-bit integers in 13-bit fixed point.
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void ComputeRGBSSE2(__m128i yv,
+    __m128i yu, __m128i *r, __m128i *g, __m128i *b,
+    const ColorCoefficients *c) {
+  const __m128i yv_to_r = _mm_set1_epi32(COEFFICIENT_PAIR(c->fixed_y,
+    c->fixed_v_to_r));
+  const __m128i yu_to_g = _mm_set1_epi32(COEFFICIENT_PAIR(c->fixed_y,
+    c->fixed_u_to_g));
+  const __m128i v_to_g = _mm_set1_epi32(COEFFICIENT_PAIR(0,
+    c->fixed_v_to_g));
+  const __m128i yu_to_b = _mm_set1_epi32(COEFFICIENT_PAIR(c->fixed_y,
+    c->fixed_u_to_b));
+  *r = _mm_srai_epi32(_mm_madd_epi16(yv, yv_to_r), FIXED_POINT_SHIFT);
+  *g = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu, yu_to_g),
+    _mm_madd_epi16(yv, v_to_g)), FIXED_POINT_SHIFT);
+  *b = _mm_srai_epi32(_mm_madd_epi16(yu, yu_to_b), FIXED_POINT_SHIFT);
+}
+
+// Takes the R, G and B values for eight pixels as 32-bit integers, split
+// across two vectors of four pixels each, and writes the 32 bytes of
+// A, B, G, R output for the eight pixels.
+__attribute__((target("sse2")))
+static inline void StoreEightPixelsSSE2(__m128i r_lo, __m128i r_hi,
+    __m128i g_lo, __m128i g_hi, __m128i b_lo, __m128i b_hi,
+    uint8_t *output) {
+  const __m128i alpha = _mm_set1_epi16(0xff);
+  __m128i bg, ar, ab, gr;
+  // The saturating packs clamp each value to a byte. bg holds the eight blue
+  // bytes followed by the eight green bytes, and ar the same for alpha/red.
+  bg = _mm_packus_epi16(_mm_packs_epi32(b_lo, b_hi),
+    _mm_packs_epi32(g_lo, g_hi));
+  ar = _mm_packus_epi16(alpha, _mm_packs_epi32(r_lo, r_hi));
+  ab = _mm_unpacklo_epi8(ar, bg);
+  gr = _mm_unpackhi_epi8(bg, ar);
+  _mm_storeu_si128((__m128i *) output, _mm_unpacklo_epi16(ab, gr));
+  _mm_storeu_si128((__m128i *) (output + 16), _mm_unpackhi_epi16(ab, gr));
+}
+
+// Converts the eight pixels in the 16 bytes at input.
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void ConvertEightPixelsSSE2(
+    const uint8_t *input, uint8_t *output, const ColorCoefficients *c) {
+  const __m128i bias = _mm_set1_epi32(BIAS_PAIR(c));
+  const __m128i zero = _mm_setzero_si128();
+  __m128i yuyv, lo, hi, yv, yu;
+  __m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+  yuyv = _mm_loadu_si128((const __m128i *) input);
+  lo = _mm_sub_epi16(_mm_unpacklo_epi8(yuyv, zero), bias);
+  hi = _mm_sub_epi16(_mm_unpackhi_epi8(yuyv, zero), bias);
+  // Each 64 bits now holds Y0, U, Y1, V for a pair of pixels. Rearrange them
+  // into Y0, V, Y1, V and Y0, U, Y1, U for the multiply-adds.
+  yv = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 2, 3, 0)),
+    _MM_SHUFFLE(3, 2, 3, 0));
+  yu = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(1, 2, 1, 0)),
+    _MM_SHUFFLE(1, 2, 1, 0));
+  ComputeRGBSSE2(yv, yu, &r_lo, &g_lo, &b_lo, c);
+  yv = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 2, 3, 0)),
+    _MM_SHUFFLE(3, 2, 3, 0));
+  yu = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(1, 2, 1, 0)),
+    _MM_SHUFFLE(1, 2, 1, 0));
+  ComputeRGBSSE2(yv, yu, &r_hi, &g_hi, &b_hi, c);
+  StoreEightPixelsSSE2(r_lo, r_hi, g_lo, g_hi, b_lo, b_hi, output);
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void ConvertRowSSE2(
+    const uint8_t *input, uint8_t *output, int w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  int x;
+  for (x = 0; (x + 16) <= w; x += 16) {
+    ConvertEightPixelsSSE2(input, output, c);
+    ConvertEightPixelsSSE2(input + 16, output + 32, c);
+    input += 32;
+    output += 64;
+  }
+  ConvertRowTailFixed(fixed_tables + encoding, input, output, w - x, x > 0);
+}
+
+SPECIALIZE_RGBA_ROW_CONVERTER(__attribute__((target("sse2"))),
+  ConvertRowSSE2);
+
+// Byte shuffles turning 16 bytes of YUYV into the zero-extended (Y, V) and
+// (Y, U) pairs for the first four pixels (the LO masks) or the last four (the
+// HI masks). An index of -1 produces a 0 byte.
+#define YV_SHUFFLE_LO 0, -1, 3, -1, 2, -1, 3, -1, 4, -1, 7, -1, 6, -1, 7, -1
+#define YV_SHUFFLE_HI 8, -1, 11, -1, 10, -1, 11, -1, 12, -1, 15, -1, 14, -1, \
+  15, -1
+#define YU_SHUFFLE_LO 0, -1, 1, -1, 2, -1, 1, -1, 4, -1, 5, -1, 6, -1, 5, -1
+#define YU_SHUFFLE_HI 8, -1, 9, -1, 10, -1, 9, -1, 12, -1, 13, -1, 14, -1, \
+  13, -1
+
+// Converts the eight pixels in the 16 bytes at input. This is the same as the
+// SSE2 version, but uses byte shuffles to unpack the samples.
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) void ConvertEightPixelsSSSE3(
+    const uint8_t *input, uint8_t *output, const ColorCoefficients *c) {
+  const __m128i bias = _mm_set1_epi32(BIAS_PAIR(c));
+  const __m128i yv_lo_shuffle = _mm_setr_epi8(YV_SHUFFLE_LO);
+  const __m128i yv_hi_shuffle = _mm_setr_epi8(YV_SHUFFLE_HI);
+  const __m128i yu_lo_shuffle = _mm_setr_epi8(YU_SHUFFLE_LO);
+  const __m128i yu_hi_shuffle = _mm_setr_epi8(YU_SHUFFLE_HI);
+  __m128i yuyv, yv, yu;
+  __m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+  yuyv = _mm_loadu_si128((const __m128i *) input);
+  yv = _mm_sub_epi16(_mm_shuffle_epi8(yuyv, yv_lo_shuffle), bias);
+  yu = _mm_sub_epi16(_mm_shuffle_epi8(yuyv, yu_lo_shuffle), bias);
+  ComputeRGBSSE2(yv, yu, &r_lo, &g_lo, &b_lo, c);
+  yv = _mm_sub_epi16(_mm_shuffle_epi8(yuyv, yv_hi_shuffle), bias);
+  yu = _mm_sub_epi16(_mm_shuffle_epi8(yuyv, yu_hi_shuffle), bias);
+  ComputeRGBSSE2(yv, yu, &r_hi, &g_hi, &b_hi, c);
+  StoreEightPixelsSSE2(r_lo, r_hi, g_lo, g_hi, b_lo, b_hi, output);
+}
+
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) void ConvertRowSSSE3(
+    const uint8_t *input, uint8_t *output, int w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  int x;
+  for (x = 0; (x + 16) <= w; x += 16) {
+    ConvertEightPixelsSSSE3(input, output, c);
+    ConvertEightPixelsSSSE3(input + 16, output + 32, c);
+    input += 32;
+    output += 64;
+  }
+  ConvertRowTailFixed(fixed_tables + encoding, input, output, w - x, x > 0);
+}
+
+SPECIALIZE_RGBA_ROW_CONVERTER(__attribute__((target("ssse3"))),
+  ConvertRowSSSE3);
+
+// The AVX2 equivalent of ComputeRGBSSE2, operating on eight pixels at once.
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void ComputeRGBAVX2(__m256i yv,
+    __m256i yu, __m256i *r, __m256i *g, __m256i *b,
+    const ColorCoefficients *c) {
+  const __m256i yv_to_r = _mm256_set1_epi32(COEFFICIENT_PAIR(c->fixed_y,
+    c->fixed_v_to_r));
+  const __m256i yu_to_g = _mm256_set1_epi32(COEFFICIENT_PAIR(c->fixed_y,
+    c->fixed_u_to_g));
+  const __m256i v_to_g = _mm256_set1_epi32(COEFFICIENT_PAIR(0,
+    c->fixed_v_to_g));
+  const __m256i yu_to_b = _mm256_set1_epi32(COEFFICIENT_PAIR(c->fixed_y,
+    c->fixed_u_to_b));
+  *r = _mm256_srai_epi32(_mm256_madd_epi16(yv, yv_to_r), FIXED_POINT_SHIFT);
+  *g = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yu, yu_to_g),
+    _mm256_madd_epi16(yv, v_to_g)), FIXED_POINT_SHIFT);
+  *b = _mm256_srai_epi32(_mm256_madd_epi16(yu, yu_to_b), FIXED_POINT_SHIFT);
+}
+
+// Takes the R, G and B values for 16 pixels as 32-bit integers, where the lo
+// vectors hold pixels 0-3 and 8-11 and the hi vectors hold pixels 4-7 and
+// 12-15, and writes the 64 bytes of A, B, G, R output for the 16 pixels.
+__attribute__((target("avx2")))
+static inline void StoreSixteenPixelsAVX2(__m256i r_lo, __m256i r_hi,
+    __m256i g_lo, __m256i g_hi, __m256i b_lo, __m256i b_hi,
+    uint8_t *output) {
+  const __m256i alpha = _mm256_set1_epi16(0xff);
+  __m256i bg, ar, ab, gr, first, second;
+  bg = _mm256_packus_epi16(_mm256_packs_epi32(b_lo, b_hi),
+    _mm256_packs_epi32(g_lo, g_hi));
+  ar = _mm256_packus_epi16(alpha, _mm256_packs_epi32(r_lo, r_hi));
+  ab = _mm256_unpacklo_epi8(ar, bg);
+  gr = _mm256_unpackhi_epi8(bg, ar);
+  // first holds pixels 0-3 and 8-11, second holds pixels 4-7 and 12-15.
+  first = _mm256_unpacklo_epi16(ab, gr);
+  second = _mm256_unpackhi_epi16(ab, gr);
+  _mm256_storeu_si256((__m256i *) output, _mm256_permute2x128_si256(first,
+    second, 0x20));
+  _mm256_storeu_si256((__m256i *) (output + 32),
+    _mm256_permute2x128_si256(first, second, 0x31));
+}
+
+// Converts the 16 pixels in the 32 bytes at input. AVX2 shuffles and packs
+// only operate within 128-bit lanes, so this works like two side-by-side
+// copies of the SSSE3 code: the low lane holds pixels 0-7 and the high lane
+// holds pixels 8-15 until the lanes are recombined at the end.
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void ConvertSixteenPixelsAVX2(
+    const uint8_t *input, uint8_t *output, const ColorCoefficients *c) {
+  const __m256i bias = _mm256_set1_epi32(BIAS_PAIR(c));
+  const __m256i yv_lo_shuffle = _mm256_setr_epi8(YV_SHUFFLE_LO,
+    YV_SHUFFLE_LO);
+  const __m256i yv_hi_shuffle = _mm256_setr_epi8(YV_SHUFFLE_HI,
+    YV_SHUFFLE_HI);
+  const __m256i yu_lo_shuffle = _mm256_setr_epi8(YU_SHUFFLE_LO,
+    YU_SHUFFLE_LO);
+  const __m256i yu_hi_shuffle = _mm256_setr_epi8(YU_SHUFFLE_HI,
+    YU_SHUFFLE_HI);
+  __m256i yuyv, yv, yu;
+  __m256i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+  yuyv = _mm256_loadu_si256((const __m256i *) input);
+  yv = _mm256_sub_epi16(_mm256_shuffle_epi8(yuyv, yv_lo_shuffle), bias);
+  yu = _mm256_sub_epi16(_mm256_shuffle_epi8(yuyv, yu_lo_shuffle), bias);
+  ComputeRGBAVX2(yv, yu, &r_lo, &g_lo, &b_lo, c);
+  yv = _mm256_sub_epi16(_mm256_shuffle_epi8(yuyv, yv_hi_shuffle), bias);
+  yu = _mm256_sub_epi16(_mm256_shuffle_epi8(yuyv, yu_hi_shuffle), bias);
+  ComputeRGBAVX2(yv, yu, &r_hi, &g_hi, &b_hi, c);
+  StoreSixteenPixelsAVX2(r_lo, r_hi, g_lo, g_hi, b_lo, b_hi, output);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void ConvertRowAVX2(
+    const uint8_t *input, uint8_t *output, int w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  int x;
+  for (x = 0; (x + 32) <= w; x += 32) {
+    ConvertSixteenPixelsAVX2(input, output, c);
+    ConvertSixteenPixelsAVX2(input + 32, output + 64, c);
+    input += 64;
+    output += 128;
+  }
+  ConvertRowTailFixed(fixed_tables + encoding, input, output, w - x, x > 0);
+}
+
+SPECIALIZE_RGBA_ROW_CONVERTER(__attribute__((target("avx2"))),
+  ConvertRowAVX2);
+
+// Converts eight pixels at a time from separate Y, U and V samples. Unpacking
+// Y with V and Y with U directly produces the (Y, V) and (Y, U) pairs that
+// ComputeRGBSSE2 takes.
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void ConvertYUVPixelsSSE2(
+    const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *output,
+    int w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i luma_bias = _mm_set1_epi16(c->luma_bias);
+  const __m128i chroma_bias = _mm_set1_epi16(128);
+  __m128i y16, u16, v16;
+  __m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+  int x;
+  for (x = 0; (x + 8) <= w; x += 8) {
+    y16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)
+      (y + x)), zero), luma_bias);
+    u16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)
+      (u + x)), zero), chroma_bias);
+    v16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)
+      (v + x)), zero), chroma_bias);
+    ComputeRGBSSE2(_mm_unpacklo_epi16(y16, v16), _mm_unpacklo_epi16(y16, u16),
+      &r_lo, &g_lo, &b_lo, c);
+    ComputeRGBSSE2(_mm_unpackhi_epi16(y16, v16), _mm_unpackhi_epi16(y16, u16),
+      &r_hi, &g_hi, &b_hi, c);
+    StoreEightPixelsSSE2(r_lo, r_hi, g_lo, g_hi, b_lo, b_hi, output + x * 4);
+  }
+  ConvertYUVPixelsTailFixed(fixed_tables + encoding, y + x, u + x, v + x,
+    output + x * 4, w - x);
+}
+
+SPECIALIZE_YUV_PIXEL_CONVERTER(__attribute__((target("sse2"))),
+  ConvertYUVPixelsSSE2);
+
+// Averages four pixel pairs from each row into four output pixels, returning
+// their (Y, V) and (Y, U) pairs for ComputeRGBSSE2. _mm_avg_epu8 rounds the
+// same way as the scalar code, so it averages the chroma exactly.
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void HalveFourPairsSSE2(
+    const uint8_t *first_row, const uint8_t *second_row, __m128i *yv,
+    __m128i *yu, const ColorCoefficients *c) {
+  const __m128i bias = _mm_set1_epi32(BIAS_PAIR(c));
+  const __m128i luma_mask = _mm_set1_epi16(0xff);
+  const __m128i chroma_mask = _mm_set1_epi32(0x00ff0000);
+  __m128i first = _mm_loadu_si128((const __m128i *) first_row);
+  __m128i second = _mm_loadu_si128((const __m128i *) second_row);
+  __m128i luma, chroma;
+  // Each 32-bit lane holds one pair. Summing the Y samples as 16-bit values
+  // and then adding each lane's halves gives each block's total luma.
+  luma = _mm_madd_epi16(_mm_add_epi16(_mm_and_si128(first, luma_mask),
+    _mm_and_si128(second, luma_mask)), _mm_set1_epi16(1));
+  luma = _mm_srli_epi32(_mm_add_epi32(luma, _mm_set1_epi32(2)), 2);
+  // Byte 1 of each lane is U and byte 3 is V. Move either one into the high
+  // 16 bits to pair it with the luma.
+  chroma = _mm_avg_epu8(first, second);
+  *yu = _mm_sub_epi16(_mm_or_si128(luma, _mm_and_si128(_mm_slli_epi32(chroma,
+    8), chroma_mask)), bias);
+  *yv = _mm_sub_epi16(_mm_or_si128(luma, _mm_and_si128(_mm_srli_epi32(chroma,
+    8), chroma_mask)), bias);
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void HalveRowSSE2(
+    const uint8_t *first_row, const uint8_t *second_row, uint8_t *output,
+    int output_w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  __m128i yv, yu, r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+  int x;
+  for (x = 0; (x + 8) <= output_w; x += 8) {
+    HalveFourPairsSSE2(first_row, second_row, &yv, &yu, c);
+    ComputeRGBSSE2(yv, yu, &r_lo, &g_lo, &b_lo, c);
+    HalveFourPairsSSE2(first_row + 16, second_row + 16, &yv, &yu, c);
+    ComputeRGBSSE2(yv, yu, &r_hi, &g_hi, &b_hi, c);
+    StoreEightPixelsSSE2(r_lo, r_hi, g_lo, g_hi, b_lo, b_hi, output);
+    first_row += 32;
+    second_row += 32;
+    output += 32;
+  }
+  HalveRowTailFixed(fixed_tables + encoding, first_row, second_row, output,
+    output_w - x);
+}
+
+SPECIALIZE_HALVING_ROW_CONVERTER(__attribute__((target("sse2"))),
+  HalveRowSSE2);
+
+// Averages eight pixel pairs from each of four rows into four output pixels,
+// returning their (Y, V) and (Y, U) pairs for ComputeRGBSSE2. The rows are
+// summed as 16-bit columns first, so the horizontal sums are only done once.
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void QuarterEightPairsSSE2(
+    const uint8_t *input, int input_pitch, __m128i *yv, __m128i *yu,
+    const ColorCoefficients *c) {
+  const __m128i bias = _mm_set1_epi32(BIAS_PAIR(c));
+  const __m128i luma_mask = _mm_set1_epi16(0xff);
+  const __m128i chroma_mask = _mm_set1_epi32(0xffff0000);
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i first, second, luma_first, luma_second, chroma_first,
+    chroma_second, luma, chroma;
+  int row;
+  luma_first = _mm_setzero_si128();
+  luma_second = luma_first;
+  chroma_first = luma_first;
+  chroma_second = luma_first;
+  for (row = 0; row < 4; row++) {
+    first = _mm_loadu_si128((const __m128i *) input);
+    second = _mm_loadu_si128((const __m128i *) (input + 16));
+    luma_first = _mm_add_epi16(luma_first, _mm_and_si128(first, luma_mask));
+    luma_second = _mm_add_epi16(luma_second, _mm_and_si128(second,
+      luma_mask));
+    chroma_first = _mm_add_epi16(chroma_first, _mm_srli_epi16(first, 8));
+    chroma_second = _mm_add_epi16(chroma_second, _mm_srli_epi16(second, 8));
+    input += input_pitch;
+  }
+  // Adding neighboring luma columns gives each pair's total, and adding
+  // neighboring pairs gives each block's. The pair totals are at most 2040,
+  // so packing them to 16 bits is exact.
+  luma = _mm_madd_epi16(_mm_packs_epi32(_mm_madd_epi16(luma_first, ones),
+    _mm_madd_epi16(luma_second, ones)), ones);
+  luma = _mm_srli_epi32(_mm_add_epi32(luma, _mm_set1_epi32(8)), 4);
+  // The chroma columns alternate U and V. Adding each pair's samples to the
+  // next pair's leaves a block's U and V totals in the low 32 bits of each
+  // 64-bit half, which are then gathered into one block per 32-bit lane.
+  chroma_first = _mm_add_epi16(chroma_first, _mm_srli_epi64(chroma_first,
+    32));
+  chroma_second = _mm_add_epi16(chroma_second, _mm_srli_epi64(chroma_second,
+    32));
+  chroma = _mm_unpacklo_epi64(_mm_shuffle_epi32(chroma_first,
+    _MM_SHUFFLE(3, 1, 2, 0)), _mm_shuffle_epi32(chroma_second,
+    _MM_SHUFFLE(3, 1, 2, 0)));
+  chroma = _mm_srli_epi16(_mm_add_epi16(chroma, _mm_set1_epi16(4)), 3);
+  // Each lane now holds U in its low 16 bits and V in its high 16 bits.
+  *yu = _mm_sub_epi16(_mm_or_si128(luma, _mm_slli_epi32(chroma, 16)), bias);
+  *yv = _mm_sub_epi16(_mm_or_si128(luma, _mm_and_si128(chroma, chroma_mask)),
+    bias);
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void QuarterRowSSE2(
+    const uint8_t *input, int input_pitch, uint8_t *output, int output_w,
+    int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  __m128i yv, yu, r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+  int x;
+  for (x = 0; (x + 8) <= output_w; x += 8) {
+    QuarterEightPairsSSE2(input, input_pitch, &yv, &yu, c);
+    ComputeRGBSSE2(yv, yu, &r_lo, &g_lo, &b_lo, c);
+    QuarterEightPairsSSE2(input + 32, input_pitch, &yv, &yu, c);
+    ComputeRGBSSE2(yv, yu, &r_hi, &g_hi, &b_hi, c);
+    StoreEightPixelsSSE2(r_lo, r_hi, g_lo, g_hi, b_lo, b_hi, output);
+    input += 64;
+    output += 32;
+  }
+  QuarterRowTailFixed(fixed_tables + encoding, input, input_pitch, output,
+    output_w - x);
+}
+
+SPECIALIZE_QUARTERING_ROW_CONVERTER(__attribute__((target("sse2"))),
+  QuarterRowSSE2);
+
+// The AVX2 equivalent of HalveFourPairsSSE2, for eight pairs from each row.
+// first and second hold the two rows' samples, rather than pointers, so the
+// caller can arrange the pairs across the lanes.
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void HalveEightPairsAVX2(
+    __m256i first, __m256i second, __m256i *yv, __m256i *yu,
+    const ColorCoefficients *c) {
+  const __m256i bias = _mm256_set1_epi32(BIAS_PAIR(c));
+  const __m256i luma_mask = _mm256_set1_epi16(0xff);
+  const __m256i chroma_mask = _mm256_set1_epi32(0x00ff0000);
+  __m256i luma, chroma;
+  luma = _mm256_madd_epi16(_mm256_add_epi16(_mm256_and_si256(first,
+    luma_mask), _mm256_and_si256(second, luma_mask)), _mm256_set1_epi16(1));
+  luma = _mm256_srli_epi32(_mm256_add_epi32(luma, _mm256_set1_epi32(2)), 2);
+  chroma = _mm256_avg_epu8(first, second);
+  *yu = _mm256_sub_epi16(_mm256_or_si256(luma, _mm256_and_si256(
+    _mm256_slli_epi32(chroma, 8), chroma_mask)), bias);
+  *yv = _mm256_sub_epi16(_mm256_or_si256(luma, _mm256_and_si256(
+    _mm256_srli_epi32(chroma, 8), chroma_mask)), bias);
+}
+
+// Produces 16 output pixels from 16 pairs in each row. The pairs are
+// regrouped so the lo vectors cover output pixels 0-3 and 8-11, the layout
+// StoreSixteenPixelsAVX2 expects.
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void HalveRowAVX2(
+    const uint8_t *first_row, const uint8_t *second_row, uint8_t *output,
+    int output_w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  __m256i first_a, first_b, second_a, second_b, yv, yu;
+  __m256i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+  int x;
+  for (x = 0; (x + 16) <= output_w; x += 16) {
+    first_a = _mm256_loadu_si256((const __m256i *) first_row);
+    first_b = _mm256_loadu_si256((const __m256i *) (first_row + 32));
+    second_a = _mm256_loadu_si256((const __m256i *) second_row);
+    second_b = _mm256_loadu_si256((const __m256i *) (second_row + 32));
+    HalveEightPairsAVX2(_mm256_permute2x128_si256(first_a, first_b, 0x20),
+      _mm256_permute2x128_si256(second_a, second_b, 0x20), &yv, &yu, c);
+    ComputeRGBAVX2(yv, yu, &r_lo, &g_lo, &b_lo, c);
+    HalveEightPairsAVX2(_mm256_permute2x128_si256(first_a, first_b, 0x31),
+      _mm256_permute2x128_si256(second_a, second_b, 0x31), &yv, &yu, c);
+    ComputeRGBAVX2(yv, yu, &r_hi, &g_hi, &b_hi, c);
+    StoreSixteenPixelsAVX2(r_lo, r_hi, g_lo, g_hi, b_lo, b_hi, output);
+    first_row += 64;
+    second_row += 64;
+    output += 64;
+  }
+  HalveRowSSE2(first_row, second_row, output, output_w - x, encoding);
+}
+
+SPECIALIZE_HALVING_ROW_CONVERTER(__attribute__((target("avx2"))),
+  HalveRowAVX2);
+
+// Keeps the low byte of each 16-bit lane, which holds the Y samples, and
+// packs 16 pixels' worth of them together.
+__attribute__((target("sse2")))
+static void ExtractLumaRowSSE2(const uint8_t *input, uint8_t *output, int w) {
+  const __m128i luma_mask = _mm_set1_epi16(0xff);
+  __m128i first, second;
+  int x;
+  for (x = 0; (x + 16) <= w; x += 16) {
+    first = _mm_and_si128(_mm_loadu_si128((const __m128i *) input),
+      luma_mask);
+    second = _mm_and_si128(_mm_loadu_si128((const __m128i *) (input + 16)),
+      luma_mask);
+    _mm_storeu_si128((__m128i *) output, _mm_packus_epi16(first, second));
+    input += 32;
+    output += 16;
+  }
+  ExtractLumaRow(input, output, w - x);
+}
+
+__attribute__((target("avx2")))
+static void ExtractLumaRowAVX2(const uint8_t *input, uint8_t *output, int w) {
+  const __m256i luma_mask = _mm256_set1_epi16(0xff);
+  __m256i first, second, packed;
+  int x;
+  for (x = 0; (x + 32) <= w; x += 32) {
+    first = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) input),
+      luma_mask);
+    second = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)
+      (input + 32)), luma_mask);
+    // The pack works within each 128-bit lane, so put the 64-bit quarters
+    // back in order afterwards.
+    packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(first, second),
+      _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *) output, packed);
+    input += 64;
+    output += 32;
+  }
+  ExtractLumaRow(input, output, w - x);
+}
+
+// Averages eight pairs from each row, leaving their U, V samples interleaved
+// in the low 16 bytes.
+__attribute__((target("sse2")))
+static inline __m128i AverageEightChromaPairsSSE2(const uint8_t *first_row,
+    const uint8_t *second_row) {
+  __m128i first, second;
+  first = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) first_row),
+    _mm_loadu_si128((const __m128i *) second_row));
+  second = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) (first_row + 16)),
+    _mm_loadu_si128((const __m128i *) (second_row + 16)));
+  // Each 16-bit lane holds a Y sample in its low byte and a U or V sample in
+  // its high byte.
+  return _mm_packus_epi16(_mm_srli_epi16(first, 8),
+    _mm_srli_epi16(second, 8));
+}
+
+__attribute__((target("sse2")))
+static void AverageChromaRowI420SSE2(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  const __m128i low_bytes = _mm_set1_epi16(0xff);
+  __m128i uv, planar;
+  int x;
+  for (x = 0; (x + 8) <= pairs; x += 8) {
+    uv = AverageEightChromaPairsSSE2(first_row, second_row);
+    planar = _mm_packus_epi16(_mm_and_si128(uv, low_bytes),
+      _mm_srli_epi16(uv, 8));
+    _mm_storel_epi64((__m128i *) (u + x), planar);
+    _mm_storel_epi64((__m128i *) (v + x), _mm_srli_si128(planar, 8));
+    first_row += 32;
+    second_row += 32;
+  }
+  AverageChromaRowI420(first_row, second_row, u + x, v + x, pairs - x);
+}
+
+__attribute__((target("sse2")))
+static void AverageChromaRowNV12SSE2(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  int x;
+  for (x = 0; (x + 8) <= pairs; x += 8) {
+    _mm_storeu_si128((__m128i *) (u + x * 2),
+      AverageEightChromaPairsSSE2(first_row, second_row));
+    first_row += 32;
+    second_row += 32;
+  }
+  AverageChromaRowNV12(first_row, second_row, u + x * 2, v, pairs - x);
+}
+
+// The AVX2 equivalent of AverageEightChromaPairsSSE2, for 16 pairs. The packs
+// work within 128-bit lanes, so the 64-bit quarters are put back in order
+// afterwards.
+__attribute__((target("avx2")))
+static inline __m256i AverageSixteenChromaPairsAVX2(const uint8_t *first_row,
+    const uint8_t *second_row) {
+  __m256i first, second;
+  first = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *) first_row),
+    _mm256_loadu_si256((const __m256i *) second_row));
+  second = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)
+    (first_row + 32)), _mm256_loadu_si256((const __m256i *)
+    (second_row + 32)));
+  return _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(
+    first, 8), _mm256_srli_epi16(second, 8)), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2")))
+static void AverageChromaRowI420AVX2(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  const __m256i low_bytes = _mm256_set1_epi16(0xff);
+  __m256i uv, planar;
+  int x;
+  for (x = 0; (x + 16) <= pairs; x += 16) {
+    uv = AverageSixteenChromaPairsAVX2(first_row, second_row);
+    // This leaves U samples 0-7, V samples 0-7, U samples 8-15 and V samples
+    // 8-15 in the four quarters, so gather the U and V halves.
+    planar = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(
+      uv, low_bytes), _mm256_srli_epi16(uv, 8)), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i *) (u + x), _mm256_castsi256_si128(planar));
+    _mm_storeu_si128((__m128i *) (v + x), _mm256_extracti128_si256(planar,
+      1));
+    first_row += 64;
+    second_row += 64;
+  }
+  AverageChromaRowI420SSE2(first_row, second_row, u + x, v + x, pairs - x);
+}
+
+__attribute__((target("avx2")))
+static void AverageChromaRowNV12AVX2(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  int x;
+  for (x = 0; (x + 16) <= pairs; x += 16) {
+    _mm256_storeu_si256((__m256i *) (u + x * 2),
+      AverageSixteenChromaPairsAVX2(first_row, second_row));
+    first_row += 64;
+    second_row += 64;
+  }
+  AverageChromaRowNV12SSE2(first_row, second_row, u + x * 2, v, pairs - x);
+}
+
+// Sums the differences 16 bytes at a time. Each SAD instruction leaves two
+// 16-bit sums in the low bits of its 64-bit halves.
+__attribute__((target("sse2")))
+static uint32_t SumRowDifferencesSSE2(const uint8_t *a, const uint8_t *b,
+    int bytes) {
+  __m128i sums = _mm_setzero_si128();
+  int i;
+  for (i = 0; (i + 16) <= bytes; i += 16) {
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(
+      _mm_loadu_si128((const __m128i *) (a + i)),
+      _mm_loadu_si128((const __m128i *) (b + i))));
+  }
+  sums = _mm_add_epi64(sums, _mm_unpackhi_epi64(sums, sums));
+  return ((uint32_t) _mm_cvtsi128_si32(sums)) +
+    SumRowDifferences(a + i, b + i, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t SumRowDifferencesAVX2(const uint8_t *a, const uint8_t *b,
+    int bytes) {
+  __m256i sums = _mm256_setzero_si256();
+  __m128i total;
+  int i;
+  for (i = 0; (i + 32) <= bytes; i += 32) {
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(
+      _mm256_loadu_si256((const __m256i *) (a + i)),
+      _mm256_loadu_si256((const __m256i *) (b + i))));
+  }
+  total = _mm_add_epi64(_mm256_castsi256_si128(sums),
+    _mm256_extracti128_si256(sums, 1));
+  total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+  return ((uint32_t) _mm_cvtsi128_si32(total)) +
+    SumRowDifferences(a + i, b + i, bytes - i);
+}
+
+// Sums 16 columns at a time down all of the rows, keeping the totals in
+// registers rather than adding each row to the sums in memory.
+__attribute__((target("sse2")))
+static void SumColumnsSSE2(const uint8_t *input, int input_pitch, int rows,
+    uint16_t *sums, int bytes) {
+  const __m128i zero = _mm_setzero_si128();
+  const uint8_t *column;
+  __m128i low, high, row_bytes;
+  int i, row;
+  for (i = 0; (i + 16) <= bytes; i += 16) {
+    low = zero;
+    high = zero;
+    column = input + i;
+    for (row = 0; row < rows; row++) {
+      row_bytes = _mm_loadu_si128((const __m128i *) column);
+      low = _mm_add_epi16(low, _mm_unpacklo_epi8(row_bytes, zero));
+      high = _mm_add_epi16(high, _mm_unpackhi_epi8(row_bytes, zero));
+      column += input_pitch;
+    }
+    _mm_storeu_si128((__m128i *) (sums + i), low);
+    _mm_storeu_si128((__m128i *) (sums + i + 8), high);
+  }
+  SumColumns(input + i, input_pitch, rows, sums + i, bytes - i);
+}
+
+// The AVX2 version of SumColumnsSSE2, for 32 columns at a time. Widening
+// each half of the bytes separately keeps the totals in column order.
+__attribute__((target("avx2")))
+static void SumColumnsAVX2(const uint8_t *input, int input_pitch, int rows,
+    uint16_t *sums, int bytes) {
+  const uint8_t *column;
+  __m256i low, high;
+  int i, row;
+  for (i = 0; (i + 32) <= bytes; i += 32) {
+    low = _mm256_setzero_si256();
+    high = _mm256_setzero_si256();
+    column = input + i;
+    for (row = 0; row < rows; row++) {
+      low = _mm256_add_epi16(low, _mm256_cvtepu8_epi16(_mm_loadu_si128(
+        (const __m128i *) column)));
+      high = _mm256_add_epi16(high, _mm256_cvtepu8_epi16(_mm_loadu_si128(
+        (const __m128i *) (column + 16))));
+      column += input_pitch;
+    }
+    _mm256_storeu_si256((__m256i *) (sums + i), low);
+    _mm256_storeu_si256((__m256i *) (sums + i + 16), high);
+  }
+  SumColumnsSSE2(input + i, input_pitch, rows, sums + i, bytes - i);
+}
+
+// Masks out the chroma and sums the remaining Y samples against zero with
+// the SAD instruction, which leaves two 16-bit sums in the low bits of its
+// 64-bit halves.
+__attribute__((target("sse2")))
+static uint32_t SumRowLumaSSE2(const uint8_t *input, int w) {
+  const __m128i luma_mask = _mm_set1_epi16(0xff);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums = zero;
+  int x;
+  for (x = 0; (x + 8) <= w; x += 8) {
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_and_si128(_mm_loadu_si128(
+      (const __m128i *) (input + x * 2)), luma_mask), zero));
+  }
+  sums = _mm_add_epi64(sums, _mm_unpackhi_epi64(sums, sums));
+  return ((uint32_t) _mm_cvtsi128_si32(sums)) + SumRowLuma(input + x * 2,
+    w - x);
+}
+
+__attribute__((target("avx2")))
+static uint32_t SumRowLumaAVX2(const uint8_t *input, int w) {
+  const __m256i luma_mask = _mm256_set1_epi16(0xff);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sums = zero;
+  __m128i total;
+  int x;
+  for (x = 0; (x + 16) <= w; x += 16) {
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_and_si256(
+      _mm256_loadu_si256((const __m256i *) (input + x * 2)), luma_mask),
+      zero));
+  }
+  total = _mm_add_epi64(_mm256_castsi256_si128(sums),
+    _mm256_extracti128_si256(sums, 1));
+  total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+  return ((uint32_t) _mm_cvtsi128_si32(total)) + SumRowLuma(input + x * 2,
+    w - x);
+}
+
+// Returns the (Y0, U, Y1, V) totals of a block of whole pairs. Each pair's
+// four column sums fill 64 bits, so a vector holds two pairs; widening them
+// to 32 bits puts one pair in each half, and the halves are then added.
+__attribute__((target("sse2")))
+static inline __m128i SumPairBlockSSE2(const uint16_t *sums, int pairs) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i total = zero, two_pairs;
+  int k;
+  for (k = 0; (k + 2) <= pairs; k += 2) {
+    two_pairs = _mm_loadu_si128((const __m128i *) (sums + k * 4));
+    total = _mm_add_epi32(total, _mm_add_epi32(_mm_unpacklo_epi16(two_pairs,
+      zero), _mm_unpackhi_epi16(two_pairs, zero)));
+  }
+  if (k < pairs) {
+    total = _mm_add_epi32(total, _mm_unpacklo_epi16(_mm_loadl_epi64(
+      (const __m128i *) (sums + k * 4)), zero));
+  }
+  return total;
+}
+
+// Computes BlockAverage for four sums. _mm_mul_epu32 only multiplies the even
+// 32-bit lanes, leaving each product's high half, which is the quotient, in
+// the odd lane above it.
+__attribute__((target("sse2")))
+static inline __m128i BlockAverageSSE2(__m128i sums, __m128i half_area,
+    __m128i reciprocal) {
+  const __m128i odd_lanes = _mm_set_epi32(-1, 0, -1, 0);
+  __m128i even, odd;
+  sums = _mm_add_epi32(sums, half_area);
+  even = _mm_srli_epi64(_mm_mul_epu32(sums, reciprocal), 32);
+  odd = _mm_mul_epu32(_mm_srli_epi64(sums, 32), reciprocal);
+  return _mm_or_si128(even, _mm_and_si128(odd, odd_lanes));
+}
+
+// Averages four blocks at a time. Transposing their (Y0, U, Y1, V) totals
+// gives a vector of each sample, so the division and the packing down to
+// bytes are shared by the four blocks.
+__attribute__((target("sse2")))
+static void ReducePairBlocksSSE2(const uint16_t *sums, int factor,
+    uint64_t reciprocal, uint8_t *y, uint8_t *u, uint8_t *v, int count) {
+  const __m128i half_area = _mm_set1_epi32((factor * factor) / 2);
+  // The reciprocal fits in 32 bits, since the area is at least 16.
+  const __m128i reciprocal_lanes = _mm_set1_epi32((uint32_t) reciprocal);
+  __m128i a, b, c, d, y_sums, u_sums, v_sums, packed;
+  int pairs = factor / 2, i;
+  uint32_t samples;
+  for (i = 0; (i + 4) <= count; i += 4) {
+    a = SumPairBlockSSE2(sums, pairs);
+    b = SumPairBlockSSE2(sums + pairs * 4, pairs);
+    c = SumPairBlockSSE2(sums + pairs * 8, pairs);
+    d = SumPairBlockSSE2(sums + pairs * 12, pairs);
+    sums += pairs * 16;
+    // Interleave the blocks' totals, so each 64-bit half holds one sample
+    // from each of two blocks.
+    y_sums = _mm_unpacklo_epi32(a, b);
+    u_sums = _mm_unpacklo_epi32(c, d);
+    a = _mm_unpackhi_epi32(a, b);
+    c = _mm_unpackhi_epi32(c, d);
+    b = _mm_unpackhi_epi64(y_sums, u_sums);
+    d = _mm_unpackhi_epi64(a, c);
+    y_sums = _mm_add_epi32(_mm_unpacklo_epi64(y_sums, u_sums),
+      _mm_unpacklo_epi64(a, c));
+    u_sums = _mm_add_epi32(b, b);
+    v_sums = _mm_add_epi32(d, d);
+    y_sums = BlockAverageSSE2(y_sums, half_area, reciprocal_lanes);
+    u_sums = BlockAverageSSE2(u_sums, half_area, reciprocal_lanes);
+    v_sums = BlockAverageSSE2(v_sums, half_area, reciprocal_lanes);
+    // The averages are at most 255, so saturation never changes them.
+    packed = _mm_packus_epi16(_mm_packs_epi32(y_sums, u_sums),
+      _mm_packs_epi32(v_sums, v_sums));
+    samples = _mm_cvtsi128_si32(packed);
+    memcpy(y + i, &samples, 4);
+    samples = _mm_cvtsi128_si32(_mm_srli_si128(packed, 4));
+    memcpy(u + i, &samples, 4);
+    samples = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+    memcpy(v + i, &samples, 4);
+  }
+  ReducePairBlocks(sums, factor, reciprocal, y + i, u + i, v + i, count - i);
+}
+
+#endif  // X86_KERNELS
+
+#ifdef NEON_KERNELS
+
+// Returns the eight bytes for one color channel, given the 16-bit luma term
+// and the 32-bit chroma terms for the low and high four pixels.
+static inline __attribute__((always_inline)) uint8x8_t FinishChannelNEON(
+    int16x8_t y, int32x4_t chroma_lo, int32x4_t chroma_hi,
+    const ColorCoefficients *c) {
+  int32x4_t lo = vmlal_n_s16(chroma_lo, vget_low_s16(y), c->fixed_y);
+  int32x4_t hi = vmlal_n_s16(chroma_hi, vget_high_s16(y), c->fixed_y);
+  return vqmovun_s16(vcombine_s16(
+    vqmovn_s32(vshrq_n_s32(lo, FIXED_POINT_SHIFT)),
+    vqmovn_s32(vshrq_n_s32(hi, FIXED_POINT_SHIFT))));
+}
+
+static inline __attribute__((always_inline)) void ConvertRowNEON(
+    const uint8_t *input, uint8_t *output, int w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  int x;
+  uint8x8x4_t pairs, rgba;
+  uint8x8x2_t r, g, b;
+  int16x8_t y_even, y_odd, u, v;
+  int32x4_t r_lo, r_hi, g_lo, g_hi, b_lo, b_hi;
+  const int16x8_t luma_bias = vdupq_n_s16(c->luma_bias);
+  const int16x8_t chroma_bias = vdupq_n_s16(128);
+  rgba.val[0] = vdup_n_u8(0xff);
+  for (x = 0; (x + 16) <= w; x += 16) {
+    // De-interleave 8 pixel pairs into the even Ys, Us, odd Ys and Vs.
+    pairs = vld4_u8(input);
+    y_even = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[0])),
+      luma_bias);
+    u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[1])),
+      chroma_bias);
+    y_odd = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[2])),
+      luma_bias);
+    v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[3])),
+      chroma_bias);
+    // Both pixels in a pair share the same chroma terms.
+    r_lo = vmull_n_s16(vget_low_s16(v), c->fixed_v_to_r);
+    r_hi = vmull_n_s16(vget_high_s16(v), c->fixed_v_to_r);
+    g_lo = vmlal_n_s16(vmull_n_s16(vget_low_s16(u), c->fixed_u_to_g),
+      vget_low_s16(v), c->fixed_v_to_g);
+    g_hi = vmlal_n_s16(vmull_n_s16(vget_high_s16(u), c->fixed_u_to_g),
+      vget_high_s16(v), c->fixed_v_to_g);
+    b_lo = vmull_n_s16(vget_low_s16(u), c->fixed_u_to_b);
+    b_hi = vmull_n_s16(vget_high_s16(u), c->fixed_u_to_b);
+    // Interleave the even and odd pixels back into their original order.
+    r = vzip_u8(FinishChannelNEON(y_even, r_lo, r_hi, c),
+      FinishChannelNEON(y_odd, r_lo, r_hi, c));
+    g = vzip_u8(FinishChannelNEON(y_even, g_lo, g_hi, c),
+      FinishChannelNEON(y_odd, g_lo, g_hi, c));
+    b = vzip_u8(FinishChannelNEON(y_even, b_lo, b_hi, c),
+      FinishChannelNEON(y_odd, b_lo, b_hi, c));
+    rgba.val[1] = b.val[0];
+    rgba.val[2] = g.val[0];
+    rgba.val[3] = r.val[0];
+    vst4_u8(output, rgba);
+    rgba.val[1] = b.val[1];
+    rgba.val[2] = g.val[1];
+    rgba.val[3] = r.val[1];
+    vst4_u8(output + 32, rgba);
+    input += 32;
+    output += 64;
+  }
+  ConvertRowTailFixed(fixed_tables + encoding, input, output, w - x, x > 0);
+}
+
+SPECIALIZE_RGBA_ROW_CONVERTER(, ConvertRowNEON);
+
+static inline __attribute__((always_inline)) void ConvertYUVPixelsNEON(
+    const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *output,
+    int w, int encoding) {
+  const ColorCoefficients *c = color_coefficients + encoding;
+  int x;
+  uint8x8x4_t rgba;
+  int16x8_t y16, u16, v16;
+  int32x4_t r_lo, r_hi, g_lo, g_hi, b_lo, b_hi;
+  const int16x8_t luma_bias = vdupq_n_s16(c->luma_bias);
+  const int16x8_t chroma_bias = vdupq_n_s16(128);
+  rgba.val[0] = vdup_n_u8(0xff);
+  for (x = 0; (x + 8) <= w; x += 8) {
+    y16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + x))),
+      luma_bias);
+    u16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + x))),
+      chroma_bias);
+    v16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v + x))),
+      chroma_bias);
+    r_lo = vmull_n_s16(vget_low_s16(v16), c->fixed_v_to_r);
+    r_hi = vmull_n_s16(vget_high_s16(v16), c->fixed_v_to_r);
+    g_lo = vmlal_n_s16(vmull_n_s16(vget_low_s16(u16), c->fixed_u_to_g),
+      vget_low_s16(v16), c->fixed_v_to_g);
+    g_hi = vmlal_n_s16(vmull_n_s16(vget_high_s16(u16), c->fixed_u_to_g),
+      vget_high_s16(v16), c->fixed_v_to_g);
+    b_lo = vmull_n_s16(vget_low_s16(u16), c->fixed_u_to_b);
+    b_hi = vmull_n_s16(vget_high_s16(u16), c->fixed_u_to_b);
+    rgba.val[1] = FinishChannelNEON(y16, b_lo, b_hi, c);
+    rgba.val[2] = FinishChannelNEON(y16, g_lo, g_hi, c);
+    rgba.val[3] = FinishChannelNEON(y16, r_lo, r_hi, c);
+    vst4_u8(output + x * 4, rgba);
+  }
+  ConvertYUVPixelsTailFixed(fixed_tables + encoding, y + x, u + x, v + x,
+    output + x * 4, w - x);
+}
+
+SPECIALIZE_YUV_PIXEL_CONVERTER(, ConvertYUVPixelsNEON);
+
+static void ExtractLumaRowNEON(const uint8_t *input, uint8_t *output, int w) {
+  int x;
+  for (x = 0; (x + 16) <= w; x += 16) {
+    vst1q_u8(output, vld2q_u8(input).val[0]);
+    input += 32;
+    output += 16;
+  }
+  ExtractLumaRow(input, output, w - x);
+}
+
+static void AverageChromaRowI420NEON(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  uint8x16x4_t first, second;
+  int x;
+  for (x = 0; (x + 16) <= pairs; x += 16) {
+    first = vld4q_u8(first_row);
+    second = vld4q_u8(second_row);
+    vst1q_u8(u + x, vrhaddq_u8(first.val[1], second.val[1]));
+    vst1q_u8(v + x, vrhaddq_u8(first.val[3], second.val[3]));
+    first_row += 64;
+    second_row += 64;
+  }
+  AverageChromaRowI420(first_row, second_row, u + x, v + x, pairs - x);
+}
+
+static void AverageChromaRowNV12NEON(const uint8_t *first_row,
+    const uint8_t *second_row, uint8_t *u, uint8_t *v, int pairs) {
+  uint8x16x4_t first, second;
+  uint8x16x2_t uv;
+  int x;
+  for (x = 0; (x + 16) <= pairs; x += 16) {
+    first = vld4q_u8(first_row);
+    second = vld4q_u8(second_row);
+    uv.val[0] = vrhaddq_u8(first.val[1], second.val[1]);
+    uv.val[1] = vrhaddq_u8(first.val[3], second.val[3]);
+    vst2q_u8(u + x * 2, uv);
+    first_row += 64;
+    second_row += 64;
+  }
+  AverageChromaRowNV12(first_row, second_row, u + x * 2, v, pairs - x);
+}
+
+static uint32_t SumRowDifferencesNEON(const uint8_t *a, const uint8_t *b,
+    int bytes) {
+  uint32x4_t sums = vdupq_n_u32(0);
+  uint64x2_t total;
+  int i;
+  for (i = 0; (i + 16) <= bytes; i += 16) {
+    sums = vpadalq_u16(sums, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i),
+      vld1q_u8(b + i))));
+  }
+  total = vpaddlq_u32(sums);
+  return ((uint32_t) (vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1))) +
+    SumRowDifferences(a + i, b + i, bytes - i);
+}
+
+#endif  // NEON_KERNELS
+
+int ConversionKernelSupported(ConversionKernel kernel) {
+  switch (kernel) {
+  case CONVERSION_KERNEL_REFERENCE:
+  case CONVERSION_KERNEL_FIXED_POINT:
+    return 1;
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") != 0;
+  case CONVERSION_KERNEL_SSSE3:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") != 0;
+  case CONVERSION_KERNEL_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+#ifdef NEON_KERNELS
+  case CONVERSION_KERNEL_NEON:
+    return 1;
+#endif
+  default:
+    break;
+  }
+  return 0;
+}
+
+ConversionKernel GetBestConversionKernel(void) {
+  // Kernels later in the enum are preferred, if they're supported. The
+  // fixed-point kernel is always supported, and is faster than the reference.
+  static int best = -1;
+  int i;
+  if (best >= 0) return (ConversionKernel) best;
+  for (i = CONVERSION_KERNEL_COUNT - 1; i > CONVERSION_KERNEL_FIXED_POINT;
+    i--) {
+    if (ConversionKernelSupported((ConversionKernel) i)) break;
+  }
+  best = i;
+  return (ConversionKernel) best;
+}
+
+const char *ConversionKernelName(ConversionKernel kernel) {
+  switch (kernel) {
+  case CONVERSION_KERNEL_REFERENCE:
+    return "reference";
+  case CONVERSION_KERNEL_FIXED_POINT:
+    return "fixed_point";
+  case CONVERSION_KERNEL_SSE2:
+    return "sse2";
+  case CONVERSION_KERNEL_SSSE3:
+    return "ssse3";
+  case CONVERSION_KERNEL_AVX2:
+    return "avx2";
+  case CONVERSION_KERNEL_NEON:
+    return "neon";
+  default:
+    break;
+  }
+  return "unknown";
+}
+
+// Returns the row conversion function for the given kernel and color
+// encoding index, or NULL if the kernel isn't supported.
+static RGBARowConverter GetRGBARowConverter(ConversionKernel kernel,
+    int encoding) {
+  if (!ConversionKernelSupported(kernel)) return NULL;
+  switch (kernel) {
+  case CONVERSION_KERNEL_REFERENCE:
+    return ConvertRowReferenceForEncoding[encoding];
+  case CONVERSION_KERNEL_FIXED_POINT:
+    return ConvertRowFixedForEncoding[encoding];
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+    return ConvertRowSSE2ForEncoding[encoding];
+  case CONVERSION_KERNEL_SSSE3:
+    return ConvertRowSSSE3ForEncoding[encoding];
+  case CONVERSION_KERNEL_AVX2:
+    return ConvertRowAVX2ForEncoding[encoding];
+#endif
+#ifdef NEON_KERNELS
+  case CONVERSION_KERNEL_NEON:
+    return ConvertRowNEONForEncoding[encoding];
+#endif
+  default:
+    break;
+  }
+  return NULL;
+}
+
+// Returns the luma extraction function matching the given kernel's
+// instruction set, or NULL if the kernel isn't supported.
+static LumaRowConverter GetLumaRowConverter(ConversionKernel kernel) {
+  if (!ConversionKernelSupported(kernel)) return NULL;
+  switch (kernel) {
+  case CONVERSION_KERNEL_REFERENCE:
+  case CONVERSION_KERNEL_FIXED_POINT:
+    return ExtractLumaRow;
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+    return ExtractLumaRowSSE2;
+  case CONVERSION_KERNEL_AVX2:
+    return ExtractLumaRowAVX2;
+#endif
+#ifdef NEON_KERNELS
+  case CONVERSION_KERNEL_NEON:
+    return ExtractLumaRowNEON;
+#endif
+  default:
+    break;
+  }
+  return NULL;
+}
+
+// Returns the function converting pixels with separate Y, U and V samples
+// that matches the given kernel's instruction set, for the given color
+// encoding index, or NULL if the kernel isn't supported.
+static YUVPixelConverter GetYUVPixelConverter(ConversionKernel kernel,
+    int encoding) {
+  if (!ConversionKernelSupported(kernel)) return NULL;
+  switch (kernel) {
+  case CONVERSION_KERNEL_REFERENCE:
+  case CONVERSION_KERNEL_FIXED_POINT:
+    return ConvertYUVPixelsFixedForEncoding[encoding];
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+  case CONVERSION_KERNEL_AVX2:
+    return ConvertYUVPixelsSSE2ForEncoding[encoding];
+#endif
+#ifdef NEON_KERNELS
+  case CONVERSION_KERNEL_NEON:
+    return ConvertYUVPixelsNEONForEncoding[encoding];
+#endif
+  default:
+    break;
+  }
+  return NULL;
+}
+
+// Returns the 2x2 downscaling function for the given kernel's instruction
+// set and color encoding index, or NULL if the kernel isn't supported.
+static HalvingRowConverter GetHalvingRowConverter(ConversionKernel kernel,
+    int encoding) {
+  if (!ConversionKernelSupported(kernel)) return NULL;
+  switch (kernel) {
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+    return HalveRowSSE2ForEncoding[encoding];
+  case CONVERSION_KERNEL_AVX2:
+    return HalveRowAVX2ForEncoding[encoding];
+#endif
+  default:
+    break;
+  }
+  return HalveRowFixedForEncoding[encoding];
+}
+
+// Returns the 4x4 downscaling function for the given kernel's instruction
+// set and color encoding index, or NULL if the kernel isn't supported.
+static QuarteringRowConverter GetQuarteringRowConverter(
+    ConversionKernel kernel, int encoding) {
+  if (!ConversionKernelSupported(kernel)) return NULL;
+  switch (kernel) {
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+  case CONVERSION_KERNEL_AVX2:
+    return QuarterRowSSE2ForEncoding[encoding];
+#endif
+  default:
+    break;
+  }
+  return QuarterRowFixedForEncoding[encoding];
+}
+
+// Returns the function to average two rows of chroma for I420 output, or for
+// NV12 if interleaved is set. Returns NULL if the kernel isn't supported.
+static ChromaRowConverter GetChromaRowConverter(ConversionKernel kernel,
+    int interleaved) {
+  if (!ConversionKernelSupported(kernel)) return NULL;
+  switch (kernel) {
+  case CONVERSION_KERNEL_REFERENCE:
+  case CONVERSION_KERNEL_FIXED_POINT:
+    return interleaved ? AverageChromaRowNV12 : AverageChromaRowI420;
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+    return interleaved ? AverageChromaRowNV12SSE2 : AverageChromaRowI420SSE2;
+  case CONVERSION_KERNEL_AVX2:
+    return interleaved ? AverageChromaRowNV12AVX2 : AverageChromaRowI420AVX2;
+#endif
+#ifdef NEON_KERNELS
+  case CONVERSION_KERNEL_NEON:
+    return interleaved ? AverageChromaRowNV12NEON : AverageChromaRowI420NEON;
+#endif
+  default:
+    break;
+  }
+  return NULL;
+}
+
+// Returns the function to sum a row's Y samples for the given kernel's
+// instruction set.
+static LumaSummer GetLumaSummer(ConversionKernel kernel) {
+  switch (kernel) {
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+    return SumRowLumaSSE2;
+  case CONVERSION_KERNEL_AVX2:
+    return SumRowLumaAVX2;
+#endif
+  default:
+    break;
+  }
+  return SumRowLuma;
+}
+
+// Returns the function to sum columns for downscaling, for the given
+// kernel's instruction set.
+static ColumnSummer GetColumnSummer(ConversionKernel kernel) {
+  switch (kernel) {
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+    return SumColumnsSSE2;
+  case CONVERSION_KERNEL_AVX2:
+    return SumColumnsAVX2;
+#endif
+  default:
+    break;
+  }
+  return SumColumns;
+}
+
+// Returns the function to average blocks of pixel pairs for downscaling, for
+// the given kernel's instruction set.
+static PairBlockReducer GetPairBlockReducer(ConversionKernel kernel) {
+  switch (kernel) {
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+  case CONVERSION_KERNEL_AVX2:
+    return ReducePairBlocksSSE2;
+#endif
+  default:
+    break;
+  }
+  return ReducePairBlocks;
+}
+
+// Returns the row differencing function matching the given kernel's
+// instruction set, or NULL if the kernel isn't supported.
+static RowDifferencer GetRowDifferencer(ConversionKernel kernel) {
+  if (!ConversionKernelSupported(kernel)) return NULL;
+  switch (kernel) {
+  case CONVERSION_KERNEL_REFERENCE:
+  case CONVERSION_KERNEL_FIXED_POINT:
+    return SumRowDifferences;
+#ifdef X86_KERNELS
+  case CONVERSION_KERNEL_SSE2:
+  case CONVERSION_KERNEL_SSSE3:
+    return SumRowDifferencesSSE2;
+  case CONVERSION_KERNEL_AVX2:
+    return SumRowDifferencesAVX2;
+#endif
+#ifdef NEON_KERNELS
+  case CONVERSION_KERNEL_NEON:
+    return SumRowDifferencesNEON;
+#endif
+  default:
+    break;
+  }
+  return NULL;
+}
+
+const char *ColorMatrixName(ColorMatrix matrix) {
+  switch (matrix) {
+  case COLOR_MATRIX_BT601:
+    return "bt601";
+  case COLOR_MATRIX_BT709:
+    return "bt709";
+  case COLOR_MATRIX_BT2020:
+    return "bt2020";
+  default:
+    break;
+  }
+  return "unknown";
+}
+
+const char *ColorRangeName(ColorRange range) {
+  switch (range) {
+  case COLOR_RANGE_LIMITED:
+    return "limited";
+  case COLOR_RANGE_FULL:
+    return "full";
+  default:
+    break;
+  }
+  return "unknown";
+}
+
+// Accumulates FrameStatistics over the rows of a YUYV frame. Consecutive
+// pixels are counted in four separate histograms, which are added together at
+// the end, so a run of pixels with the same value doesn't make every
+// increment wait for the previous one to the same counter. The tile sums are
+// computed separately with SIMD, leaving only the histogram's scattered
+// increments to the scalar loop.
+typedef struct {
+  LumaSummer sum_luma;
+  uint32_t histograms[4][256];
+  uint64_t tile_sums[MAX_STATISTICS_TILES * MAX_STATISTICS_TILES];
+  uint32_t tile_row_heights[MAX_STATISTICS_TILES];
+  // The first pixel of each tile column, followed by w.
+  int tile_starts[MAX_STATISTICS_TILES + 1];
+  int tile_columns;
+  int tile_rows;
+  int h;
+} StatisticsAccumulator;
+
+// Prepares the accumulator for a w x h frame, using the tile grid requested in
+// statistics. Returns 0 if the grid is too large.
+static int StartStatistics(StatisticsAccumulator *a,
+    const FrameStatistics *statistics, int w, int h) {
+  int i;
+  a->tile_columns = statistics->tile_columns ? statistics->tile_columns : 1;
+  a->tile_rows = statistics->tile_rows ? statistics->tile_rows : 1;
+  if ((a->tile_columns < 0) || (a->tile_columns > MAX_STATISTICS_TILES) ||
+    (a->tile_rows < 0) || (a->tile_rows > MAX_STATISTICS_TILES)) {
+    return 0;
+  }
+  a->sum_luma = GetLumaSummer(GetBestConversionKernel());
+  memset(a->histograms, 0, sizeof(a->histograms));
+  memset(a->tile_sums, 0, sizeof(a->tile_sums));
+  memset(a->tile_row_heights, 0, sizeof(a->tile_row_heights));
+  for (i = 0; i <= a->tile_columns; i++) {
+    a->tile_starts[i] = (int) (((int64_t) w * i) / a->tile_columns);
+  }
+  a->h = h;
+  return 1;
+}
+
+// Counts the Y samples in row y of the frame.
+static void AccumulateRowStatistics(StatisticsAccumulator *a,
+    const uint8_t *input, int y) {
+  int tile_row = (int) (((int64_t) y * a->tile_rows) / a->h);
+  uint64_t *sums = a->tile_sums + tile_row * a->tile_columns;
+  uint32_t *h0 = a->histograms[0], *h1 = a->histograms[1];
+  uint32_t *h2 = a->histograms[2], *h3 = a->histograms[3];
+  int tile, x, w = a->tile_starts[a->tile_columns];
+  a->tile_row_heights[tile_row]++;
+  for (tile = 0; tile < a->tile_columns; tile++) {
+    x = a->tile_starts[tile];
+    sums[tile] += a->sum_luma(input + x * 2, a->tile_starts[tile + 1] - x);
+  }
+  for (x = 0; (x + 4) <= w; x += 4) {
+    h0[input[x * 2]]++;
+    h1[input[x * 2 + 2]]++;
+    h2[input[x * 2 + 4]]++;
+    h3[input[x * 2 + 6]]++;
+  }
+  for (; x < w; x++) {
+    h0[input[x * 2]]++;
+  }
+}
+
+// Fills in statistics from the accumulated counts. range selects the clipping
+// levels.
+static void FinishStatistics(StatisticsAccumulator *a, ColorRange range,
+    FrameStatistics *statistics) {
+  int black = (range == COLOR_RANGE_FULL) ? 0 : 16;
+  int white = (range == COLOR_RANGE_FULL) ? 255 : 235;
+  uint64_t count = 0, sum = 0, tile_count, dark = 0, bright = 0;
+  uint32_t n;
+  int i, row, column;
+  for (i = 0; i < 256; i++) {
+    n = a->histograms[0][i] + a->histograms[1][i] + a->histograms[2][i] +
+      a->histograms[3][i];
+    statistics->histogram[i] = n;
+    count += n;
+    sum += (uint64_t) n * i;
+    if (i <= black) dark += n;
+    if (i >= white) bright += n;
+  }
+  statistics->pixel_count = count;
+  statistics->mean_luma = count ? ((double) sum) / count : 0;
+  statistics->clipped_dark = dark;
+  statistics->clipped_bright = bright;
+  memset(statistics->tile_means, 0, sizeof(statistics->tile_means));
+  for (row = 0; row < a->tile_rows; row++) {
+    for (column = 0; column < a->tile_columns; column++) {
+      tile_count = ((uint64_t) a->tile_row_heights[row]) *
+        (a->tile_starts[column + 1] - a->tile_starts[column]);
+      if (tile_count == 0) continue;
+      i = row * a->tile_columns + column;
+      statistics->tile_means[i] = ((double) a->tile_sums[i]) / tile_count;
+    }
+  }
+}
+
+// Converts a YUYV frame to RGBA using the given kernel and color encoding
+// index. Returns 0 on error.
+static int ConvertYUYVToRGBAWithKernelAndEncoding(ConversionKernel kernel,
+    int encoding, uint8_t *input, uint8_t *output, int w, int h,
+    int input_pitch, int output_pitch) {
+  RGBARowConverter convert_row = GetRGBARowConverter(kernel, encoding);
+  int y;
+  if (!convert_row) return 0;
+  if ((w < 0) || (h < 0)) return 0;
+  if (input_pitch < (w * 2)) return 0;
+  if (output_pitch < (w * 4)) return 0;
+  InitFixedPointTables();
+  for (y = 0; y < h; y++) {
+    convert_row(input, output, w);
+    input += input_pitch;
+    output += output_pitch;
+  }
+  return 1;
+}
+
+int ConvertYUYVToRGBAWithKernel(ConversionKernel kernel, uint8_t *input,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch) {
+  return ConvertYUYVToRGBAWithKernelAndEncoding(kernel,
+    DEFAULT_COLOR_ENCODING, input, output, w, h, input_pitch, output_pitch);
+}
+
+int ConvertYUYVToRGBA(uint8_t *input, uint8_t *output, int w, int h,
+    int input_pitch, int output_pitch) {
+  return ConvertYUYVToRGBAWithKernel(GetBestConversionKernel(), input, output,
+    w, h, input_pitch, output_pitch);
+}
+
+int ConvertYUYVToRGBAWithEncoding(const ColorEncoding *encoding,
+    uint8_t *input, uint8_t *output, int w, int h, int input_pitch,
+    int output_pitch) {
+  int index = ColorEncodingIndex(encoding);
+  if (index < 0) return 0;
+  return ConvertYUYVToRGBAWithKernelAndEncoding(GetBestConversionKernel(),
+    index, input, output, w, h, input_pitch, output_pitch);
+}
+
+int GetYUYVFrameStatistics(uint8_t *input, int w, int h, int input_pitch,
+    const ColorEncoding *encoding, FrameStatistics *statistics) {
+  StatisticsAccumulator a;
+  int y;
+  if (!encoding) encoding = &default_color_encoding;
+  if (ColorEncodingIndex(encoding) < 0) return 0;
+  if ((w < 0) || (h < 0)) return 0;
+  if (input_pitch < (w * 2)) return 0;
+  if (!StartStatistics(&a, statistics, w, h)) return 0;
+  for (y = 0; y < h; y++) {
+    AccumulateRowStatistics(&a, input, y);
+    input += input_pitch;
+  }
+  FinishStatistics(&a, encoding->range, statistics);
+  return 1;
+}
+
+int ConvertYUYVToRGBAWithStatistics(const ColorEncoding *encoding,
+    uint8_t *input, uint8_t *output, int w, int h, int input_pitch,
+    int output_pitch, FrameStatistics *statistics) {
+  StatisticsAccumulator a;
+  RGBARowConverter convert_row;
+  int index, y;
+  if (!encoding) encoding = &default_color_encoding;
+  if (!statistics) {
+    return ConvertYUYVToRGBAWithEncoding(encoding, input, output, w, h,
+      input_pitch, output_pitch);
+  }
+  index = ColorEncodingIndex(encoding);
+  if (index < 0) return 0;
+  convert_row = GetRGBARowConverter(GetBestConversionKernel(), index);
+  if (!convert_row) return 0;
+  if ((w < 0) || (h < 0)) return 0;
+  if (input_pitch < (w * 2)) return 0;
+  if (output_pitch < (w * 4)) return 0;
+  if (!StartStatistics(&a, statistics, w, h)) return 0;
+  InitFixedPointTables();
+  for (y = 0; y < h; y++) {
+    convert_row(input, output, w);
+    AccumulateRowStatistics(&a, input, y);
+    input += input_pitch;
+    output += output_pitch;
+  }
+  FinishStatistics(&a, encoding->range, statistics);
+  return 1;
+}
+
+int CreateDirtyTileTracker(DirtyTileTracker *tracker, int w, int h,
+    int threshold, const ColorEncoding *encoding) {
+  size_t tile_count;
+  memset(tracker, 0, sizeof(*tracker));
+  if (!encoding) encoding = &default_color_encoding;
+  if ((w <= 0) || (h <= 0) || (threshold < 0) ||
+    (ColorEncodingIndex(encoding) < 0)) {
+    errno = EINVAL;
+    return 0;
+  }
+  tracker->w = w;
+  tracker->h = h;
+  tracker->tile_columns = (w + DIRTY_TILE_WIDTH - 1) / DIRTY_TILE_WIDTH;
+  tracker->tile_rows = (h + DIRTY_TILE_HEIGHT - 1) / DIRTY_TILE_HEIGHT;
+  tracker->threshold = threshold;
+  tracker->encoding = *encoding;
+  tracker->convert_all = 1;
+  tile_count = ((size_t) tracker->tile_columns) * tracker->tile_rows;
+  tracker->reference = (uint8_t *) malloc(((size_t) w) * h * 2);
+  // Every region starts at a different tile, so there can't be more regions
+  // than tiles.
+  tracker->dirty_regions = (FrameRegion *) malloc(tile_count *
+    sizeof(FrameRegion));
+  tracker->column_regions = (int *) malloc(tracker->tile_columns * 2 *
+    sizeof(int));
+  if (!tracker->reference || !tracker->dirty_regions ||
+    !tracker->column_regions) {
+    DestroyDirtyTileTracker(tracker);
+    errno = ENOMEM;
+    return 0;
+  }
+  return 1;
+}
+
+void DestroyDirtyTileTracker(DirtyTileTracker *tracker) {
+  free(tracker->reference);
+  free(tracker->dirty_regions);
+  free(tracker->column_regions);
+  memset(tracker, 0, sizeof(*tracker));
+}
+
+void ResetDirtyTileTracker(DirtyTileTracker *tracker) {
+  tracker->convert_all = 1;
+}
+
+// Returns nonzero if the tile whose top-left corner is at the given input and
+// reference pointers has changed by more than the threshold. Stops comparing
+// as soon as the difference is large enough.
+static int TileChanged(DirtyTileTracker *tracker,
+    RowDifferencer difference_row, const uint8_t *input, int input_pitch,
+    const uint8_t *reference, int tile_w, int tile_h) {
+  uint64_t limit = ((uint64_t) tracker->threshold) * tile_w * tile_h * 2;
+  uint64_t sum = 0;
+  int y;
+  for (y = 0; y < tile_h; y++) {
+    sum += difference_row(input, reference, tile_w * 2);
+    if (sum > limit) return 1;
+    input += input_pitch;
+    reference += tracker->w * 2;
+  }
+  return 0;
+}
+
+// Records that the given run of tiles in the current tile row was converted,
+// extending the region the same columns had in the previous tile row if there
+// is one. previous and current are the halves of column_regions for the
+// previous and current tile rows.
+static void AddDirtyRegion(DirtyTileTracker *tracker, int *previous,
+    int *current, int first_column, int x, int y, int w, int h) {
+  int index = previous[first_column];
+  FrameRegion *region;
+  if ((index >= 0) && (tracker->dirty_regions[index].w == w)) {
+    tracker->dirty_regions[index].h += h;
+    current[first_column] = index;
+    return;
+  }
+  index = tracker->dirty_region_count;
+  tracker->dirty_region_count++;
+  region = tracker->dirty_regions + index;
+  region->x = x;
+  region->y = y;
+  region->w = w;
+  region->h = h;
+  current[first_column] = index;
+}
+
+// Converts h rows of the pixels from x to x + w - 1, and saves their samples
+// in the reference, starting at the given row of it. The row converter treats
+// its input as the start of a row, so if the run ends with the lone last pixel
+// of an odd-width frame, and doesn't start the row, that pixel is converted
+// separately to borrow the preceding pair's V sample as a full conversion
+// would.
+static void ConvertDirtyRun(DirtyTileTracker *tracker,
+    RGBARowConverter convert_row, uint8_t *input, int input_pitch,
+    uint8_t *output, int output_pitch, uint8_t *reference, int x, int w,
+    int h) {
+  const FixedPointTables *t = fixed_tables +
+    ColorEncodingIndex(&(tracker->encoding));
+  int lone_pixel = (x > 0) && ((w % 2) != 0);
+  int y;
+  reference += x * 2;
+  input += x * 2;
+  output += x * 4;
+  for (y = 0; y < h; y++) {
+    convert_row(input, output, w - lone_pixel);
+    if (lone_pixel) {
+      ConvertLonePixelFixed(t, input + (w - 1) * 2, output + (w - 1) * 4, 1);
+    }
+    memcpy(reference, input, w * 2);
+    input += input_pitch;
+    output += output_pitch;
+    reference += tracker->w * 2;
+  }
+}
+
+int ConvertYUYVToRGBAIncremental(DirtyTileTracker *tracker, uint8_t *input,
+    uint8_t *output, int input_pitch, int output_pitch) {
+  ConversionKernel kernel = GetBestConversionKernel();
+  RGBARowConverter convert_row = GetRGBARowConverter(kernel,
+    ColorEncodingIndex(&(tracker->encoding)));
+  RowDifferencer difference_row = GetRowDifferencer(kernel);
+  int w = tracker->w, tile_row, column, run_start, changed, x, y, tile_w;
+  int tile_h, *previous, *current, *swap;
+  uint8_t *reference;
+  if (!convert_row || !difference_row) return 0;
+  if (input_pitch < (w * 2)) return 0;
+  if (output_pitch < (w * 4)) return 0;
+  InitFixedPointTables();
+  tracker->dirty_region_count = 0;
+  previous = tracker->column_regions;
+  current = previous + tracker->tile_columns;
+  for (column = 0; column < tracker->tile_columns; column++) {
+    previous[column] = -1;
+  }
+  for (tile_row = 0; tile_row < tracker->tile_rows; tile_row++) {
+    y = tile_row * DIRTY_TILE_HEIGHT;
+    tile_h = tracker->h - y;
+    if (tile_h > DIRTY_TILE_HEIGHT) tile_h = DIRTY_TILE_HEIGHT;
+    reference = tracker->reference + ((size_t) y) * w * 2;
+    for (column = 0; column < tracker->tile_columns; column++) {
+      current[column] = -1;
+    }
+    // Find runs of changed tiles, converting each one once it ends. The
+    // extra iteration past the last column ends the final run.
+    run_start = -1;
+    for (column = 0; column <= tracker->tile_columns; column++) {
+      changed = 0;
+      if (column < tracker->tile_columns) {
+        x = column * DIRTY_TILE_WIDTH;
+        tile_w = w - x;
+        if (tile_w > DIRTY_TILE_WIDTH) tile_w = DIRTY_TILE_WIDTH;
+        changed = tracker->convert_all || TileChanged(tracker,
+          difference_row, input + x * 2, input_pitch, reference + x * 2,
+          tile_w, tile_h);
+        // A last column one pixel wide borrows the V sample at the end of the
+        // previous tile, so it's converted whenever that tile is.
+        if ((tile_w == 1) && (run_start >= 0)) changed = 1;
+      }
+      if (changed) {
+        if (run_start < 0) run_start = column;
+        continue;
+      }
+      if (run_start < 0) continue;
+      x = run_start * DIRTY_TILE_WIDTH;
+      tile_w = column * DIRTY_TILE_WIDTH;
+      if (tile_w > w) tile_w = w;
+      tile_w -= x;
+      ConvertDirtyRun(tracker, convert_row, input, input_pitch, output,
+        output_pitch, reference, x, tile_w, tile_h);
+      AddDirtyRegion(tracker, previous, current, run_start, x, y, tile_w,
+        tile_h);
+      tracker->converted_tile_count += column - run_start;
+      run_start = -1;
+    }
+    input += ((size_t) input_pitch) * tile_h;
+    output += ((size_t) output_pitch) * tile_h;
+    swap = previous;
+    previous = current;
+    current = swap;
+  }
+  tracker->frame_count++;
+  tracker->tile_count += ((uint64_t) tracker->tile_columns) *
+    tracker->tile_rows;
+  tracker->convert_all = 0;
+  return 1;
+}
+
+int GetDirtyRegions(DirtyTileTracker *tracker, const FrameRegion **regions) {
+  *regions = tracker->dirty_regions;
+  return tracker->dirty_region_count;
+}
+
+double GetSkippedTileFraction(DirtyTileTracker *tracker) {
+  if (tracker->tile_count == 0) return 0;
+  return 1.0 - (((double) tracker->converted_tile_count) /
+    tracker->tile_count);
+}
+
+int ConvertYUYVToGrey(uint8_t *input, uint8_t *output, int w, int h,
+    int input_pitch, int output_pitch) {
+  LumaRowConverter luma_row = GetLumaRowConverter(GetBestConversionKernel());
+  int y;
+  if ((w < 0) || (h < 0)) return 0;
+  if ((input_pitch < (w * 2)) || (output_pitch < w)) return 0;
+  for (y = 0; y < h; y++) {
+    luma_row(input, output, w);
+    input += input_pitch;
+    output += output_pitch;
+  }
+  return 1;
+}
+
+// Converts a YUYV frame to I420 or NV12, depending on whether interleaved is
+// set. For NV12, u_plane holds the interleaved chroma and v_plane is unused.
+// Returns 0 on error.
+static int ConvertYUYVTo420(uint8_t *input, int w, int h, int input_pitch,
+    uint8_t *y_plane, int y_pitch, uint8_t *u_plane, uint8_t *v_plane,
+    int chroma_pitch, int interleaved) {
+  ConversionKernel kernel = GetBestConversionKernel();
+  LumaRowConverter luma_row = GetLumaRowConverter(kernel);
+  ChromaRowConverter chroma_row = GetChromaRowConverter(kernel, interleaved);
+  uint8_t *second_row;
+  int y;
+  // Chroma is only subsampled horizontally in YUYV, so w must cover whole
+  // pixel pairs.
+  if ((w < 0) || (h < 0) || ((w % 2) != 0)) return 0;
+  if ((input_pitch < (w * 2)) || (y_pitch < w)) return 0;
+  if (chroma_pitch < (interleaved ? w : (w / 2))) return 0;
+  for (y = 0; y < h; y += 2) {
+    // The last row of a frame with an odd height has no partner, so its
+    // chroma is used as it is.
+    second_row = (y + 1) < h ? input + input_pitch : input;
+    luma_row(input, y_plane, w);
+    if (second_row != input) luma_row(second_row, y_plane + y_pitch, w);
+    chroma_row(input, second_row, u_plane, v_plane, w / 2);
+    input += ((size_t) input_pitch) * 2;
+    y_plane += ((size_t) y_pitch) * 2;
+    u_plane += chroma_pitch;
+    if (!interleaved) v_plane += chroma_pitch;
+  }
+  return 1;
+}
+
+int ConvertYUYVToI420(uint8_t *input, int w, int h, int input_pitch,
+    uint8_t *y_plane, int y_pitch, uint8_t *u_plane, uint8_t *v_plane,
+    int chroma_pitch) {
+  return ConvertYUYVTo420(input, w, h, input_pitch, y_plane, y_pitch,
+    u_plane, v_plane, chroma_pitch, 0);
+}
+
+int ConvertYUYVToNV12(uint8_t *input, int w, int h, int input_pitch,
+    uint8_t *y_plane, int y_pitch, uint8_t *uv_plane, int uv_pitch) {
+  return ConvertYUYVTo420(input, w, h, input_pitch, y_plane, y_pitch,
+    uv_plane, NULL, uv_pitch, 1);
+}
+
+// One eye's output for a stereo split, with the row function to produce it.
+// row is NULL if the eye isn't wanted.
+typedef struct {
+  void (*row)(const uint8_t *input, uint8_t *output, int w);
+  uint8_t *data;
+  int pitch;
+} StereoEyeTarget;
+
+// The arguments for converting a range of rows of a stereo frame.
+typedef struct {
+  uint8_t *input;
+  int input_pitch;
+  int eye_w;
+  StereoEyeTarget eyes[2];
+} StereoSplitArgs;
+
+// Looks up the row function for one eye's output format and color encoding,
+// and checks its pitch. Returns 0 if the output is invalid.
+static int PrepareStereoEye(StereoEyeOutput *eye, int eye_w,
+    ConversionKernel kernel, StereoEyeTarget *target) {
+  int encoding;
+  memset(target, 0, sizeof(*target));
+  if (!eye || !eye->data) return 1;
+  if (eye->format == RGBA_FORMAT_CODE) {
+    if (eye->pitch < (eye_w * 4)) return 0;
+    encoding = ColorEncodingIndex(eye->encoding ? eye->encoding :
+      &default_color_encoding);
+    if (encoding < 0) return 0;
+    target->row = GetRGBARowConverter(kernel, encoding);
+  } else if (eye->format == V4L2_PIX_FMT_GREY) {
+    if (eye->pitch < eye_w) return 0;
+    target->row = GetLumaRowConverter(kernel);
+  } else {
+    return 0;
+  }
+  target->data = eye->data;
+  target->pitch = eye->pitch;
+  return target->row != NULL;
+}
+
+// Fills in the arguments for a stereo split. Returns 0 on error.
+static int PrepareStereoSplit(uint8_t *input, int w, int h, int input_pitch,
+    StereoEyeOutput *left, StereoEyeOutput *right, StereoSplitArgs *args) {
+  ConversionKernel kernel = GetBestConversionKernel();
+  // Each eye must start on a whole YUYV pixel pair.
+  if ((w < 0) || (h < 0) || ((w % 4) != 0)) return 0;
+  if (input_pitch < (w * 2)) return 0;
+  args->input = input;
+  args->input_pitch = input_pitch;
+  args->eye_w = w / 2;
+  if (!PrepareStereoEye(left, args->eye_w, kernel, args->eyes)) return 0;
+  if (!PrepareStereoEye(right, args->eye_w, kernel, args->eyes + 1)) {
+    return 0;
+  }
+  InitFixedPointTables();
+  return 1;
+}
+
+// Converts a range of rows of a stereo frame. Each input row is read once,
+// with the left half going to one output and the right half to the other.
+static void ConvertStereoStripe(void *arg, int start_row, int end_row) {
+  StereoSplitArgs *args = (StereoSplitArgs *) arg;
+  StereoEyeTarget *eye;
+  uint8_t *input;
+  int y, i;
+  for (y = start_row; y < end_row; y++) {
+    input = args->input + ((size_t) y) * args->input_pitch;
+    for (i = 0; i < 2; i++) {
+      eye = args->eyes + i;
+      if (!eye->row) continue;
+      eye->row(input + i * args->eye_w * 2, eye->data + ((size_t) y) *
+        eye->pitch, args->eye_w);
+    }
+  }
+}
+
+int ConvertStereoYUYV(uint8_t *input, int w, int h, int input_pitch,
+    StereoEyeOutput *left, StereoEyeOutput *right) {
+  StereoSplitArgs args;
+  if (!PrepareStereoSplit(input, w, h, input_pitch, left, right, &args)) {
+    return 0;
+  }
+  ConvertStereoStripe(&args, 0, h);
+  return 1;
+}
+
+// The number of input pixels a downscaled conversion sums at a time. The
+// column sums for a chunk are kept on the stack, so this bounds its size.
+#define DOWNSCALE_CHUNK_PIXELS (2048)
+
+// The arguments for a downscaled conversion, shared by every stripe.
+typedef struct {
+  uint8_t *input;
+  int input_pitch;
+  uint8_t *output;
+  int output_pitch;
+  // The region's top-left corner, in input pixels.
+  int x;
+  int y;
+  int factor;
+  int output_w;
+  YUVPixelConverter convert_pixels;
+  ColumnSummer sum_columns;
+  // Set if the factor is 2 and the region starts on a pixel pair, in which
+  // case every block is a pixel pair in each of two rows, and the general
+  // code isn't needed.
+  HalvingRowConverter halve_row;
+  // The same for a factor of 4, where every block is two pixel pairs in each
+  // of four rows.
+  QuarteringRowConverter quarter_row;
+  // Set if the factor is even and above 4 and the region starts on a pixel
+  // pair, so every block is made of whole pairs.
+  PairBlockReducer reduce_pair_blocks;
+  // Dividing a block's sum by its area, rounded to nearest, is done by
+  // multiplying the sum plus half the area by this and shifting right by 32.
+  uint64_t reciprocal;
+} DownscaleArgs;
+
+// Averages blocks of factor columns in the column sums of a chunk, storing
+// each block's average Y, U and V samples. sums holds the sums of each byte
+// of the chunk's YUYV pixel pairs, starting with the pair containing the
+// first pixel; first_is_odd is set if the first pixel is the second of its
+// pair. Each pixel contributes its pair's U and V samples to its block's
+// chroma. The blocks are walked a pair at a time, with a block that starts or
+// ends in the middle of a pair taking just that pixel's share of it. This is
+// always inlined so the common factors get loops with a constant trip count.
+static inline __attribute__((always_inline)) void ReduceDownscaleChunk(
+    const uint16_t *sums, int first_is_odd, uint8_t *y, uint8_t *u,
+    uint8_t *v, int output_count, int factor, uint64_t reciprocal) {
+  uint32_t y_sum, u_sum, v_sum;
+  const uint16_t *pair = sums;
+  int i, k, starts_odd = first_is_odd;
+  for (i = 0; i < output_count; i++) {
+    y_sum = 0;
+    u_sum = 0;
+    v_sum = 0;
+    k = factor;
+    if (starts_odd) {
+      y_sum = pair[2];
+      u_sum = pair[1];
+      v_sum = pair[3];
+      pair += 4;
+      k--;
+    }
+    for (; k >= 2; k -= 2) {
+      y_sum += pair[0] + pair[2];
+      u_sum += pair[1] * 2;
+      v_sum += pair[3] * 2;
+      pair += 4;
+    }
+    // If the block ends on the first pixel of a pair, the next block starts
+    // on the second.
+    starts_odd = k;
+    if (k) {
+      y_sum += pair[0];
+      u_sum += pair[1];
+      v_sum += pair[3];
+    }
+    y[i] = BlockAverage(y_sum, factor, reciprocal);
+    u[i] = BlockAverage(u_sum, factor, reciprocal);
+    v[i] = BlockAverage(v_sum, factor, reciprocal);
+  }
+}
+
+// Produces output rows start_row through end_row - 1 of a downscaled
+// conversion. The input is processed in chunks of columns: each chunk's
+// bytes are summed down the block's rows into a small buffer of 16-bit
+// column sums, and the sums are then reduced horizontally to output pixels.
+static void ConvertDownscaledStripe(void *arg, int start_row, int end_row) {
+  DownscaleArgs *args = (DownscaleArgs *) arg;
+  uint16_t sums[DOWNSCALE_CHUNK_PIXELS * 2 + 4];
+  uint8_t y[DOWNSCALE_CHUNK_PIXELS], u[DOWNSCALE_CHUNK_PIXELS],
+    v[DOWNSCALE_CHUNK_PIXELS];
+  int chunk_outputs = DOWNSCALE_CHUNK_PIXELS / args->factor;
+  int factor = args->factor;
+  int out_y, chunk_start, chunk_count, first_pixel, byte_start, byte_count;
+  int first_is_odd;
+  uint8_t *input, *output;
+  for (out_y = start_row; out_y < end_row; out_y++) {
+    output = args->output + ((size_t) out_y) * args->output_pitch;
+    if (args->halve_row) {
+      input = args->input + ((size_t) (args->y + out_y * 2)) *
+        args->input_pitch + args->x * 2;
+      args->halve_row(input, input + args->input_pitch, output,
+        args->output_w);
+      continue;
+    }
+    if (args->quarter_row) {
+      input = args->input + ((size_t) (args->y + out_y * 4)) *
+        args->input_pitch + args->x * 2;
+      args->quarter_row(input, args->input_pitch, output, args->output_w);
+      continue;
+    }
+    for (chunk_start = 0; chunk_start < args->output_w;
+      chunk_start += chunk_outputs) {
+      chunk_count = args->output_w - chunk_start;
+      if (chunk_count > chunk_outputs) chunk_count = chunk_outputs;
+      // Sum whole pixel pairs, so every pixel's chroma is available.
+      first_pixel = args->x + chunk_start * factor;
+      first_is_odd = first_pixel & 1;
+      byte_start = (first_pixel & ~1) * 2;
+      byte_count = (((first_pixel + chunk_count * factor + 1) & ~1) * 2) -
+        byte_start;
+      input = args->input + ((size_t) (args->y + out_y * factor)) *
+        args->input_pitch + byte_start;
+      args->sum_columns(input, args->input_pitch, factor, sums, byte_count);
+      output = args->output + ((size_t) out_y) * args->output_pitch +
+        chunk_start * 4;
+      if (args->reduce_pair_blocks) {
+        args->reduce_pair_blocks(sums, factor, args->reciprocal, y, u, v,
+          chunk_count);
+      } else if (factor == 2) {
+        ReduceDownscaleChunk(sums, first_is_odd, y, u, v, chunk_count, 2, 0);
+      } else if (factor == 3) {
+        ReduceDownscaleChunk(sums, first_is_odd, y, u, v, chunk_count, 3, 0);
+      } else {
+        ReduceDownscaleChunk(sums, first_is_odd, y, u, v, chunk_count,
+          factor, args->reciprocal);
+      }
+      args->convert_pixels(y, u, v, output, chunk_count);
+    }
+  }
+}
+
+// Checks the arguments for a downscaled conversion and fills in args, using
+// the given color encoding index. Sets output_h to the number of output rows.
+// Returns 0 on error.
+static int PrepareDownscale(int encoding, uint8_t *input, int w, int h,
+    int input_pitch, const FrameRegion *region, int factor, uint8_t *output,
+    int output_pitch, DownscaleArgs *args, int *output_h) {
+  FrameRegion whole_frame;
+  int area;
+  if (encoding < 0) return 0;
+  if ((w < 0) || (h < 0) || ((w % 2) != 0)) return 0;
+  if (input_pitch < (w * 2)) return 0;
+  if ((factor < 1) || (factor > MAX_DOWNSCALE_FACTOR)) return 0;
+  if (!region) {
+    whole_frame.x = 0;
+    whole_frame.y = 0;
+    whole_frame.w = w;
+    whole_frame.h = h;
+    region = &whole_frame;
+  }
+  if ((region->x < 0) || (region->y < 0) || (region->w < 0) ||
+    (region->h < 0) || (region->w > (w - region->x)) ||
+    (region->h > (h - region->y))) {
+    return 0;
+  }
+  args->output_w = region->w / factor;
+  if (output_pitch < (args->output_w * 4)) return 0;
+  args->input = input;
+  args->input_pitch = input_pitch;
+  args->output = output;
+  args->output_pitch = output_pitch;
+  args->x = region->x;
+  args->y = region->y;
+  args->factor = factor;
+  args->convert_pixels = GetYUVPixelConverter(GetBestConversionKernel(),
+    encoding);
+  args->sum_columns = GetColumnSummer(GetBestConversionKernel());
+  args->halve_row = NULL;
+  if ((factor == 2) && ((region->x % 2) == 0)) {
+    args->halve_row = GetHalvingRowConverter(GetBestConversionKernel(),
+      encoding);
+  }
+  args->quarter_row = NULL;
+  if ((factor == 4) && ((region->x % 2) == 0)) {
+    args->quarter_row = GetQuarteringRowConverter(GetBestConversionKernel(),
+      encoding);
+  }
+  args->reduce_pair_blocks = NULL;
+  if ((factor > 4) && ((factor % 2) == 0) && ((region->x % 2) == 0)) {
+    args->reduce_pair_blocks = GetPairBlockReducer(GetBestConversionKernel());
+  }
+  // This is exact for every sum a block can have, since the sums are below
+  // 256 * area and area is at most 2^12.
+  area = factor * factor;
+  args->reciprocal = ((1ULL << 32) + area - 1) / area;
+  *output_h = region->h / factor;
+  InitFixedPointTables();
+  return 1;
+}
+
+int ConvertYUYVToRGBADownscaled(uint8_t *input, int w, int h,
+    int input_pitch, const FrameRegion *region, int factor, uint8_t *output,
+    int output_pitch) {
+  return ConvertYUYVToRGBADownscaledWithEncoding(&default_color_encoding,
+    input, w, h, input_pitch, region, factor, output, output_pitch);
+}
+
+int ConvertYUYVToRGBADownscaledWithEncoding(const ColorEncoding *encoding,
+    uint8_t *input, int w, int h, int input_pitch, const FrameRegion *region,
+    int factor, uint8_t *output, int output_pitch) {
+  DownscaleArgs args;
+  int output_h;
+  if (!PrepareDownscale(ColorEncodingIndex(encoding), input, w, h,
+    input_pitch, region, factor, output, output_pitch, &args, &output_h)) {
+    return 0;
+  }
+  ConvertDownscaledStripe(&args, 0, output_h);
+  return 1;
+}
+
+// Converts a frame with a full-resolution luma plane followed by chroma
+// subsampled by 2 in both directions. chroma_step is the distance in bytes
+// between consecutive U (or V) samples in a chroma row, chroma_pitch is the
+// size of a chroma row, and u_plane and v_plane point to the first U and V
+// samples. encoding is the index of the color encoding.
+static void ConvertPlanar420ToRGBA(uint8_t *input, uint8_t *u_plane,
+    uint8_t *v_plane, int chroma_step, int chroma_pitch, uint8_t *output,
+    int w, int h, int input_pitch, int output_pitch, int encoding) {
+  const FixedPointTables *t = fixed_tables + encoding;
+  uint8_t *luma, *u, *v, *out;
+  int x, y, offset;
+  InitFixedPointTables();
+  for (y = 0; y < h; y++) {
+    luma = input + ((size_t) y) * input_pitch;
+    u = u_plane + ((size_t) (y / 2)) * chroma_pitch;
+    v = v_plane + ((size_t) (y / 2)) * chroma_pitch;
+    out = output + ((size_t) y) * output_pitch;
+    for (x = 0; x < w; x++) {
+      offset = (x / 2) * chroma_step;
+      WriteFixedPixel(t, luma[x], u[offset], v[offset], out + x * 4);
+    }
+  }
+}
+
+// Returns nonzero if the frame's dimensions and pitches are valid and
+// input_size holds a 4:2:0 frame with the given chroma pitch.
+static int Valid420Frame(size_t input_size, int w, int h, int input_pitch,
+    int output_pitch, int chroma_pitch, int chroma_planes) {
+  size_t expected_size;
+  if ((w < 0) || (h < 0)) return 0;
+  if ((input_pitch < w) || (output_pitch < (w * 4))) return 0;
+  expected_size = ((size_t) input_pitch) * h + ((size_t) chroma_pitch) *
+    ((h + 1) / 2) * chroma_planes;
+  return input_size >= expected_size;
+}
+
+// Converts NV12 frames: a luma plane followed by a plane of interleaved U, V
+// samples with the same pitch.
+static int ConvertNV12ToRGBA(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch,
+    int encoding) {
+  uint8_t *chroma = input + ((size_t) input_pitch) * h;
+  if (!Valid420Frame(input_size, w, h, input_pitch, output_pitch,
+    input_pitch, 1)) {
+    return 0;
+  }
+  ConvertPlanar420ToRGBA(input, chroma, chroma + 1, 2, input_pitch, output,
+    w, h, input_pitch, output_pitch, encoding);
+  return 1;
+}
+
+// Converts YU12 (aka I420) frames: a luma plane followed by a U plane and
+// then a V plane, both with half the luma pitch.
+static int ConvertYU12ToRGBA(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch,
+    int encoding) {
+  int chroma_pitch = input_pitch / 2;
+  uint8_t *u_plane = input + ((size_t) input_pitch) * h;
+  uint8_t *v_plane = u_plane + ((size_t) chroma_pitch) * ((h + 1) / 2);
+  if (!Valid420Frame(input_size, w, h, input_pitch, output_pitch,
+    chroma_pitch, 2)) {
+    return 0;
+  }
+  ConvertPlanar420ToRGBA(input, u_plane, v_plane, 1, chroma_pitch, output, w,
+    h, input_pitch, output_pitch, encoding);
+  return 1;
+}
+
+// Converts GREY frames, which hold full-range luma samples, to RGBA.
+static int ConvertGreyToRGBA(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch) {
+  uint8_t *luma, *out;
+  int x, y;
+  if ((w < 0) || (h < 0)) return 0;
+  if ((input_pitch < w) || (output_pitch < (w * 4))) return 0;
+  if (input_size < (((size_t) input_pitch) * h)) return 0;
+  for (y = 0; y < h; y++) {
+    luma = input + ((size_t) y) * input_pitch;
+    out = output + ((size_t) y) * output_pitch;
+    for (x = 0; x < w; x++) {
+      out[0] = 0xff;
+      out[1] = luma[x];
+      out[2] = luma[x];
+      out[3] = luma[x];
+      out += 4;
+    }
+  }
+  return 1;
+}
+
+// Checks that input_size holds h rows of w YUYV pixels with the given pitch.
+static int ValidYUYVFrame(size_t input_size, int w, int h, int input_pitch) {
+  return !h || (input_size >= (((size_t) input_pitch) * (h - 1) + w * 2));
+}
+
+// Converts YUYV frames to RGBA, with the fastest kernel.
+static int ConvertYUYVFrameToRGBA(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch,
+    int encoding) {
+  if (!ValidYUYVFrame(input_size, w, h, input_pitch)) return 0;
+  return ConvertYUYVToRGBAWithKernelAndEncoding(GetBestConversionKernel(),
+    encoding, input, output, w, h, input_pitch, output_pitch);
+}
+
+// Adapts ConvertYUYVToGrey to the FrameConverter interface.
+static int ConvertYUYVFrameToGrey(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch) {
+  if (!ValidYUYVFrame(input_size, w, h, input_pitch)) return 0;
+  return ConvertYUYVToGrey(input, output, w, h, input_pitch, output_pitch);
+}
+
+// Adapts ConvertYUYVToI420 to the FrameConverter interface, using the YU12
+// layout: a U plane and then a V plane after the luma plane, both with half
+// the luma pitch.
+static int ConvertYUYVFrameToYU12(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch) {
+  int chroma_pitch = output_pitch / 2;
+  uint8_t *u_plane = output + ((size_t) output_pitch) * h;
+  uint8_t *v_plane = u_plane + ((size_t) chroma_pitch) * ((h + 1) / 2);
+  if (!ValidYUYVFrame(input_size, w, h, input_pitch)) return 0;
+  return ConvertYUYVToI420(input, w, h, input_pitch, output, output_pitch,
+    u_plane, v_plane, chroma_pitch);
+}
+
+// Adapts ConvertYUYVToNV12 to the FrameConverter interface, with the
+// interleaved chroma plane after the luma plane, using the same pitch.
+static int ConvertYUYVFrameToNV12(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch) {
+  if (!ValidYUYVFrame(input_size, w, h, input_pitch)) return 0;
+  return ConvertYUYVToNV12(input, w, h, input_pitch, output, output_pitch,
+    output + ((size_t) output_pitch) * h, output_pitch);
+}
+
+// Used for converting any format to itself.
+static int PassThroughFrame(uint8_t *input, size_t input_size,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch) {
+  memcpy(output, input, input_size);
+  return 1;
+}
+
+// Holds one entry in the table of frame converters.
+typedef struct {
+  uint32_t input_format;
+  uint32_t output_format;
+  FrameConverter converter;
+} ConverterEntry;
+
+// Defines name##_<index> for each color encoding, a FrameConverter that calls
+// name with the encoding's index.
+#define DEFINE_FRAME_CONVERTER_FOR_ENCODING(encoding, name) \
+  static int name##_##encoding(uint8_t *input, size_t input_size, \
+      uint8_t *output, int w, int h, int input_pitch, int output_pitch) { \
+    return name(input, input_size, output, w, h, input_pitch, \
+      output_pitch, encoding); \
+  }
+
+FOR_EACH_COLOR_ENCODING(DEFINE_FRAME_CONVERTER_FOR_ENCODING,
+  ConvertYUYVFrameToRGBA)
+FOR_EACH_COLOR_ENCODING(DEFINE_FRAME_CONVERTER_FOR_ENCODING,
+  ConvertNV12ToRGBA)
+FOR_EACH_COLOR_ENCODING(DEFINE_FRAME_CONVERTER_FOR_ENCODING,
+  ConvertYU12ToRGBA)
+
+// The built-in converters whose output depends on the color encoding, for
+// each encoding.
+#define ENCODING_CONVERTER_COUNT (3)
+#define ENCODING_CONVERTER_ENTRIES(encoding, unused) { \
+    {YUYV_FORMAT_CODE, RGBA_FORMAT_CODE, ConvertYUYVFrameToRGBA_##encoding}, \
+    {V4L2_PIX_FMT_NV12, RGBA_FORMAT_CODE, ConvertNV12ToRGBA_##encoding}, \
+    {V4L2_PIX_FMT_YUV420, RGBA_FORMAT_CODE, ConvertYU12ToRGBA_##encoding}, \
+  },
+
+static const ConverterEntry encoding_converters[COLOR_ENCODING_COUNT][
+  ENCODING_CONVERTER_COUNT] = {
+  FOR_EACH_COLOR_ENCODING(ENCODING_CONVERTER_ENTRIES, 0)
+};
+
+// The remaining built-in converters.
+static const ConverterEntry builtin_converters[] = {
+  {V4L2_PIX_FMT_GREY, RGBA_FORMAT_CODE, ConvertGreyToRGBA},
+  {YUYV_FORMAT_CODE, V4L2_PIX_FMT_GREY, ConvertYUYVFrameToGrey},
+  {YUYV_FORMAT_CODE, V4L2_PIX_FMT_YUV420, ConvertYUYVFrameToYU12},
+  {YUYV_FORMAT_CODE, V4L2_PIX_FMT_NV12, ConvertYUYVFrameToNV12},
+};
+
+// The converters added using RegisterFrameConverter, protected by
+// converters_mutex.
+static ConverterEntry registered_converters[MAX_REGISTERED_CONVERTERS];
+static int registered_converter_count = 0;
+static pthread_mutex_t converters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int RegisterFrameConverter(uint32_t input_format, uint32_t output_format,
+    FrameConverter converter) {
+  ConverterEntry *entry;
+  if (!converter) {
+    errno = EINVAL;
+    return 0;
+  }
+  pthread_mutex_lock(&converters_mutex);
+  if (registered_converter_count >= MAX_REGISTERED_CONVERTERS) {
+    pthread_mutex_unlock(&converters_mutex);
+    errno = ENOSPC;
+    return 0;
+  }
+  entry = registered_converters + registered_converter_count;
+  entry->input_format = input_format;
+  entry->output_format = output_format;
+  entry->converter = converter;
+  registered_converter_count++;
+  pthread_mutex_unlock(&converters_mutex);
+  return 1;
+}
+
+// Implements GetFrameConverterForEncoding, given the index of the color
+// encoding.
+static FrameConverter FindFrameConverter(uint32_t input_format,
+    uint32_t output_format, int encoding) {
+  FrameConverter converter = NULL;
+  const ConverterEntry *entry;
+  int i;
+  // Search backwards so later registrations take precedence.
+  pthread_mutex_lock(&converters_mutex);
+  for (i = registered_converter_count - 1; i >= 0; i--) {
+    entry = registered_converters + i;
+    if ((entry->input_format == input_format) &&
+      (entry->output_format == output_format)) {
+      converter = entry->converter;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&converters_mutex);
+  if (converter) return converter;
+  for (i = 0; i < ENCODING_CONVERTER_COUNT; i++) {
+    entry = encoding_converters[encoding] + i;
+    if ((entry->input_format == input_format) &&
+      (entry->output_format == output_format)) {
+      return entry->converter;
+    }
+  }
+  for (i = 0; i < (sizeof(builtin_converters) / sizeof(ConverterEntry));
+    i++) {
+    entry = builtin_converters + i;
+    if ((entry->input_format == input_format) &&
+      (entry->output_format == output_format)) {
+      return entry->converter;
+    }
+  }
+  if (input_format == output_format) return PassThroughFrame;
+  return NULL;
+}
+
+FrameConverter GetFrameConverter(uint32_t input_format,
+    uint32_t output_format) {
+  return FindFrameConverter(input_format, output_format,
+    DEFAULT_COLOR_ENCODING);
+}
+
+FrameConverter GetFrameConverterForEncoding(uint32_t input_format,
+    uint32_t output_format, const ColorEncoding *encoding) {
+  int index = ColorEncodingIndex(encoding);
+  if (index < 0) return NULL;
+  return FindFrameConverter(input_format, output_format, index);
+}
+
+// Converts a range of rows in one of the stripes for a parallel conversion.
+// The arguments are shared by every stripe.
+typedef struct {
+  RGBARowConverter convert_row;
+  uint8_t *input;
+  uint8_t *output;
+  int w;
+  int input_pitch;
+  int output_pitch;
+} RGBAStripeArgs;
+
+static void ConvertRGBAStripe(void *arg, int start_row, int end_row) {
+  RGBAStripeArgs *args = (RGBAStripeArgs *) arg;
+  uint8_t *input = args->input + ((size_t) start_row) * args->input_pitch;
+  uint8_t *output = args->output + ((size_t) start_row) * args->output_pitch;
+  int y;
+  for (y = start_row; y < end_row; y++) {
+    args->convert_row(input, output, args->w);
+    input += args->input_pitch;
+    output += args->output_pitch;
+  }
+}
+
+// Runs the pool's current job on the given stripe of rows.
+static void RunPoolStripe(ConversionPool *pool, int stripe) {
+  int start_row, end_row;
+  start_row = (int) ((((int64_t) pool->job_rows) * stripe) /
+    pool->thread_count);
+  end_row = (int) ((((int64_t) pool->job_rows) * (stripe + 1)) /
+    pool->thread_count);
+  if (start_row < end_row) pool->job(pool->job_arg, start_row, end_row);
+}
+
+static void *ConversionPoolWorkerThread(void *arg) {
+  ConversionPoolWorker *worker = (ConversionPoolWorker *) arg;
+  ConversionPool *pool = worker->pool;
+  uint64_t last_generation = 0;
+  pthread_mutex_lock(&(pool->mutex));
+  while (1) {
+    while (!pool->quit && (pool->generation == last_generation)) {
+      pthread_cond_wait(&(pool->work_ready), &(pool->mutex));
+    }
+    if (pool->quit) break;
+    last_generation = pool->generation;
+    pthread_mutex_unlock(&(pool->mutex));
+    RunPoolStripe(pool, worker->stripe);
+    pthread_mutex_lock(&(pool->mutex));
+    pool->stripes_remaining--;
+    if (pool->stripes_remaining == 0) {
+      pthread_cond_signal(&(pool->work_done));
+    }
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+  return NULL;
+}
+
+// Runs job on every stripe of a frame with the given number of rows, and
+// waits for all of the stripes to finish.
+static void RunPoolJob(ConversionPool *pool, void (*job)(void *, int, int),
+    void *arg, int rows) {
+  pthread_mutex_lock(&(pool->mutex));
+  pool->job = job;
+  pool->job_arg = arg;
+  pool->job_rows = rows;
+  pool->stripes_remaining = pool->thread_count - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&(pool->work_ready));
+  pthread_mutex_unlock(&(pool->mutex));
+  RunPoolStripe(pool, 0);
+  pthread_mutex_lock(&(pool->mutex));
+  while (pool->stripes_remaining > 0) {
+    pthread_cond_wait(&(pool->work_done), &(pool->mutex));
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+// Pins the given thread to a single CPU. Returns 0 on error.
+static int PinThread(pthread_t thread, int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  errno = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+  return errno == 0;
+}
+
+// Stops and joins the first worker_count worker threads.
+static void StopPoolWorkers(ConversionPool *pool, int worker_count) {
+  int i;
+  pthread_mutex_lock(&(pool->mutex));
+  pool->quit = 1;
+  pthread_cond_broadcast(&(pool->work_ready));
+  pthread_mutex_unlock(&(pool->mutex));
+  for (i = 0; i < worker_count; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+}
+
+// Initializes the pool's mutex and condition variables. Returns 0 with errno
+// set on error, after destroying any that were initialized.
+static int InitPoolSynchronization(ConversionPool *pool) {
+  int result;
+  result = pthread_mutex_init(&(pool->mutex), NULL);
+  if (result != 0) goto error_exit;
+  result = pthread_cond_init(&(pool->work_ready), NULL);
+  if (result != 0) {
+    pthread_mutex_destroy(&(pool->mutex));
+    goto error_exit;
+  }
+  result = pthread_cond_init(&(pool->work_done), NULL);
+  if (result != 0) {
+    pthread_cond_destroy(&(pool->work_ready));
+    pthread_mutex_destroy(&(pool->mutex));
+    goto error_exit;
+  }
+  return 1;
+error_exit:
+  errno = result;
+  return 0;
+}
+
+int CreateConversionPool(ConversionPool *pool, int thread_count,
+    int pin_threads) {
+  int i, cpu_count;
+  ConversionPoolWorker *worker;
+  memset(pool, 0, sizeof(*pool));
+  cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpu_count < 1) cpu_count = 1;
+  if (thread_count <= 0) thread_count = cpu_count;
+  pool->thread_count = thread_count;
+  if (thread_count > 1) {
+    pool->workers = (ConversionPoolWorker *) calloc(thread_count - 1,
+      sizeof(ConversionPoolWorker));
+    if (!pool->workers) return 0;
+  }
+  // The error path below uses the mutex to stop the workers, so it can't be
+  // taken until the mutex exists.
+  if (!InitPoolSynchronization(pool)) {
+    free(pool->workers);
+    pool->workers = NULL;
+    return 0;
+  }
+  for (i = 0; i < (thread_count - 1); i++) {
+    worker = pool->workers + i;
+    worker->pool = pool;
+    worker->stripe = i + 1;
+    errno = pthread_create(&(worker->thread), NULL,
+      ConversionPoolWorkerThread, worker);
+    if (errno != 0) goto error_exit;
+    if (pin_threads && !PinThread(worker->thread, i % cpu_count)) {
+      // This thread was started, so it needs to be stopped too.
+      i++;
+      goto error_exit;
+    }
+  }
+  return 1;
+error_exit:
+  StopPoolWorkers(pool, i);
+  DestroyConversionPool(pool);
+  return 0;
+}
+
+void DestroyConversionPool(ConversionPool *pool) {
+  if (!pool->quit) StopPoolWorkers(pool, pool->thread_count - 1);
+  pthread_mutex_destroy(&(pool->mutex));
+  pthread_cond_destroy(&(pool->work_ready));
+  pthread_cond_destroy(&(pool->work_done));
+  free(pool->workers);
+  memset(pool, 0, sizeof(*pool));
+}
+
+int GetConversionPoolThreadCount(ConversionPool *pool) {
+  return pool->thread_count;
+}
+
+int ConvertStereoYUYVParallel(ConversionPool *pool, uint8_t *input, int w,
+    int h, int input_pitch, StereoEyeOutput *left, StereoEyeOutput *right) {
+  StereoSplitArgs args;
+  if (!PrepareStereoSplit(input, w, h, input_pitch, left, right, &args)) {
+    return 0;
+  }
+  RunPoolJob(pool, ConvertStereoStripe, &args, h);
+  return 1;
+}
+
+int ConvertYUYVToRGBADownscaledParallel(ConversionPool *pool,
+    uint8_t *input, int w, int h, int input_pitch, const FrameRegion *region,
+    int factor, uint8_t *output, int output_pitch) {
+  return ConvertYUYVToRGBADownscaledParallelWithEncoding(pool,
+    &default_color_encoding, input, w, h, input_pitch, region, factor, output,
+    output_pitch);
+}
+
+int ConvertYUYVToRGBADownscaledParallelWithEncoding(ConversionPool *pool,
+    const ColorEncoding *encoding, uint8_t *input, int w, int h,
+    int input_pitch, const FrameRegion *region, int factor, uint8_t *output,
+    int output_pitch) {
+  DownscaleArgs args;
+  int output_h;
+  if (!PrepareDownscale(ColorEncodingIndex(encoding), input, w, h,
+    input_pitch, region, factor, output, output_pitch, &args, &output_h)) {
+    return 0;
+  }
+  RunPoolJob(pool, ConvertDownscaledStripe, &args, output_h);
+  return 1;
+}
+
+// Implements the parallel YUYV to RGBA conversions, given the index of the
+// color encoding. Returns 0 on error.
+static int ConvertYUYVToRGBAParallelWithIndex(ConversionPool *pool,
+    int encoding, uint8_t *input, uint8_t *output, int w, int h,
+    int input_pitch, int output_pitch) {
+  RGBAStripeArgs args;
+  if ((w < 0) || (h < 0)) return 0;
+  if (input_pitch < (w * 2)) return 0;
+  if (output_pitch < (w * 4)) return 0;
+  InitFixedPointTables();
+  args.convert_row = GetRGBARowConverter(GetBestConversionKernel(),
+    encoding);
+  args.input = input;
+  args.output = output;
+  args.w = w;
+  args.input_pitch = input_pitch;
+  args.output_pitch = output_pitch;
+  RunPoolJob(pool, ConvertRGBAStripe, &args, h);
+  return 1;
+}
+
+int ConvertYUYVToRGBAParallel(ConversionPool *pool, uint8_t *input,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch) {
+  return ConvertYUYVToRGBAParallelWithIndex(pool, DEFAULT_COLOR_ENCODING,
+    input, output, w, h, input_pitch, output_pitch);
+}
+
+int ConvertYUYVToRGBAParallelWithEncoding(ConversionPool *pool,
+    const ColorEncoding *encoding, uint8_t *input, uint8_t *output, int w,
+    int h, int input_pitch, int output_pitch) {
+  int index = ColorEncodingIndex(encoding);
+  if (index < 0) return 0;
+  return ConvertYUYVToRGBAParallelWithIndex(pool, index, input, output, w, h,
+    input_pitch, output_pitch);
+}
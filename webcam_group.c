@@ -0,0 +1,352 @@
+// This file implements the capture groups declared in webcam_lib.h.
+//
+// Every device's fd is registered with the group's epoll set when the group
+// is created, with the device's index as the event data. The stop_fd eventfd
+// is registered too, so a single write to it wakes up every capture thread
+// when the group is stopped.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "webcam_lib.h"
+
+// The epoll event data used for the stop_fd, rather than a device index.
+#define STOP_EVENT_ID (0xffffffff)
+
+// The maximum number of events handled per call to epoll_wait.
+#define MAX_EPOLL_EVENTS (32)
+
+// Records the first error for a device and removes it from the epoll set, so
+// it doesn't keep waking up the other devices' waits.
+static void FailDevice(CaptureGroupDevice *device, int error) {
+  int expected = 0;
+  if (error == 0) error = EIO;
+  __atomic_compare_exchange_n(&(device->error), &expected, error, 0,
+    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  epoll_ctl(device->group->epoll_fd, EPOLL_CTL_DEL,
+    GetWebcamFD(device->webcam), NULL);
+  device->ready = 0;
+}
+
+static int DeviceFailed(CaptureGroupDevice *device) {
+  return __atomic_load_n(&(device->error), __ATOMIC_RELAXED) != 0;
+}
+
+// Stops or resumes waiting on the device. This removes the device from the
+// epoll set, since epoll always reports errors even for an fd with no events
+// selected.
+static void SetDevicePaused(CaptureGroupDevice *device, int paused) {
+  struct epoll_event event;
+  int fd = GetWebcamFD(device->webcam);
+  if (DeviceFailed(device) || (device->paused == paused)) return;
+  device->paused = paused;
+  if (paused) {
+    epoll_ctl(device->group->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    return;
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = device->id;
+  if (epoll_ctl(device->group->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    FailDevice(device, errno);
+  }
+}
+
+// Waits up to timeout_ns for epoll to report activity, marking the devices
+// that are readable. Devices reporting errors are marked too, so the error
+// gets picked up when the frame is dequeued. Returns the number of events, 0
+// on timeout, or -1 on error.
+static int WaitForGroupEvents(CaptureGroup *group, int64_t timeout_ns) {
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  int timeout_ms = -1, count, i;
+  uint32_t id;
+  // epoll only has millisecond precision, so round up rather than spinning
+  // on timeouts shorter than a millisecond.
+  if (timeout_ns >= 0) timeout_ms = (timeout_ns + 999999) / 1000000;
+  count = epoll_wait(group->epoll_fd, events, MAX_EPOLL_EVENTS, timeout_ms);
+  if (count < 0) {
+    if (errno == EINTR) return 0;
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    id = events[i].data.u32;
+    if (id == STOP_EVENT_ID) continue;
+    group->devices[id].ready = 1;
+    group->devices[id].error_reported = (events[i].events &
+      (EPOLLERR | EPOLLHUP)) != 0;
+  }
+  return count;
+}
+
+// Dequeues the next frame from the device, if one is ready. Fills in the
+// device fields of frame. Returns DEVICE_ERROR and fails the device on error.
+static FrameBufferState GetDeviceFrame(CaptureGroupDevice *device,
+    GroupFrame *frame) {
+  FrameBufferState state = GetFrame(device->webcam, &(frame->frame));
+  frame->device_id = device->id;
+  frame->webcam = device->webcam;
+  if (state == DEVICE_ERROR) {
+    FailDevice(device, errno);
+    return DEVICE_ERROR;
+  }
+  if (state == FRAME_NOT_READY) {
+    device->ready = 0;
+    // Without this, a device stuck reporting an error would keep waking up
+    // every wait on the group.
+    if (device->error_reported) {
+      FailDevice(device, EIO);
+      errno = EIO;
+      return DEVICE_ERROR;
+    }
+  }
+  return state;
+}
+
+int CreateCaptureGroup(CaptureGroup *group, WebcamInfo **webcams,
+    int device_count) {
+  struct epoll_event event;
+  CaptureGroupDevice *device;
+  int i;
+  memset(group, 0, sizeof(*group));
+  group->epoll_fd = -1;
+  group->stop_fd = -1;
+  if (device_count <= 0) {
+    errno = EINVAL;
+    return 0;
+  }
+  group->devices = (CaptureGroupDevice *) calloc(device_count,
+    sizeof(CaptureGroupDevice));
+  if (!group->devices) return 0;
+  group->device_count = device_count;
+  group->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (group->epoll_fd < 0) goto error_exit;
+  group->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (group->stop_fd < 0) goto error_exit;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = STOP_EVENT_ID;
+  if (epoll_ctl(group->epoll_fd, EPOLL_CTL_ADD, group->stop_fd, &event) < 0) {
+    goto error_exit;
+  }
+  for (i = 0; i < device_count; i++) {
+    device = group->devices + i;
+    device->group = group;
+    device->id = i;
+    device->webcam = webcams[i];
+    if (!BeginLoadingNextFrame(device->webcam)) goto error_exit;
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(group->epoll_fd, EPOLL_CTL_ADD, GetWebcamFD(webcams[i]),
+      &event) < 0) {
+      goto error_exit;
+    }
+  }
+  return 1;
+error_exit:
+  DestroyCaptureGroup(group);
+  return 0;
+}
+
+void DestroyCaptureGroup(CaptureGroup *group) {
+  int saved_errno = errno;
+  StopCaptureGroup(group);
+  if (group->epoll_fd >= 0) close(group->epoll_fd);
+  if (group->stop_fd >= 0) close(group->stop_fd);
+  free(group->devices);
+  memset(group, 0, sizeof(*group));
+  group->epoll_fd = -1;
+  group->stop_fd = -1;
+  errno = saved_errno;
+}
+
+FrameBufferState GetGroupFrame(CaptureGroup *group, GroupFrame *frame,
+    int64_t timeout_ns) {
+  CaptureGroupDevice *device;
+  FrameBufferState state;
+  int waited = 0, i, id;
+  frame->device_id = -1;
+  if (group->running) {
+    errno = EBUSY;
+    return DEVICE_ERROR;
+  }
+  while (1) {
+    for (i = 0; i < group->device_count; i++) {
+      id = (group->next_device + i) % group->device_count;
+      device = group->devices + id;
+      if (!device->ready || DeviceFailed(device)) continue;
+      state = GetDeviceFrame(device, frame);
+      if (state == DEVICE_ERROR) return DEVICE_ERROR;
+      if (state == FRAME_NOT_READY) continue;
+      device->held_frames++;
+      if (device->held_frames >= GetBufferCount(device->webcam)) {
+        SetDevicePaused(device, 1);
+      }
+      // Leave the device marked as ready, since it may have more frames, but
+      // give the next device the first chance next time.
+      group->next_device = (id + 1) % group->device_count;
+      return FRAME_READY;
+    }
+    // Nothing was ready, so wait once. After waiting, look through the
+    // devices one more time and give up if nothing arrived.
+    if (waited) return FRAME_NOT_READY;
+    if (WaitForGroupEvents(group, timeout_ns) < 0) return DEVICE_ERROR;
+    waited = 1;
+  }
+}
+
+int ReleaseGroupFrame(CaptureGroup *group, GroupFrame *frame) {
+  CaptureGroupDevice *device;
+  if ((frame->device_id < 0) || (frame->device_id >= group->device_count)) {
+    errno = EINVAL;
+    return 0;
+  }
+  device = group->devices + frame->device_id;
+  if (!ReleaseFrameBuffer(device->webcam, frame->frame.index)) return 0;
+  if (device->held_frames > 0) device->held_frames--;
+  if (device->paused) SetDevicePaused(device, 0);
+  return 1;
+}
+
+// Dequeues every ready frame from the device, passing each one to the
+// callback and then releasing it. Fails the device on error.
+static void DeliverDeviceFrames(CaptureGroupDevice *device) {
+  CaptureGroup *group = device->group;
+  GroupFrame frame;
+  FrameBufferState state;
+  while (device->ready && !DeviceFailed(device)) {
+    state = GetDeviceFrame(device, &frame);
+    if (state != FRAME_READY) return;
+    group->callback(&frame, group->user_data);
+    if (!ReleaseFrameBuffer(device->webcam, frame.frame.index)) {
+      FailDevice(device, errno);
+    }
+  }
+}
+
+// Returns nonzero if StopCaptureGroup has been called. This doesn't consume
+// the event, since every capture thread needs to see it.
+static int StopRequested(CaptureGroup *group) {
+  struct pollfd poll_info;
+  poll_info.fd = group->stop_fd;
+  poll_info.events = POLLIN;
+  poll_info.revents = 0;
+  return poll(&poll_info, 1, 0) > 0;
+}
+
+// The thread that waits on every device in CAPTURE_GROUP_EPOLL mode.
+static void *EpollCaptureThread(void *arg) {
+  CaptureGroup *group = (CaptureGroup *) arg;
+  CaptureGroupDevice *device;
+  int i;
+  while (!StopRequested(group)) {
+    if (WaitForGroupEvents(group, -1) < 0) break;
+    for (i = 0; i < group->device_count; i++) {
+      device = group->devices + i;
+      if (device->ready) DeliverDeviceFrames(device);
+    }
+  }
+  return NULL;
+}
+
+// The thread that waits on one device in CAPTURE_GROUP_THREAD_PER_DEVICE
+// mode. This polls the device's fd directly rather than using the epoll set.
+static void *DeviceCaptureThread(void *arg) {
+  CaptureGroupDevice *device = (CaptureGroupDevice *) arg;
+  struct pollfd poll_info[2];
+  int result;
+  poll_info[0].fd = GetWebcamFD(device->webcam);
+  poll_info[0].events = POLLIN;
+  poll_info[1].fd = device->group->stop_fd;
+  poll_info[1].events = POLLIN;
+  while (!DeviceFailed(device)) {
+    poll_info[0].revents = 0;
+    poll_info[1].revents = 0;
+    result = poll(poll_info, 2, -1);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      FailDevice(device, errno);
+      break;
+    }
+    if (poll_info[1].revents) break;
+    device->ready = 1;
+    device->error_reported = (poll_info[0].revents &
+      (POLLERR | POLLHUP | POLLNVAL)) != 0;
+    DeliverDeviceFrames(device);
+  }
+  return NULL;
+}
+
+int StartCaptureGroup(CaptureGroup *group, CaptureGroupMode mode,
+    GroupFrameCallback callback, void *user_data) {
+  CaptureGroupDevice *device;
+  int i, result;
+  if (group->running || !callback) {
+    errno = EINVAL;
+    return 0;
+  }
+  group->callback = callback;
+  group->user_data = user_data;
+  group->mode = mode;
+  group->running = 1;
+  if (mode == CAPTURE_GROUP_EPOLL) {
+    result = pthread_create(&(group->epoll_thread), NULL, EpollCaptureThread,
+      group);
+    if (result != 0) {
+      group->running = 0;
+      errno = result;
+      return 0;
+    }
+    return 1;
+  }
+  if (mode != CAPTURE_GROUP_THREAD_PER_DEVICE) {
+    group->running = 0;
+    errno = EINVAL;
+    return 0;
+  }
+  for (i = 0; i < group->device_count; i++) {
+    device = group->devices + i;
+    result = pthread_create(&(device->thread), NULL, DeviceCaptureThread,
+      device);
+    if (result != 0) {
+      StopCaptureGroup(group);
+      errno = result;
+      return 0;
+    }
+    device->thread_started = 1;
+  }
+  return 1;
+}
+
+void StopCaptureGroup(CaptureGroup *group) {
+  uint64_t value = 1;
+  int i;
+  if (!group->running) return;
+  if (write(group->stop_fd, &value, sizeof(value)) < 0) {
+    // This can only fail if the counter would overflow, which would still
+    // leave the fd readable.
+  }
+  if (group->mode == CAPTURE_GROUP_EPOLL) {
+    pthread_join(group->epoll_thread, NULL);
+  }
+  for (i = 0; i < group->device_count; i++) {
+    if (!group->devices[i].thread_started) continue;
+    pthread_join(group->devices[i].thread, NULL);
+    group->devices[i].thread_started = 0;
+  }
+  if (read(group->stop_fd, &value, sizeof(value)) < 0) {
+    // The eventfd was written above, so this can't fail.
+  }
+  group->running = 0;
+}
+
+int GetCaptureGroupDeviceError(CaptureGroup *group, int device_id) {
+  if ((device_id < 0) || (device_id >= group->device_count)) return EINVAL;
+  return __atomic_load_n(&(group->devices[device_id].error),
+    __ATOMIC_RELAXED);
+}
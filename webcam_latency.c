@@ -0,0 +1,110 @@
+// This file implements the latency histograms declared in webcam_lib.h.
+//
+// Bucket indices follow the layout used by HDR histograms: values below
+// 2^LATENCY_SUB_BUCKET_BITS get a bucket each, and every power of two above
+// that is split into 2^LATENCY_SUB_BUCKET_BITS equally sized buckets. So the
+// index is computed from the position of the highest set bit plus the next
+// few bits below it, without any loops or divisions.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "webcam_lib.h"
+
+#define SUB_BUCKET_COUNT (1 << LATENCY_SUB_BUCKET_BITS)
+
+static const char *stage_names[LATENCY_STAGE_COUNT] = {
+  "capture to dequeue",
+  "dequeue to convert",
+  "convert to present",
+  "capture to present",
+};
+
+// Returns the index of the bucket holding the given value.
+static int BucketIndex(uint64_t value) {
+  int highest_bit, shift;
+  if (value < SUB_BUCKET_COUNT) return (int) value;
+  highest_bit = 63 - __builtin_clzll(value);
+  shift = highest_bit - LATENCY_SUB_BUCKET_BITS;
+  return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) +
+    ((int) ((value >> shift) & (SUB_BUCKET_COUNT - 1)));
+}
+
+// Returns the largest value that falls into the bucket with the given index.
+static uint64_t BucketUpperBound(int index) {
+  int shift;
+  uint64_t base;
+  if (index < SUB_BUCKET_COUNT) return index;
+  shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+  base = SUB_BUCKET_COUNT + (index & (SUB_BUCKET_COUNT - 1));
+  return ((base + 1) << shift) - 1;
+}
+
+void ResetFrameLatencyStats(FrameLatencyStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void RecordLatency(LatencyHistogram *histogram, int64_t latency_ns) {
+  uint64_t value = latency_ns < 0 ? 0 : (uint64_t) latency_ns;
+  uint64_t max = __atomic_load_n(&(histogram->max_ns), __ATOMIC_RELAXED);
+  __atomic_fetch_add(histogram->counts + BucketIndex(value), 1,
+    __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(histogram->count), 1, __ATOMIC_RELAXED);
+  while ((value > max) && !__atomic_compare_exchange_n(&(histogram->max_ns),
+    &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // The failed exchange reloaded max, so just check it again.
+  }
+}
+
+uint64_t GetLatencyPercentile(LatencyHistogram *histogram,
+    double percentile) {
+  uint64_t count = __atomic_load_n(&(histogram->count), __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&(histogram->max_ns), __ATOMIC_RELAXED);
+  uint64_t target, seen = 0, bound;
+  int i;
+  if (count == 0) return 0;
+  if (percentile < 0) percentile = 0;
+  if (percentile > 100) percentile = 100;
+  // Use the nearest-rank method, so the target is between 1 and count.
+  target = (uint64_t) ((percentile / 100.0) * count + 0.5);
+  if (target < 1) target = 1;
+  if (target > count) target = count;
+  for (i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+    seen += __atomic_load_n(histogram->counts + i, __ATOMIC_RELAXED);
+    if (seen < target) continue;
+    bound = BucketUpperBound(i);
+    return bound < max ? bound : max;
+  }
+  return max;
+}
+
+void RecordFrameLatency(FrameLatencyStats *stats, WebcamFrame *frame,
+    int64_t converted_ns, int64_t presented_ns) {
+  RecordLatency(stats->stages + LATENCY_CAPTURE_TO_DEQUEUE,
+    frame->dequeue_ns - frame->capture_ns);
+  RecordLatency(stats->stages + LATENCY_DEQUEUE_TO_CONVERT,
+    converted_ns - frame->dequeue_ns);
+  RecordLatency(stats->stages + LATENCY_CONVERT_TO_PRESENT,
+    presented_ns - converted_ns);
+  RecordLatency(stats->stages + LATENCY_CAPTURE_TO_PRESENT,
+    presented_ns - frame->capture_ns);
+}
+
+const char *LatencyStageName(LatencyStage stage) {
+  if ((stage < 0) || (stage >= LATENCY_STAGE_COUNT)) return "unknown";
+  return stage_names[stage];
+}
+
+void PrintFrameLatencyStats(FrameLatencyStats *stats) {
+  LatencyHistogram *histogram;
+  int i;
+  printf("Frame latency (ms):    frames      p50      p99      max\n");
+  for (i = 0; i < LATENCY_STAGE_COUNT; i++) {
+    histogram = stats->stages + i;
+    printf("  %-18s %10llu %8.3f %8.3f %8.3f\n",
+      LatencyStageName((LatencyStage) i),
+      (unsigned long long) histogram->count,
+      GetLatencyPercentile(histogram, 50.0) / 1e6,
+      GetLatencyPercentile(histogram, 99.0) / 1e6,
+      histogram->max_ns / 1e6);
+  }
+}
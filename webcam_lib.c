@@ -1,20 +1,89 @@
 // Author: Nathan Otterness (otternes@cs.unc.edu)
 //
 // This file implements the API defined in webcam_lib.h.
+#define _GNU_SOURCE
 #include <errno.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/videodev2.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include "webcam_lib.h"
 
-// The specifier used when requesting the YUYV format from V4L2.
-#define YUYV_FORMAT_CODE (v4l2_fourcc('Y', 'U', 'Y', 'V'))
+// The size of the huge pages used by AllocateCaptureArena. This is the default
+// huge page size on x86-64 and arm64.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// The most formats, frame sizes or frame intervals a capability cache file
+// may contain. This only guards against allocating huge amounts of memory for
+// a corrupt file; real devices list far fewer.
+#define MAX_CACHED_ENTRIES (1 << 20)
+
+// The start of a capability cache file. It's followed by the snapshot's
+// formats, frame sizes and frame intervals, in that order. All values are in
+// the host's byte order.
+typedef struct {
+  char magic[8];
+  // The device's capabilities when the file was written. The file is only
+  // used if they still match.
+  struct v4l2_capability capabilities;
+  uint32_t format_count;
+  uint32_t size_count;
+  uint32_t interval_count;
+  uint32_t reserved;
+} CapabilityCacheHeader;
+
+// The number of entries allocated for each of a snapshot's arrays while it's
+// being built.
+typedef struct {
+  uint32_t formats;
+  uint32_t sizes;
+  uint32_t intervals;
+} SnapshotCapacity;
+
+// The directory set by SetCapabilityCacheDirectory, or an empty string if
+// capabilities aren't being cached.
+static char capability_cache_directory[PATH_MAX];
+
+// Passes an ioctl on to the webcam's backend.
+static int DeviceIoctl(WebcamInfo *webcam, unsigned long request, void *arg) {
+  return webcam->backend->ioctl(webcam, request, arg);
+}
+
+static int V4L2Ioctl(WebcamInfo *webcam, unsigned long request, void *arg) {
+  return ioctl(webcam->fd, request, arg);
+}
+
+static void *V4L2Mmap(WebcamInfo *webcam, size_t length, off_t offset) {
+  return mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, webcam->fd,
+    offset);
+}
+
+static void V4L2Munmap(WebcamInfo *webcam, void *address, size_t length) {
+  munmap(address, length);
+}
+
+static void V4L2Close(WebcamInfo *webcam) {
+  close(webcam->fd);
+}
+
+// The backend used for real V4L2 devices, which passes everything through to
+// the driver.
+static const WebcamBackend v4l2_backend = {
+  "v4l2",
+  V4L2Ioctl,
+  V4L2Mmap,
+  V4L2Munmap,
+  V4L2Close,
+};
 
 // Prints the meaning of the set flags in the v4l2_capability struct's flag
 // fields.
@@ -103,70 +172,480 @@ static void PrintCapabilityFlagDetails(uint32_t flags) {
   }
 }
 
-// Takes a file descriptor for a device and a pixel format from the
-// v4l2_fmtdesc struct and prints a list of frame sizes supported by the
-// format. Returns 0 on error, 1 on success.
-static int PrintFormatFrameSizes(int fd, uint32_t pixel_format) {
-  struct v4l2_frmsizeenum info;
-  int result;
-  uint32_t current_index;
-  info.pixel_format = pixel_format;
-  for (current_index = 0; ; current_index++) {
-    info.index = current_index;
-    result = ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &info);
-    if (result < 0) {
-      if (errno == EINVAL) break;
+static void FreeCapabilitySnapshot(CapabilitySnapshot *snapshot) {
+  free(snapshot->formats);
+  free(snapshot->sizes);
+  free(snapshot->intervals);
+  memset(snapshot, 0, sizeof(*snapshot));
+}
+
+// Makes room for another entry at the end of an array holding count entries,
+// doubling its capacity when it's full. Returns 0 on error.
+static int GrowArray(void **array, uint32_t count, uint32_t *capacity,
+    size_t entry_size) {
+  uint32_t new_capacity;
+  void *resized;
+  if (count < *capacity) return 1;
+  new_capacity = *capacity ? (*capacity * 2) : 16;
+  resized = realloc(*array, new_capacity * entry_size);
+  if (!resized) return 0;
+  *array = resized;
+  *capacity = new_capacity;
+  return 1;
+}
+
+// Returns nonzero if an enumeration ioctl failed because there are no more
+// entries, or because the driver can't enumerate them at all.
+static int EndOfList(void) {
+  return (errno == EINVAL) || (errno == ENOTTY);
+}
+
+// Adds the frame intervals supported at the given format and frame size to
+// the snapshot. For ranges of sizes, this asks about the maximum size. Returns
+// 0 on error.
+static int ProbeFrameIntervals(WebcamInfo *webcam,
+    CapabilitySnapshot *snapshot, SnapshotCapacity *capacity,
+    uint32_t pixel_format, CapabilityFrameSize *size) {
+  struct v4l2_frmivalenum info;
+  CapabilityFrameInterval *interval;
+  uint32_t i;
+  size->first_interval = snapshot->interval_count;
+  size->interval_count = 0;
+  for (i = 0; ; i++) {
+    memset(&info, 0, sizeof(info));
+    info.index = i;
+    info.pixel_format = pixel_format;
+    info.width = size->max.width;
+    info.height = size->max.height;
+    if (DeviceIoctl(webcam, VIDIOC_ENUM_FRAMEINTERVALS, &info) < 0) {
+      return EndOfList();
+    }
+    if (!GrowArray((void **) &(snapshot->intervals), snapshot->interval_count,
+      &(capacity->intervals), sizeof(*interval))) {
       return 0;
     }
-    if (info.type == V4L2_FRMSIZE_TYPE_CONTINUOUS) {
-      printf("    Continuous frame size.\n");
+    interval = snapshot->intervals + snapshot->interval_count;
+    memset(interval, 0, sizeof(*interval));
+    interval->type = info.type;
+    snapshot->interval_count++;
+    size->interval_count++;
+    if (info.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+      interval->min = info.discrete;
+      interval->max = info.discrete;
       continue;
     }
+    // Continuous and stepwise ranges are only reported at index 0.
+    interval->min = info.stepwise.min;
+    interval->max = info.stepwise.max;
+    interval->step = info.stepwise.step;
+    return 1;
+  }
+}
+
+// Adds the frame sizes supported in the snapshot's format at format_index,
+// along with their frame intervals, to the snapshot. Returns 0 on error.
+static int ProbeFrameSizes(WebcamInfo *webcam, CapabilitySnapshot *snapshot,
+    SnapshotCapacity *capacity, uint32_t format_index) {
+  CapabilityFormat *format = snapshot->formats + format_index;
+  struct v4l2_frmsizeenum info;
+  CapabilityFrameSize *size;
+  uint32_t i;
+  format->first_size = snapshot->size_count;
+  format->size_count = 0;
+  for (i = 0; ; i++) {
+    memset(&info, 0, sizeof(info));
+    info.index = i;
+    info.pixel_format = format->pixel_format;
+    if (DeviceIoctl(webcam, VIDIOC_ENUM_FRAMESIZES, &info) < 0) {
+      return EndOfList();
+    }
+    if (!GrowArray((void **) &(snapshot->sizes), snapshot->size_count,
+      &(capacity->sizes), sizeof(*size))) {
+      return 0;
+    }
+    size = snapshot->sizes + snapshot->size_count;
+    memset(size, 0, sizeof(*size));
+    size->type = info.type;
+    snapshot->size_count++;
+    format->size_count++;
     if (info.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
-      printf("    Discrete %dx%d frames\n", info.discrete.width,
-        info.discrete.height);
-      continue;
+      size->min.width = info.discrete.width;
+      size->min.height = info.discrete.height;
+      size->max = size->min;
+    } else {
+      size->min.width = info.stepwise.min_width;
+      size->min.height = info.stepwise.min_height;
+      size->max.width = info.stepwise.max_width;
+      size->max.height = info.stepwise.max_height;
+      size->step.width = info.stepwise.step_width;
+      size->step.height = info.stepwise.step_height;
+    }
+    if (!ProbeFrameIntervals(webcam, snapshot, capacity, format->pixel_format,
+      size)) {
+      return 0;
     }
-    printf("    Stepwise %d-%dx%d-%d frames\n", info.stepwise.min_width,
-      info.stepwise.max_width, info.stepwise.min_height,
-      info.stepwise.max_height);
+    // Like intervals, ranges of sizes are only reported at index 0.
+    if (info.type != V4L2_FRMSIZE_TYPE_DISCRETE) return 1;
   }
-  return 1;
 }
 
-// Takes a file descriptor for the device, and prints information about the
-// image formats it supports to stdout. Returns 0 on error, 1 on success.
-int PrintVideoFormatDetails(WebcamInfo *webcam) {
+// Builds a snapshot of the webcam's capabilities by asking the driver for
+// every format, frame size and frame interval. Returns 0 on error.
+static int ProbeCapabilities(WebcamInfo *webcam,
+    CapabilitySnapshot *snapshot) {
   struct v4l2_fmtdesc info;
-  uint32_t current_index = 0;
-  int result = 0;
-  info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  printf("Available image formats:\n");
-  while (1) {
-    info.index = current_index;
-    result = ioctl(webcam->fd, VIDIOC_ENUM_FMT, &info);
+  SnapshotCapacity capacity;
+  CapabilityFormat *format;
+  uint32_t i;
+  memset(snapshot, 0, sizeof(*snapshot));
+  memset(&capacity, 0, sizeof(capacity));
+  for (i = 0; ; i++) {
+    memset(&info, 0, sizeof(info));
+    info.index = i;
+    info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (DeviceIoctl(webcam, VIDIOC_ENUM_FMT, &info) < 0) {
+      if (EndOfList()) break;
+      goto error_exit;
+    }
+    if (!GrowArray((void **) &(snapshot->formats), snapshot->format_count,
+      &(capacity.formats), sizeof(*format))) {
+      goto error_exit;
+    }
+    format = snapshot->formats + snapshot->format_count;
+    memset(format, 0, sizeof(*format));
+    format->pixel_format = info.pixelformat;
+    format->flags = info.flags;
+    snprintf(format->description, sizeof(format->description), "%s",
+      (char *) info.description);
+    snapshot->format_count++;
+    if (!ProbeFrameSizes(webcam, snapshot, &capacity,
+      snapshot->format_count - 1)) {
+      goto error_exit;
+    }
+  }
+  return 1;
+error_exit:
+  FreeCapabilitySnapshot(snapshot);
+  return 0;
+}
+
+// Fills in path with the name of the webcam's capability cache file. Returns
+// 0 if the webcam's capabilities aren't cached. Only real devices are cached,
+// since the emulated ones are quick to probe, and their capabilities depend on
+// how they were opened rather than on their bus info.
+static int GetCapabilityCachePath(WebcamInfo *webcam, char *path,
+    size_t path_size) {
+  struct v4l2_capability *caps = &(webcam->capabilities);
+  char name[sizeof(caps->driver) + sizeof(caps->bus_info) + 1];
+  char *c;
+  if ((capability_cache_directory[0] == 0) ||
+    (webcam->backend != &v4l2_backend)) {
+    return 0;
+  }
+  snprintf(name, sizeof(name), "%s-%s", (char *) caps->driver,
+    (char *) caps->bus_info);
+  // Bus info such as "usb-0000:00:14.0-1" may contain characters that don't
+  // belong in file names.
+  for (c = name; *c != 0; c++) {
+    if (!isalnum((unsigned char) *c) && (*c != '-') && (*c != '_')) *c = '_';
+  }
+  return snprintf(path, path_size, "%s/%s.caps", capability_cache_directory,
+    name) < (int) path_size;
+}
+
+// Reads size bytes from the file into data. Returns 0 on error, including if
+// the file ends first.
+static int ReadFully(int fd, void *data, size_t size) {
+  uint8_t *current = (uint8_t *) data;
+  ssize_t result;
+  while (size > 0) {
+    result = read(fd, current, size);
     if (result < 0) {
-      if (errno == EINVAL) break;
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    if (result == 0) {
+      errno = EIO;
       return 0;
     }
-    printf("  %s", info.description);
-    if (info.flags != 0) {
+    current += result;
+    size -= result;
+  }
+  return 1;
+}
+
+// Writes size bytes from data to the file. Returns 0 on error.
+static int WriteFully(int fd, const void *data, size_t size) {
+  const uint8_t *current = (const uint8_t *) data;
+  ssize_t result;
+  while (size > 0) {
+    result = write(fd, current, size);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    current += result;
+    size -= result;
+  }
+  return 1;
+}
+
+// Allocates an array of count entries and reads it from the file. Leaves the
+// array NULL if count is 0. Returns 0 on error.
+static int ReadCachedArray(int fd, void **array, uint32_t count,
+    size_t entry_size) {
+  if (count == 0) return 1;
+  *array = calloc(count, entry_size);
+  if (!*array) return 0;
+  return ReadFully(fd, *array, count * entry_size);
+}
+
+// Returns nonzero if the count entries starting at first all fall within an
+// array of total entries.
+static int RangeInBounds(uint32_t first, uint32_t count, uint32_t total) {
+  return (first <= total) && (count <= (total - first));
+}
+
+// Returns nonzero if every index in the snapshot refers to an entry that
+// exists, so a corrupt cache file can't cause out-of-bounds reads.
+static int SnapshotIndicesValid(CapabilitySnapshot *snapshot) {
+  uint32_t i;
+  for (i = 0; i < snapshot->format_count; i++) {
+    if (!RangeInBounds(snapshot->formats[i].first_size,
+      snapshot->formats[i].size_count, snapshot->size_count)) {
+      return 0;
+    }
+  }
+  for (i = 0; i < snapshot->size_count; i++) {
+    if (!RangeInBounds(snapshot->sizes[i].first_interval,
+      snapshot->sizes[i].interval_count, snapshot->interval_count)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Loads the webcam's capability snapshot from the cache file at path. Returns
+// 0 if the file can't be read or doesn't match the device.
+static int LoadCachedCapabilities(WebcamInfo *webcam, const char *path) {
+  CapabilitySnapshot *snapshot = &(webcam->snapshot);
+  CapabilityCacheHeader header;
+  uint32_t i;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  if (!ReadFully(fd, &header, sizeof(header))) goto error_exit;
+  if ((memcmp(header.magic, CAPABILITY_CACHE_MAGIC, sizeof(header.magic))
+    != 0) || (memcmp(&(header.capabilities), &(webcam->capabilities),
+    sizeof(header.capabilities)) != 0)) {
+    goto error_exit;
+  }
+  if ((header.format_count > MAX_CACHED_ENTRIES) ||
+    (header.size_count > MAX_CACHED_ENTRIES) ||
+    (header.interval_count > MAX_CACHED_ENTRIES)) {
+    goto error_exit;
+  }
+  snapshot->format_count = header.format_count;
+  snapshot->size_count = header.size_count;
+  snapshot->interval_count = header.interval_count;
+  if (!ReadCachedArray(fd, (void **) &(snapshot->formats),
+    snapshot->format_count, sizeof(CapabilityFormat)) ||
+    !ReadCachedArray(fd, (void **) &(snapshot->sizes), snapshot->size_count,
+    sizeof(CapabilityFrameSize)) ||
+    !ReadCachedArray(fd, (void **) &(snapshot->intervals),
+    snapshot->interval_count, sizeof(CapabilityFrameInterval))) {
+    goto error_exit;
+  }
+  if (!SnapshotIndicesValid(snapshot)) goto error_exit;
+  for (i = 0; i < snapshot->format_count; i++) {
+    snapshot->formats[i].description[sizeof(snapshot->formats[i].description)
+      - 1] = 0;
+  }
+  snapshot->from_cache = 1;
+  close(fd);
+  return 1;
+error_exit:
+  close(fd);
+  FreeCapabilitySnapshot(snapshot);
+  return 0;
+}
+
+// Writes the webcam's capability snapshot to the cache file at path. The file
+// is written under a temporary name and then renamed, so other processes never
+// see a partly written file. Returns 0 on error.
+static int SaveCachedCapabilities(WebcamInfo *webcam, const char *path) {
+  CapabilitySnapshot *snapshot = &(webcam->snapshot);
+  CapabilityCacheHeader header;
+  char temp_path[PATH_MAX];
+  int fd;
+  if (snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path,
+    (int) getpid()) >= (int) sizeof(temp_path)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPABILITY_CACHE_MAGIC, sizeof(header.magic));
+  header.capabilities = webcam->capabilities;
+  header.format_count = snapshot->format_count;
+  header.size_count = snapshot->size_count;
+  header.interval_count = snapshot->interval_count;
+  fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return 0;
+  if (!WriteFully(fd, &header, sizeof(header)) ||
+    !WriteFully(fd, snapshot->formats, snapshot->format_count *
+    sizeof(CapabilityFormat)) ||
+    !WriteFully(fd, snapshot->sizes, snapshot->size_count *
+    sizeof(CapabilityFrameSize)) ||
+    !WriteFully(fd, snapshot->intervals, snapshot->interval_count *
+    sizeof(CapabilityFrameInterval))) {
+    goto error_exit;
+  }
+  if (close(fd) != 0) {
+    fd = -1;
+    goto error_exit;
+  }
+  fd = -1;
+  if (rename(temp_path, path) != 0) goto error_exit;
+  return 1;
+error_exit:
+  if (fd >= 0) close(fd);
+  unlink(temp_path);
+  return 0;
+}
+
+// Fills in the webcam's capability snapshot, from the cache if there's a
+// usable cache file, or otherwise from the driver, in which case the cache
+// file is written for next time. Returns 0 on error.
+static int LoadCapabilitySnapshot(WebcamInfo *webcam) {
+  char path[PATH_MAX];
+  int cached = GetCapabilityCachePath(webcam, path, sizeof(path));
+  if (cached && LoadCachedCapabilities(webcam, path)) return 1;
+  if (!ProbeCapabilities(webcam, &(webcam->snapshot))) return 0;
+  // Failing to write the cache only means the next open will be slower.
+  if (cached) SaveCachedCapabilities(webcam, path);
+  return 1;
+}
+
+const CapabilitySnapshot *GetCapabilitySnapshot(WebcamInfo *webcam) {
+  return &(webcam->snapshot);
+}
+
+int RefreshCapabilitySnapshot(WebcamInfo *webcam) {
+  CapabilitySnapshot snapshot;
+  char path[PATH_MAX];
+  if (!ProbeCapabilities(webcam, &snapshot)) return 0;
+  FreeCapabilitySnapshot(&(webcam->snapshot));
+  webcam->snapshot = snapshot;
+  if (GetCapabilityCachePath(webcam, path, sizeof(path))) {
+    SaveCachedCapabilities(webcam, path);
+  }
+  return 1;
+}
+
+int SetCapabilityCacheDirectory(const char *path) {
+  if (!path) {
+    capability_cache_directory[0] = 0;
+    return 1;
+  }
+  if (path[0] == 0) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (strlen(path) >= sizeof(capability_cache_directory)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  strcpy(capability_cache_directory, path);
+  return 1;
+}
+
+// Returns the snapshot's entry for the given pixel format, or NULL if the
+// webcam doesn't support it.
+static CapabilityFormat *FindCapabilityFormat(CapabilitySnapshot *snapshot,
+    uint32_t pixel_format) {
+  uint32_t i;
+  for (i = 0; i < snapshot->format_count; i++) {
+    if (snapshot->formats[i].pixel_format == pixel_format) {
+      return snapshot->formats + i;
+    }
+  }
+  return NULL;
+}
+
+// Prints the frame rates supported at the given frame size, followed by a
+// newline. Prints nothing else if the driver doesn't report them.
+static void PrintFrameRates(CapabilitySnapshot *snapshot,
+    CapabilityFrameSize *size) {
+  CapabilityFrameInterval *interval;
+  int printed = 0;
+  uint32_t i;
+  for (i = 0; i < size->interval_count; i++) {
+    interval = snapshot->intervals + size->first_interval + i;
+    if (interval->type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+      if (interval->min.numerator && interval->max.numerator) {
+        printf(" at %.2f-%.2f",
+          ((double) interval->max.denominator) / interval->max.numerator,
+          ((double) interval->min.denominator) / interval->min.numerator);
+        printed = 1;
+      }
+      break;
+    }
+    if (interval->min.numerator == 0) continue;
+    printf("%s%.2f", printed ? ", " : " at ",
+      ((double) interval->min.denominator) / interval->min.numerator);
+    printed = 1;
+  }
+  if (printed) printf(" FPS");
+  printf("\n");
+}
+
+// Prints the list of frame sizes supported by the given format, along with
+// their frame rates.
+static void PrintFormatFrameSizes(CapabilitySnapshot *snapshot,
+    CapabilityFormat *format) {
+  CapabilityFrameSize *size;
+  uint32_t i;
+  for (i = 0; i < format->size_count; i++) {
+    size = snapshot->sizes + format->first_size + i;
+    if (size->type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+      printf("    Discrete %dx%d frames", (int) size->max.width,
+        (int) size->max.height);
+    } else {
+      printf("    %s %d-%dx%d-%d frames",
+        size->type == V4L2_FRMSIZE_TYPE_CONTINUOUS ? "Continuous" :
+        "Stepwise", (int) size->min.width, (int) size->max.width,
+        (int) size->min.height, (int) size->max.height);
+    }
+    PrintFrameRates(snapshot, size);
+  }
+}
+
+// Prints information about the image formats the webcam supports to stdout.
+// Returns 0 on error, 1 on success.
+int PrintVideoFormatDetails(WebcamInfo *webcam) {
+  CapabilitySnapshot *snapshot = &(webcam->snapshot);
+  CapabilityFormat *format;
+  uint32_t i;
+  printf("Available image formats%s:\n", snapshot->from_cache ?
+    " (from the capability cache)" : "");
+  for (i = 0; i < snapshot->format_count; i++) {
+    format = snapshot->formats + i;
+    printf("  %s", format->description);
+    if (format->flags != 0) {
       printf(" (");
-      if (info.flags & 1) {
+      if (format->flags & 1) {
         printf("compressed");
-        if (info.flags != 1) {
+        if (format->flags != 1) {
           printf(", ");
         }
       }
-      if (info.flags & 2) {
+      if (format->flags & 2) {
         printf("emulated");
       }
       printf(")");
     }
     printf("\n");
     printf("  Supported frame sizes:\n");
-    if (!PrintFormatFrameSizes(webcam->fd, info.pixelformat)) return 0;
-    current_index++;
+    PrintFormatFrameSizes(snapshot, format);
   }
   return 1;
 }
@@ -197,209 +676,1151 @@ static int VerifyCaptureAndStreaming(WebcamInfo *webcam) {
   return (flags & desired) == desired;
 }
 
-int OpenWebcam(char *path, WebcamInfo *webcam) {
-  int fd = open(path, O_RDWR | O_NONBLOCK);
-  if (fd < 0) return 0;
+int OpenWebcamWithBackend(WebcamInfo *webcam, const WebcamBackend *backend,
+    int fd, void *backend_data) {
   memset(webcam, 0, sizeof(*webcam));
-  if (ioctl(fd, VIDIOC_QUERYCAP, &(webcam->capabilities)) < 0) {
-    close(fd);
+  webcam->fd = fd;
+  webcam->backend = backend;
+  webcam->backend_data = backend_data;
+  if (DeviceIoctl(webcam, VIDIOC_QUERYCAP, &(webcam->capabilities)) < 0) {
+    backend->close(webcam);
+    memset(webcam, 0, sizeof(*webcam));
     return 0;
   }
   if (!VerifyCaptureAndStreaming(webcam)) {
-    close(fd);
+    backend->close(webcam);
     memset(webcam, 0, sizeof(*webcam));
     errno = ENOTSUP;
     return 0;
   }
-  webcam->fd = fd;
-  // Set these once, since they're used pretty often.
-  webcam->buffer_info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  webcam->buffer_info.memory = V4L2_MEMORY_MMAP;
-  webcam->buffer_info.index = 0;
+  webcam->requested_buffer_count = DEFAULT_BUFFER_COUNT;
+  webcam->memory_type = V4L2_MEMORY_MMAP;
+  webcam->pixel_format = YUYV_FORMAT_CODE;
+  if (!LoadCapabilitySnapshot(webcam)) {
+    backend->close(webcam);
+    memset(webcam, 0, sizeof(*webcam));
+    return 0;
+  }
   return 1;
 }
 
-void CloseWebcam(WebcamInfo *webcam) {
-  close(webcam->fd);
-  if (webcam->image_buffer) {
-    munmap(webcam->image_buffer, webcam->buffer_info.length);
+// Opens a synthetic webcam given a path of the form
+// "synthetic:<width>x<height>@<fps>[:<pattern>]". Returns 0 on error.
+static int OpenSyntheticWebcamPath(char *path, WebcamInfo *webcam) {
+  unsigned int width, height, fps;
+  int pattern_start = 0;
+  SyntheticPattern pattern = SYNTHETIC_PATTERN_COLOR_BARS;
+  char *pattern_name;
+  if (sscanf(path, SYNTHETIC_PATH_PREFIX "%ux%u@%u%n", &width, &height, &fps,
+    &pattern_start) != 3) {
+    errno = EINVAL;
+    return 0;
+  }
+  pattern_name = path + pattern_start;
+  if (strcmp(pattern_name, ":noise") == 0) {
+    pattern = SYNTHETIC_PATTERN_NOISE;
+  } else if ((*pattern_name != 0) && (strcmp(pattern_name, ":bars") != 0)) {
+    errno = EINVAL;
+    return 0;
+  }
+  return OpenSyntheticWebcam(webcam, width, height, fps, pattern);
+}
+
+// Opens a replay webcam given a path of the form
+// "replay:<width>x<height>@<fps>:<file path>". Returns 0 on error.
+static int OpenReplayWebcamPath(char *path, WebcamInfo *webcam) {
+  unsigned int width, height, fps;
+  int file_start = 0;
+  if ((sscanf(path, REPLAY_PATH_PREFIX "%ux%u@%u:%n", &width, &height, &fps,
+    &file_start) != 3) || (file_start == 0)) {
+    errno = EINVAL;
+    return 0;
   }
+  return OpenReplayWebcam(webcam, path + file_start, width, height, fps);
+}
+
+// Opens a recording webcam given a path of the form
+// "recording:<fps>:<file path>". Returns 0 on error.
+static int OpenRecordingWebcamPath(char *path, WebcamInfo *webcam) {
+  unsigned int fps;
+  int file_start = 0;
+  if ((sscanf(path, RECORDING_PATH_PREFIX "%u:%n", &fps, &file_start) != 1) ||
+    (file_start == 0)) {
+    errno = EINVAL;
+    return 0;
+  }
+  return OpenRecordingWebcam(webcam, path + file_start, fps);
+}
+
+int OpenWebcam(char *path, WebcamInfo *webcam) {
+  int fd;
+  // Paths with these prefixes refer to the emulated devices, rather than a
+  // device file.
+  if (strncmp(path, SYNTHETIC_PATH_PREFIX,
+    strlen(SYNTHETIC_PATH_PREFIX)) == 0) {
+    return OpenSyntheticWebcamPath(path, webcam);
+  }
+  if (strncmp(path, REPLAY_PATH_PREFIX, strlen(REPLAY_PATH_PREFIX)) == 0) {
+    return OpenReplayWebcamPath(path, webcam);
+  }
+  if (strncmp(path, RECORDING_PATH_PREFIX,
+    strlen(RECORDING_PATH_PREFIX)) == 0) {
+    return OpenRecordingWebcamPath(path, webcam);
+  }
+  fd = open(path, O_RDWR | O_NONBLOCK);
+  if (fd < 0) return 0;
+  return OpenWebcamWithBackend(webcam, &v4l2_backend, fd, NULL);
+}
+
+// Unmaps and frees the capture buffers, if any have been allocated. Buffers in
+// an application-provided arena are left alone.
+static void FreeCaptureBuffers(WebcamInfo *webcam) {
+  uint32_t i;
+  CaptureBuffer *buffer;
+  if (!webcam->buffers) return;
+  for (i = 0; i < webcam->buffer_count; i++) {
+    buffer = webcam->buffers + i;
+    if (buffer->data && (webcam->memory_type == V4L2_MEMORY_MMAP)) {
+      webcam->backend->munmap(webcam, buffer->data, buffer->length);
+    }
+    if (buffer->dmabuf_fd >= 0) close(buffer->dmabuf_fd);
+  }
+  free(webcam->buffers);
+  webcam->buffers = NULL;
+  webcam->buffer_count = 0;
+}
+
+void CloseWebcam(WebcamInfo *webcam) {
+  if (!webcam->backend) return;
+  FreeCaptureBuffers(webcam);
+  FreeCapabilitySnapshot(&(webcam->snapshot));
+  webcam->backend->close(webcam);
   memset(webcam, 0, sizeof(*webcam));
 }
 
+int GetSupportedFormats(WebcamInfo *webcam, uint32_t *formats,
+    int formats_count) {
+  CapabilitySnapshot *snapshot = &(webcam->snapshot);
+  int i;
+  memset(formats, 0, sizeof(uint32_t) * formats_count);
+  for (i = 0; (i < formats_count) && (i < (int) snapshot->format_count);
+    i++) {
+    formats[i] = snapshot->formats[i].pixel_format;
+  }
+  return 1;
+}
+
+int SetPixelFormat(WebcamInfo *webcam, uint32_t pixel_format) {
+  // The format can't be changed once the buffers have been allocated.
+  if (webcam->buffers) return 0;
+  webcam->pixel_format = pixel_format;
+  return 1;
+}
+
+uint32_t GetPixelFormat(WebcamInfo *webcam) {
+  return webcam->pixel_format;
+}
+
+uint32_t GetBytesPerLine(WebcamInfo *webcam) {
+  return webcam->bytes_per_line;
+}
+
+ColorEncoding GetColorEncoding(WebcamInfo *webcam) {
+  return webcam->color_encoding;
+}
+
+int ChooseCaptureFormat(WebcamInfo *webcam, uint32_t output_format,
+    uint32_t *capture_format) {
+  CapabilitySnapshot *snapshot = &(webcam->snapshot);
+  CapabilityFormat *format;
+  uint32_t i;
+  int emulated;
+  // Look at the native formats on the first pass, and the emulated ones on
+  // the second.
+  for (emulated = 0; emulated <= 1; emulated++) {
+    for (i = 0; i < snapshot->format_count; i++) {
+      format = snapshot->formats + i;
+      if (((format->flags & V4L2_FMT_FLAG_EMULATED) != 0) != emulated) {
+        continue;
+      }
+      if (!GetFrameConverter(format->pixel_format, output_format)) continue;
+      *capture_format = format->pixel_format;
+      return 1;
+    }
+  }
+  errno = ENOENT;
+  return 0;
+}
+
 int GetSupportedResolutions(WebcamInfo *webcam, WebcamResolution *resolutions,
     int resolutions_count) {
-  struct v4l2_frmsizeenum info;
-  int result;
-  uint32_t api_index;
+  CapabilitySnapshot *snapshot = &(webcam->snapshot);
+  CapabilityFormat *format;
+  CapabilityFrameSize *size;
+  uint32_t i;
   int output_index = 0;
-  info.pixel_format = YUYV_FORMAT_CODE;
   // Ensure that all resolutions are zeroed-out so if the array isn't totally
   // full, the unset resolutions will simply be 0x0.
   memset(resolutions, 0, sizeof(WebcamResolution) * resolutions_count);
+  format = FindCapabilityFormat(snapshot, webcam->pixel_format);
+  if (!format) return 1;
+  for (i = 0; i < format->size_count; i++) {
+    if (output_index >= resolutions_count) break;
+    size = snapshot->sizes + format->first_size + i;
+    // Skip continuous and stepwise frame sizes.
+    if (size->type != V4L2_FRMSIZE_TYPE_DISCRETE) continue;
+    resolutions[output_index] = size->max;
+    output_index++;
+  }
+  return 1;
+}
 
-  // The API index tracks all of the frame sizes, but the output index only
-  // tracks discrete frame sizes.
-  for (api_index = 0; ; api_index++) {
-    if (output_index > resolutions_count) break;
-    info.index = api_index;
-    result = ioctl(webcam->fd, VIDIOC_ENUM_FRAMESIZES, &info);
-    if (result < 0) {
-      if (errno == EINVAL) break;
-      return 0;
+// Stores a mode in the array if there's room for it, and counts it either
+// way.
+static void AddMode(WebcamMode *modes, int modes_count, int *found,
+    uint32_t pixel_format, uint32_t width, uint32_t height,
+    struct v4l2_fract *interval) {
+  WebcamMode *mode;
+  if (*found < modes_count) {
+    mode = modes + *found;
+    mode->pixel_format = pixel_format;
+    mode->resolution.width = width;
+    mode->resolution.height = height;
+    mode->interval_numerator = interval->numerator;
+    mode->interval_denominator = interval->denominator;
+  }
+  (*found)++;
+}
+
+// Adds a mode for each frame interval supported at the given format and
+// discrete frame size.
+static void AddModesForSize(CapabilitySnapshot *snapshot,
+    CapabilityFormat *format, CapabilityFrameSize *size, WebcamMode *modes,
+    int modes_count, int *found) {
+  struct v4l2_fract unknown = {0, 0};
+  CapabilityFrameInterval *interval;
+  uint32_t i;
+  // Still list the resolution if the driver doesn't report intervals.
+  if (size->interval_count == 0) {
+    AddMode(modes, modes_count, found, format->pixel_format, size->max.width,
+      size->max.height, &unknown);
+    return;
+  }
+  for (i = 0; i < size->interval_count; i++) {
+    interval = snapshot->intervals + size->first_interval + i;
+    AddMode(modes, modes_count, found, format->pixel_format, size->max.width,
+      size->max.height, &(interval->min));
+    // Ranges contribute both their fastest and slowest intervals.
+    if (interval->type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+      AddMode(modes, modes_count, found, format->pixel_format,
+        size->max.width, size->max.height, &(interval->max));
     }
-    // Skip continuous frame types.
-    if (info.type == V4L2_FRMSIZE_TYPE_CONTINUOUS) continue;
-    // Skip stepwise frame types.
-    if (info.type == V4L2_FRMSIZE_TYPE_STEPWISE) continue;
-    // This is an error--encountered a frame size not defined by the v4l2
-    // spec (should never happen).
-    if (info.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
-      // This is probably not quite the right thing to put here, but it should
-      // be unique enough to trace back to this cause.
-      errno = EPFNOSUPPORT;
-      return 0;
+  }
+}
+
+int GetSupportedModes(WebcamInfo *webcam, WebcamMode *modes,
+    int modes_count) {
+  CapabilitySnapshot *snapshot = &(webcam->snapshot);
+  CapabilityFormat *format;
+  CapabilityFrameSize *size;
+  uint32_t format_index, size_index;
+  int found = 0;
+  for (format_index = 0; format_index < snapshot->format_count;
+    format_index++) {
+    format = snapshot->formats + format_index;
+    for (size_index = 0; size_index < format->size_count; size_index++) {
+      size = snapshot->sizes + format->first_size + size_index;
+      // Like GetSupportedResolutions, this only covers discrete sizes.
+      if (size->type != V4L2_FRMSIZE_TYPE_DISCRETE) continue;
+      AddModesForSize(snapshot, format, size, modes, modes_count, &found);
     }
-    resolutions[output_index].width = info.discrete.width;
-    resolutions[output_index].height = info.discrete.height;
-    output_index++;
+  }
+  return found;
+}
+
+// Returns a positive number if mode a has a higher frame rate than mode b, a
+// negative number if it's lower, or 0 if they're the same. Modes with an
+// unknown interval are treated as the slowest.
+static int CompareFrameRates(WebcamMode *a, WebcamMode *b) {
+  // Comparing a.den / a.num with b.den / b.num, without dividing.
+  uint64_t rate_a = ((uint64_t) a->interval_denominator) *
+    b->interval_numerator;
+  uint64_t rate_b = ((uint64_t) b->interval_denominator) *
+    a->interval_numerator;
+  if (a->interval_numerator == 0) return b->interval_numerator == 0 ? 0 : -1;
+  if (b->interval_numerator == 0) return 1;
+  if (rate_a > rate_b) return 1;
+  if (rate_a < rate_b) return -1;
+  return 0;
+}
+
+// Returns nonzero if mode a should be chosen over mode b by
+// SelectFastestMode.
+static int FasterMode(WebcamMode *a, WebcamMode *b) {
+  int rate_comparison = CompareFrameRates(a, b);
+  uint64_t pixels_a, pixels_b;
+  if (rate_comparison != 0) return rate_comparison > 0;
+  // The frame rates match, so the one with more pixels per frame also has
+  // more pixels per second.
+  pixels_a = ((uint64_t) a->resolution.width) * a->resolution.height;
+  pixels_b = ((uint64_t) b->resolution.width) * b->resolution.height;
+  return pixels_a > pixels_b;
+}
+
+int SelectFastestMode(WebcamInfo *webcam, uint32_t min_width,
+    uint32_t min_height, uint32_t output_format, WebcamMode *mode) {
+  WebcamMode *modes, *best = NULL, *current;
+  int count, i;
+  count = GetSupportedModes(webcam, NULL, 0);
+  if (count == 0) {
+    errno = ENOENT;
+    return 0;
+  }
+  modes = (WebcamMode *) calloc(count, sizeof(WebcamMode));
+  if (!modes) return 0;
+  // Both passes read the same capability snapshot, so this gets the same
+  // modes as the counting pass.
+  count = GetSupportedModes(webcam, modes, count);
+  for (i = 0; i < count; i++) {
+    current = modes + i;
+    if ((current->resolution.width < min_width) ||
+      (current->resolution.height < min_height)) {
+      continue;
+    }
+    if (output_format && !GetFrameConverter(current->pixel_format,
+      output_format)) {
+      continue;
+    }
+    if (!best || FasterMode(current, best)) best = current;
+  }
+  if (best) *mode = *best;
+  free(modes);
+  if (!best) {
+    errno = ENOENT;
+    return 0;
   }
   return 1;
 }
 
-int SetResolution(WebcamInfo *webcam, uint32_t width, uint32_t height) {
-  struct v4l2_format format;
+// Sets errno to ENOTSUP and returns 0 if the driver doesn't support setting
+// the frame rate. Otherwise fills in parameters with the current stream
+// parameters and returns 1.
+static int CheckFrameRateSupport(WebcamInfo *webcam,
+    struct v4l2_streamparm *parameters) {
+  memset(parameters, 0, sizeof(*parameters));
+  parameters->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (DeviceIoctl(webcam, VIDIOC_G_PARM, parameters) < 0) {
+    if (errno == ENOTTY) errno = ENOTSUP;
+    return 0;
+  }
+  if (!(parameters->parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+    errno = ENOTSUP;
+    return 0;
+  }
+  return 1;
+}
+
+// Sends the frame interval requested with SetFrameInterval to the driver.
+// Does nothing if no interval was requested. Returns 0 on error.
+static int ApplyFrameInterval(WebcamInfo *webcam) {
+  struct v4l2_streamparm parameters;
+  if (webcam->frame_interval.numerator == 0) return 1;
+  if (!CheckFrameRateSupport(webcam, &parameters)) return 0;
+  parameters.parm.capture.timeperframe = webcam->frame_interval;
+  if (DeviceIoctl(webcam, VIDIOC_S_PARM, &parameters) < 0) return 0;
+  return 1;
+}
+
+int SetFrameInterval(WebcamInfo *webcam, uint32_t numerator,
+    uint32_t denominator) {
+  struct v4l2_streamparm parameters;
+  if ((numerator == 0) || (denominator == 0)) {
+    errno = EINVAL;
+    return 0;
+  }
+  // Check for support now, so SetResolution doesn't fail on it later.
+  if (!CheckFrameRateSupport(webcam, &parameters)) return 0;
+  webcam->frame_interval.numerator = numerator;
+  webcam->frame_interval.denominator = denominator;
+  // Otherwise, SetResolution applies it after setting the format.
+  if (webcam->buffers) return ApplyFrameInterval(webcam);
+  return 1;
+}
+
+int GetFrameInterval(WebcamInfo *webcam, uint32_t *numerator,
+    uint32_t *denominator) {
+  struct v4l2_streamparm parameters;
+  *numerator = 0;
+  *denominator = 0;
+  memset(&parameters, 0, sizeof(parameters));
+  parameters.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (DeviceIoctl(webcam, VIDIOC_G_PARM, &parameters) < 0) {
+    // Drivers without frame rate control may not implement this at all.
+    return errno == ENOTTY;
+  }
+  if (!(parameters.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+    return 1;
+  }
+  *numerator = parameters.parm.capture.timeperframe.numerator;
+  *denominator = parameters.parm.capture.timeperframe.denominator;
+  return 1;
+}
+
+int SetBufferCount(WebcamInfo *webcam, uint32_t count) {
+  // The count can't be changed once the buffers have been allocated.
+  if (webcam->buffers) return 0;
+  if (count == 0) {
+    errno = EINVAL;
+    return 0;
+  }
+  webcam->requested_buffer_count = count;
+  return 1;
+}
+
+uint32_t GetBufferCount(WebcamInfo *webcam) {
+  return webcam->buffer_count;
+}
+
+int SetCaptureArena(WebcamInfo *webcam, void *arena, size_t size) {
+  // The arena can't be changed once the buffers have been allocated.
+  if (webcam->buffers) return 0;
+  if (!arena || ((((uintptr_t) arena) % sysconf(_SC_PAGESIZE)) != 0)) {
+    errno = EINVAL;
+    return 0;
+  }
+  webcam->arena = arena;
+  webcam->arena_size = size;
+  return 1;
+}
+
+int UsingCaptureArena(WebcamInfo *webcam) {
+  return webcam->buffers && (webcam->memory_type == V4L2_MEMORY_USERPTR);
+}
+
+// Rounds size up to the next multiple of the system's page size.
+static size_t RoundUpToPage(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  return ((size + page_size - 1) / page_size) * page_size;
+}
+
+size_t CaptureArenaSize(size_t frame_size, uint32_t buffer_count) {
+  return RoundUpToPage(frame_size) * buffer_count;
+}
+
+void *AllocateCaptureArena(size_t size, int use_huge_pages) {
+  void *arena;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (use_huge_pages) {
+    size = ((size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1,
+      0);
+    if (arena != MAP_FAILED) return arena;
+  }
+  arena = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (arena == MAP_FAILED) return NULL;
+  // This is only a hint, so it isn't an error if it fails.
+  if (use_huge_pages) madvise(arena, size, MADV_HUGEPAGE);
+  return arena;
+}
+
+void FreeCaptureArena(void *arena, size_t size, int use_huge_pages) {
+  if (!arena) return;
+  if (use_huge_pages) {
+    size = ((size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+  }
+  munmap(arena, size);
+}
+
+// Fills in the fields of a v4l2_buffer struct needed to refer to one of the
+// capture buffers.
+static void InitBufferInfo(WebcamInfo *webcam,
+    struct v4l2_buffer *buffer_info, uint32_t index) {
+  memset(buffer_info, 0, sizeof(*buffer_info));
+  buffer_info->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer_info->memory = webcam->memory_type;
+  buffer_info->index = index;
+  if ((webcam->memory_type == V4L2_MEMORY_USERPTR) && webcam->buffers) {
+    buffer_info->m.userptr = (unsigned long) webcam->buffers[index].data;
+    buffer_info->length = webcam->buffers[index].length;
+  }
+}
+
+// Exports the capture buffer with the given index as a DMABUF, returning the
+// new file descriptor or -1 if the driver doesn't support exporting it.
+static int ExportBuffer(WebcamInfo *webcam, uint32_t index) {
+  struct v4l2_exportbuffer export_info;
+  memset(&export_info, 0, sizeof(export_info));
+  export_info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  export_info.index = index;
+  export_info.flags = O_RDONLY | O_CLOEXEC;
+  if (DeviceIoctl(webcam, VIDIOC_EXPBUF, &export_info) < 0) return -1;
+  return export_info.fd;
+}
+
+// Asks the driver for the given number of buffers using the given memory
+// type, and allocates the array of CaptureBuffer structs to track them. The
+// driver may provide a different number of buffers. Returns 0 on error.
+static int RequestBuffers(WebcamInfo *webcam, uint32_t memory_type,
+    uint32_t count) {
   struct v4l2_requestbuffers buffer_request;
-  struct v4l2_buffer *buffer_info;
-  memset(&format, 0, sizeof(format));
+  uint32_t i;
   memset(&buffer_request, 0, sizeof(buffer_request));
-  buffer_info = &(webcam->buffer_info);
+  buffer_request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer_request.memory = memory_type;
+  buffer_request.count = count;
+  if (DeviceIoctl(webcam, VIDIOC_REQBUFS, &buffer_request) < 0) {
+    return 0;
+  }
+  // The driver is allowed to change the count, and will set it to 0 if it's
+  // out of memory.
+  if (buffer_request.count == 0) {
+    errno = ENOMEM;
+    return 0;
+  }
+  webcam->buffers = (CaptureBuffer *) calloc(buffer_request.count,
+    sizeof(CaptureBuffer));
+  if (!webcam->buffers) return 0;
+  webcam->buffer_count = buffer_request.count;
+  webcam->memory_type = memory_type;
+  for (i = 0; i < webcam->buffer_count; i++) {
+    webcam->buffers[i].dmabuf_fd = -1;
+  }
+  return 1;
+}
 
-  // Ensure that SetResolution hasn't been called before.
-  if (webcam->image_buffer) return 0;
+// Frees any buffers the driver allocated for the webcam. Used for cleaning up
+// after an error, so this doesn't report errors of its own.
+static void ReleaseDriverBuffers(WebcamInfo *webcam, uint32_t memory_type) {
+  struct v4l2_requestbuffers buffer_request;
+  memset(&buffer_request, 0, sizeof(buffer_request));
+  buffer_request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer_request.memory = memory_type;
+  buffer_request.count = 0;
+  DeviceIoctl(webcam, VIDIOC_REQBUFS, &buffer_request);
+}
+
+// Requests the capture buffers from the driver and maps each of them into
+// memory. Each buffer is also exported as a DMABUF if the driver supports it.
+// Returns 0 on error.
+static int AllocateMappedBuffers(WebcamInfo *webcam) {
+  struct v4l2_buffer buffer_info;
+  CaptureBuffer *buffer;
+  uint32_t i;
+  int saved_errno;
+  if (!RequestBuffers(webcam, V4L2_MEMORY_MMAP,
+    webcam->requested_buffer_count)) {
+    return 0;
+  }
+
+  // Get the driver to tell us the size and offset of each buffer, then map it.
+  for (i = 0; i < webcam->buffer_count; i++) {
+    buffer = webcam->buffers + i;
+    InitBufferInfo(webcam, &buffer_info, i);
+    if (DeviceIoctl(webcam, VIDIOC_QUERYBUF, &buffer_info) < 0) {
+      goto error_exit;
+    }
+    buffer->data = webcam->backend->mmap(webcam, buffer_info.length,
+      buffer_info.m.offset);
+    if (buffer->data == MAP_FAILED) {
+      buffer->data = NULL;
+      goto error_exit;
+    }
+    buffer->length = buffer_info.length;
+    buffer->state = BUFFER_IDLE;
+    // Failing to export isn't an error, since not every driver supports it.
+    buffer->dmabuf_fd = ExportBuffer(webcam, i);
+  }
+  return 1;
+error_exit:
+  // The driver keeps its buffers until they're released, and refuses to
+  // change the format until then.
+  saved_errno = errno;
+  FreeCaptureBuffers(webcam);
+  ReleaseDriverBuffers(webcam, V4L2_MEMORY_MMAP);
+  errno = saved_errno;
+  return 0;
+}
+
+// Splits the application's arena into buffers of at least frame_size bytes
+// and registers them with the driver. Sets errno to EINVAL if the driver
+// doesn't support user pointers. Returns 0 on error.
+static int AllocateArenaBuffers(WebcamInfo *webcam, size_t frame_size) {
+  size_t slot_size = RoundUpToPage(frame_size);
+  CaptureBuffer *buffer;
+  uint32_t i;
+  if (!RequestBuffers(webcam, V4L2_MEMORY_USERPTR,
+    webcam->requested_buffer_count)) {
+    return 0;
+  }
+  if (CaptureArenaSize(frame_size, webcam->buffer_count) >
+    webcam->arena_size) {
+    FreeCaptureBuffers(webcam);
+    ReleaseDriverBuffers(webcam, V4L2_MEMORY_USERPTR);
+    errno = ENOSPC;
+    return 0;
+  }
+  for (i = 0; i < webcam->buffer_count; i++) {
+    buffer = webcam->buffers + i;
+    buffer->data = ((uint8_t *) webcam->arena) + i * slot_size;
+    buffer->length = slot_size;
+    buffer->state = BUFFER_IDLE;
+  }
+  return 1;
+}
+
+// Sets up the capture buffers, in the application's arena if one was provided
+// and the driver supports it, or in mmap'd driver memory otherwise. Returns 0
+// on error.
+static int AllocateCaptureBuffers(WebcamInfo *webcam, size_t frame_size) {
+  if (webcam->arena) {
+    if (AllocateArenaBuffers(webcam, frame_size)) return 1;
+    // Only fall back to mmap'd buffers if the driver rejected user pointers.
+    if (errno != EINVAL) return 0;
+  }
+  return AllocateMappedBuffers(webcam);
+}
+
+// Hands the buffer with the given index to the driver. Returns 0 on error.
+static int QueueBuffer(WebcamInfo *webcam, uint32_t index) {
+  struct v4l2_buffer buffer_info;
+  InitBufferInfo(webcam, &buffer_info, index);
+  if (DeviceIoctl(webcam, VIDIOC_QBUF, &buffer_info) < 0) {
+    return 0;
+  }
+  webcam->buffers[index].state = BUFFER_QUEUED;
+  return 1;
+}
+
+// Queues every capture buffer the application doesn't hold. Returns 0 on
+// error.
+static int QueueIdleBuffers(WebcamInfo *webcam) {
+  uint32_t i;
+  for (i = 0; i < webcam->buffer_count; i++) {
+    if (webcam->buffers[i].state != BUFFER_IDLE) continue;
+    if (!QueueBuffer(webcam, i)) return 0;
+  }
+  return 1;
+}
+
+// Works out the color encoding of frames in the given format. Drivers may
+// leave the encoding and quantization at their defaults, in which case they
+// follow from the colorspace the way V4L2 specifies.
+static void ReadColorEncoding(const struct v4l2_pix_format *format,
+    ColorEncoding *encoding) {
+  uint32_t ycbcr_encoding = format->ycbcr_enc;
+  uint32_t quantization = format->quantization;
+  if (ycbcr_encoding == V4L2_YCBCR_ENC_DEFAULT) {
+    ycbcr_encoding = V4L2_MAP_YCBCR_ENC_DEFAULT(format->colorspace);
+  }
+  if (quantization == V4L2_QUANTIZATION_DEFAULT) {
+    quantization = V4L2_MAP_QUANTIZATION_DEFAULT(0, format->colorspace,
+      ycbcr_encoding);
+  }
+  switch (ycbcr_encoding) {
+  case V4L2_YCBCR_ENC_709:
+  case V4L2_YCBCR_ENC_XV709:
+  // SMPTE 240M's weights are within 0.015 of BT.709's.
+  case V4L2_YCBCR_ENC_SMPTE240M:
+    encoding->matrix = COLOR_MATRIX_BT709;
+    break;
+  case V4L2_YCBCR_ENC_BT2020:
+  case V4L2_YCBCR_ENC_BT2020_CONST_LUM:
+    encoding->matrix = COLOR_MATRIX_BT2020;
+    break;
+  default:
+    encoding->matrix = COLOR_MATRIX_BT601;
+    break;
+  }
+  encoding->range = (quantization == V4L2_QUANTIZATION_FULL_RANGE) ?
+    COLOR_RANGE_FULL : COLOR_RANGE_LIMITED;
+}
+
+// Sets the format, resolution and frame interval, allocates the capture
+// buffers and starts streaming. If queue_buffers is nonzero, the buffers are
+// all queued before streaming starts, so the driver can deliver frames
+// straight away. Returns 0 on error, leaving no buffers allocated.
+static int StartStreaming(WebcamInfo *webcam, uint32_t width,
+    uint32_t height, int queue_buffers) {
+  struct v4l2_format format;
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  size_t frame_size;
+  int saved_errno;
+  memset(&format, 0, sizeof(format));
 
   // First, notify the device which video format and resolution we want.
   format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   format.fmt.pix.width = width;
   format.fmt.pix.height = height;
-  format.fmt.pix.pixelformat = YUYV_FORMAT_CODE;
-  if (ioctl(webcam->fd, VIDIOC_S_FMT, &format) < 0) {
+  format.fmt.pix.pixelformat = webcam->pixel_format;
+  if (DeviceIoctl(webcam, VIDIOC_S_FMT, &format) < 0) {
     return 0;
   }
-
-  // Next, tell the device we want to use a single mmap'd buffer.
-  buffer_request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buffer_request.memory = V4L2_MEMORY_MMAP;
-  buffer_request.count = 1;
-  if (ioctl(webcam->fd, VIDIOC_REQBUFS, &buffer_request) < 0) {
+  // The driver picks a different format if it doesn't support the one we
+  // asked for, so make sure we got the right one.
+  if (format.fmt.pix.pixelformat != webcam->pixel_format) {
+    errno = EINVAL;
     return 0;
   }
+  // Setting the format resets the frame rate on some drivers, so this has to
+  // come afterwards.
+  if (!ApplyFrameInterval(webcam)) return 0;
 
-  // Next, get the device to tell us how much memory to allocate for the frame
-  // buffer.
-  if (ioctl(webcam->fd, VIDIOC_QUERYBUF, buffer_info) < 0) {
-    return 0;
+  // Next, set up the ring of buffers the frames will get written to. Some
+  // drivers leave sizeimage unset for uncompressed formats.
+  frame_size = format.fmt.pix.sizeimage;
+  if (frame_size == 0) {
+    frame_size = ((size_t) format.fmt.pix.bytesperline) *
+      format.fmt.pix.height;
   }
+  if (!AllocateCaptureBuffers(webcam, frame_size)) return 0;
+  if (queue_buffers && !QueueIdleBuffers(webcam)) goto error_exit;
+
+  // Activate streaming mode.
+  if (DeviceIoctl(webcam, VIDIOC_STREAMON, &type) < 0) goto error_exit;
 
-  // Allocate the buffer which the video frame will get written to.
-  webcam->image_buffer = mmap(NULL, buffer_info->length,
-    PROT_READ | PROT_WRITE, MAP_SHARED, webcam->fd, buffer_info->m.offset);
-  if (webcam->image_buffer == MAP_FAILED) {
+  // Now we're ready to receive image data. Yay.
+  webcam->resolution.width = format.fmt.pix.width;
+  webcam->resolution.height = format.fmt.pix.height;
+  webcam->bytes_per_line = format.fmt.pix.bytesperline;
+  ReadColorEncoding(&(format.fmt.pix), &(webcam->color_encoding));
+  return 1;
+error_exit:
+  saved_errno = errno;
+  FreeCaptureBuffers(webcam);
+  ReleaseDriverBuffers(webcam, webcam->memory_type);
+  errno = saved_errno;
+  return 0;
+}
+
+int SetResolution(WebcamInfo *webcam, uint32_t width, uint32_t height) {
+  // Ensure that SetResolution hasn't been called before.
+  if (webcam->buffers) return 0;
+  return StartStreaming(webcam, width, height, 0);
+}
+
+// Stops streaming, which returns every queued buffer to the library. Sequence
+// numbers restart when streaming does, so this also resets the dropped frame
+// tracking. Returns 0 on error.
+static int StopStreaming(WebcamInfo *webcam) {
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  uint32_t i;
+  if (DeviceIoctl(webcam, VIDIOC_STREAMOFF, &type) < 0) return 0;
+  for (i = 0; i < webcam->buffer_count; i++) {
+    webcam->buffers[i].state = BUFFER_IDLE;
+  }
+  webcam->have_sequence = 0;
+  return 1;
+}
+
+// Requeues every buffer and restarts streaming after StopStreaming, without
+// reallocating anything. Returns 0 on error.
+static int RestartStreaming(WebcamInfo *webcam) {
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (!QueueIdleBuffers(webcam)) return 0;
+  return DeviceIoctl(webcam, VIDIOC_STREAMON, &type) == 0;
+}
+
+// Changes only the frame interval, keeping the format and buffers. This tries
+// the change while streaming first, and only stops the stream if the driver
+// refuses. Sets *restarted to 1 if the stream had to be stopped. Returns 0 on
+// error.
+static int ChangeFrameInterval(WebcamInfo *webcam, const WebcamMode *mode,
+    int *restarted) {
+  struct v4l2_fract old_interval = webcam->frame_interval;
+  int saved_errno;
+  *restarted = 0;
+  if (SetFrameInterval(webcam, mode->interval_numerator,
+    mode->interval_denominator)) {
+    return 1;
+  }
+  if (errno != EBUSY) {
+    webcam->frame_interval = old_interval;
     return 0;
   }
+  // The buffers don't depend on the frame rate, so they can stay mapped.
+  if (!StopStreaming(webcam)) return 0;
+  *restarted = 1;
+  if (ApplyFrameInterval(webcam)) return RestartStreaming(webcam);
+  saved_errno = errno;
+  webcam->frame_interval = old_interval;
+  RestartStreaming(webcam);
+  errno = saved_errno;
+  return 0;
+}
 
-  // Activate streaming mode.
-  if (ioctl(webcam->fd, VIDIOC_STREAMON, &(buffer_info->type)) < 0) {
+int ReconfigureWebcam(WebcamInfo *webcam, const WebcamMode *mode) {
+  struct v4l2_fract old_interval = webcam->frame_interval;
+  uint32_t old_format = webcam->pixel_format;
+  WebcamResolution old_resolution = webcam->resolution;
+  int64_t start_ns = GetMonotonicTime();
+  int restarted = 1, saved_errno;
+  uint32_t i;
+  if (!webcam->buffers || ((mode->interval_numerator == 0) !=
+    (mode->interval_denominator == 0))) {
+    errno = EINVAL;
     return 0;
   }
+  // The buffers may be unmapped, so frames the application still holds would
+  // be left pointing at freed memory.
+  for (i = 0; i < webcam->buffer_count; i++) {
+    if (webcam->buffers[i].state == BUFFER_DEQUEUED) {
+      errno = EBUSY;
+      return 0;
+    }
+  }
+  // Check the format before stopping the stream. Drivers substitute a
+  // different format rather than failing, which would only be noticed after
+  // the old buffers were gone.
+  if (!FindCapabilityFormat(&(webcam->snapshot), mode->pixel_format)) {
+    errno = EINVAL;
+    return 0;
+  }
+  if ((mode->pixel_format == old_format) &&
+    (mode->resolution.width == old_resolution.width) &&
+    (mode->resolution.height == old_resolution.height)) {
+    if (mode->interval_numerator == 0) return 1;
+    if (!ChangeFrameInterval(webcam, mode, &restarted)) return 0;
+    goto done;
+  }
 
-  // Now we're ready to receive image data. Yay.
-  memset(webcam->image_buffer, 0, buffer_info->length);
-  webcam->resolution.width = width;
-  webcam->resolution.height = height;
+  // Changing the format or resolution means reallocating the buffers, since
+  // drivers refuse to change the format while any are allocated.
+  if (!StopStreaming(webcam)) return 0;
+  FreeCaptureBuffers(webcam);
+  ReleaseDriverBuffers(webcam, webcam->memory_type);
+  webcam->pixel_format = mode->pixel_format;
+  if (mode->interval_numerator != 0) {
+    webcam->frame_interval.numerator = mode->interval_numerator;
+    webcam->frame_interval.denominator = mode->interval_denominator;
+  }
+  if (!StartStreaming(webcam, mode->resolution.width,
+    mode->resolution.height, 1)) {
+    // Go back to the old mode, so the application can keep capturing. If
+    // that fails too, StartStreaming has left no buffers allocated, which
+    // the application can detect and recover from with SetResolution.
+    saved_errno = errno;
+    webcam->pixel_format = old_format;
+    webcam->frame_interval = old_interval;
+    if (!StartStreaming(webcam, old_resolution.width, old_resolution.height,
+      1)) {
+      webcam->resolution.width = 0;
+      webcam->resolution.height = 0;
+    }
+    errno = saved_errno;
+    return 0;
+  }
+done:
+  webcam->reconfigure_call_ns = GetMonotonicTime() - start_ns;
+  webcam->reconfigure_gap_ns = 0;
+  webcam->measuring_gap = restarted && (webcam->last_capture_ns != 0);
   return 1;
 }
 
+void GetReconfigureTiming(WebcamInfo *webcam, int64_t *call_ns,
+    int64_t *gap_ns) {
+  *call_ns = webcam->reconfigure_call_ns;
+  *gap_ns = webcam->reconfigure_gap_ns;
+}
+
 void GetResolution(WebcamInfo *webcam, uint32_t *width, uint32_t *height) {
   *width = webcam->resolution.width;
   *height = webcam->resolution.height;
 }
 
 int BeginLoadingNextFrame(WebcamInfo *webcam) {
-  if (ioctl(webcam->fd, VIDIOC_QBUF, &(webcam->buffer_info)) < 0) {
+  uint32_t i;
+  if (!webcam->buffers) {
+    errno = EINVAL;
     return 0;
   }
+  for (i = 0; i < webcam->buffer_count; i++) {
+    if (webcam->buffers[i].state == BUFFER_QUEUED) continue;
+    if (!QueueBuffer(webcam, i)) return 0;
+  }
   return 1;
 }
 
-FrameBufferState GetFrameBuffer(WebcamInfo *webcam, void **buffer,
-  size_t *size) {
-  int result = ioctl(webcam->fd, VIDIOC_DQBUF, &(webcam->buffer_info));
+int64_t GetMonotonicTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t) ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// Returns the capture time of a dequeued buffer on the CLOCK_MONOTONIC
+// timeline. Drivers that don't report the timestamp's clock predate the
+// switch to monotonic timestamps and normally use the wall clock, so those
+// timestamps are converted if they're closer to the wall clock. Falls back to
+// the dequeue time if the driver didn't record when the frame was captured.
+static int64_t GetCaptureTime(struct v4l2_buffer *buffer_info,
+    int64_t dequeue_ns) {
+  struct timespec ts;
+  int64_t timestamp_ns, realtime_offset;
+  uint32_t clock = buffer_info->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
+  timestamp_ns = ((int64_t) buffer_info->timestamp.tv_sec) * 1000000000LL +
+    ((int64_t) buffer_info->timestamp.tv_usec) * 1000;
+  if (timestamp_ns <= 0) return dequeue_ns;
+  // Copied timestamps come from the application, not the capture.
+  if (clock == V4L2_BUF_FLAG_TIMESTAMP_COPY) return dequeue_ns;
+  if (clock == V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtime_offset = ((int64_t) ts.tv_sec) * 1000000000LL + ts.tv_nsec -
+      dequeue_ns;
+    if (timestamp_ns > (dequeue_ns + realtime_offset / 2)) {
+      timestamp_ns -= realtime_offset;
+    }
+  }
+  // A frame can't have been captured after it was dequeued.
+  if (timestamp_ns > dequeue_ns) return dequeue_ns;
+  return timestamp_ns;
+}
+
+// Updates the dropped frame count given the sequence number of the frame that
+// was just dequeued.
+static void TrackSequence(WebcamInfo *webcam, uint32_t sequence) {
+  // Unsigned subtraction handles the counter wrapping around. Sequence
+  // numbers that go backwards (e.g. a driver restarting its count) aren't
+  // treated as drops.
+  uint32_t gap = sequence - webcam->last_sequence;
+  if (webcam->have_sequence && (gap > 1) && (gap < 0x80000000)) {
+    webcam->dropped_frames += gap - 1;
+  }
+  webcam->last_sequence = sequence;
+  webcam->have_sequence = 1;
+}
+
+FrameBufferState GetFrame(WebcamInfo *webcam, WebcamFrame *frame) {
+  struct v4l2_buffer buffer_info;
+  int result;
+  if (!webcam->buffers) {
+    errno = EINVAL;
+    return DEVICE_ERROR;
+  }
+  InitBufferInfo(webcam, &buffer_info, 0);
+  result = DeviceIoctl(webcam, VIDIOC_DQBUF, &buffer_info);
   if (result != 0) {
     if (errno == EAGAIN) return FRAME_NOT_READY;
     return DEVICE_ERROR;
   }
-  *buffer = webcam->image_buffer;
+  if (buffer_info.index >= webcam->buffer_count) {
+    errno = EINVAL;
+    return DEVICE_ERROR;
+  }
+  frame->dequeue_ns = GetMonotonicTime();
+  webcam->buffers[buffer_info.index].state = BUFFER_DEQUEUED;
+  frame->data = webcam->buffers[buffer_info.index].data;
   // The API allows bytesused to remain unset, in which case the length field
   // (the full size of the buffer) is used.
-  if (webcam->buffer_info.bytesused) {
-    *size = webcam->buffer_info.bytesused;
+  if (buffer_info.bytesused) {
+    frame->size = buffer_info.bytesused;
   } else {
-    *size = webcam->buffer_info.length;
+    frame->size = buffer_info.length;
   }
+  frame->index = buffer_info.index;
+  frame->sequence = buffer_info.sequence;
+  frame->capture_ns = GetCaptureTime(&buffer_info, frame->dequeue_ns);
+  TrackSequence(webcam, buffer_info.sequence);
+  if (webcam->measuring_gap) {
+    webcam->reconfigure_gap_ns = frame->capture_ns - webcam->last_capture_ns;
+    webcam->measuring_gap = 0;
+  }
+  webcam->last_capture_ns = frame->capture_ns;
   return FRAME_READY;
 }
 
-// Converts v to a byte, clamping it between 0 and 255.
-static uint8_t Clamp(float v) {
-  if (v < 0) return 0;
-  if (v > 255) return 255;
-  return (uint8_t) v;
-}
-
-// Reads the two pixels contained in the first four bytes of the input buffer
-// and writes the two pixels located in the first 8 bytes of the output vuffer.
-static void ConvertTwoPixels(uint8_t *input, uint8_t *output) {
-  float y_1, y_2, u, v;
-  uint8_t r1, g1, b1, r2, g2, b2;
-  y_1 = input[0];
-  u = input[1];
-  y_2 = input[2];
-  v = input[3];
-  r1 = Clamp(1.164 * (y_1 - 16) + 1.596 * (v - 128));
-  g1 = Clamp(1.164 * (y_1 - 16) - 0.813 * (v - 128) - 0.391 * (u - 128));
-  b1 = Clamp(1.164 * (y_1 - 16) + 2.018 * (u - 128));
-  r2 = Clamp(1.164 * (y_2 - 16) + 1.596 * (v - 128));
-  g2 = Clamp(1.164 * (y_2 - 16) - 0.813 * (v - 128) - 0.391 * (u - 128));
-  b2 = Clamp(1.164 * (y_2 - 16) + 2.018 * (u - 128));
-  output[0] = 0xff;
-  output[1] = b1;
-  output[2] = g1;
-  output[3] = r1;
-  output[4] = 0xff;
-  output[5] = b2;
-  output[6] = g2;
-  output[7] = r2;
-}
-
-int ConvertYUYVToRGBA(uint8_t *input, uint8_t *output, int w, int h,
-    int input_pitch, int output_pitch) {
-  int unused_input_row_bytes, unused_output_row_bytes;
-  int x, y;
-  if (input_pitch < (w * 2)) return 0;
-  if (output_pitch < (w * 4)) return 0;
-  // Since the pitch contains the number of bytes per row, calculate the number
-  // of bytes to skip after each row of meaningful pixels.
-  unused_input_row_bytes = input_pitch - (w * 2);
-  unused_output_row_bytes = output_pitch - (w * 4);
-  for (y = 0; y < h; y++) {
-    for (x = 0; x < w; x += 2) {
-      ConvertTwoPixels(input, output);
-      input += 4;
-      output += 8;
-    }
-    input += unused_input_row_bytes;
-    output += unused_output_row_bytes;
+FrameBufferState GetFrameBuffer(WebcamInfo *webcam, void **buffer,
+  size_t *size, uint32_t *index) {
+  WebcamFrame frame;
+  FrameBufferState state = GetFrame(webcam, &frame);
+  if (state != FRAME_READY) return state;
+  *buffer = frame.data;
+  *size = frame.size;
+  if (index) *index = frame.index;
+  return FRAME_READY;
+}
+
+uint64_t GetDroppedFrameCount(WebcamInfo *webcam) {
+  return webcam->dropped_frames;
+}
+
+int GetBufferDMABUF(WebcamInfo *webcam, uint32_t index) {
+  if (!webcam->buffers || (index >= webcam->buffer_count)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (webcam->buffers[index].dmabuf_fd < 0) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  return webcam->buffers[index].dmabuf_fd;
+}
+
+FrameBufferState GetFrameDMABUF(WebcamInfo *webcam, int *dmabuf_fd,
+  size_t *size, uint32_t *index) {
+  FrameBufferState state;
+  void *data = NULL;
+  uint32_t buffer_index = 0;
+  // The buffers are all exported at once, so checking the first one tells us
+  // whether a DMABUF will be available before dequeuing anything.
+  if (GetBufferDMABUF(webcam, 0) < 0) return DEVICE_ERROR;
+  state = GetFrameBuffer(webcam, &data, size, &buffer_index);
+  if (state != FRAME_READY) return state;
+  *dmabuf_fd = webcam->buffers[buffer_index].dmabuf_fd;
+  if (index) *index = buffer_index;
+  return FRAME_READY;
+}
+
+// Returns nonzero if at least one capture buffer is queued with the driver.
+static int AnyBufferQueued(WebcamInfo *webcam) {
+  uint32_t i;
+  for (i = 0; i < webcam->buffer_count; i++) {
+    if (webcam->buffers[i].state == BUFFER_QUEUED) return 1;
+  }
+  return 0;
+}
+
+// Waits for the device's fd to report a frame, for the given timeout, as
+// described for WaitForFrame. The caller must already have checked that a
+// buffer is queued.
+static FrameBufferState PollForFrame(WebcamInfo *webcam,
+    int64_t timeout_ns) {
+  struct pollfd poll_info;
+  struct timespec timeout;
+  int result;
+  poll_info.fd = webcam->fd;
+  poll_info.events = POLLIN;
+  poll_info.revents = 0;
+  timeout.tv_sec = timeout_ns / 1000000000LL;
+  timeout.tv_nsec = timeout_ns % 1000000000LL;
+  result = ppoll(&poll_info, 1, timeout_ns < 0 ? NULL : &timeout, NULL);
+  if (result < 0) {
+    if (errno == EINTR) return FRAME_NOT_READY;
+    return DEVICE_ERROR;
+  }
+  if (result == 0) return FRAME_NOT_READY;
+  if (poll_info.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    errno = EIO;
+    return DEVICE_ERROR;
+  }
+  return FRAME_READY;
+}
+
+FrameBufferState WaitForFrame(WebcamInfo *webcam, int64_t timeout_ns) {
+  if (!webcam->buffers) {
+    errno = EINVAL;
+    return DEVICE_ERROR;
+  }
+  // V4L2 reports POLLERR rather than blocking if there's nothing queued, so
+  // give a more specific error in that case.
+  if (!AnyBufferQueued(webcam)) {
+    errno = ENOBUFS;
+    return DEVICE_ERROR;
+  }
+  return PollForFrame(webcam, timeout_ns);
+}
+
+int GetWebcamFD(WebcamInfo *webcam) {
+  return webcam->fd;
+}
+
+int ReleaseFrameBuffer(WebcamInfo *webcam, uint32_t index) {
+  if (!webcam->buffers || (index >= webcam->buffer_count)) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (webcam->buffers[index].state != BUFFER_DEQUEUED) {
+    errno = EINVAL;
+    return 0;
+  }
+  return QueueBuffer(webcam, index);
+}
+
+int CreateFramePool(FramePool *pool, WebcamInfo *webcam) {
+  uint32_t i;
+  memset(pool, 0, sizeof(*pool));
+  if (!webcam->buffers) {
+    errno = EINVAL;
+    return 0;
+  }
+  pool->handles = (FrameHandle *) calloc(webcam->buffer_count,
+    sizeof(FrameHandle));
+  if (!pool->handles) return 0;
+  errno = pthread_mutex_init(&(pool->mutex), NULL);
+  if (errno != 0) {
+    free(pool->handles);
+    pool->handles = NULL;
+    return 0;
+  }
+  pool->webcam = webcam;
+  pool->handle_count = webcam->buffer_count;
+  for (i = 0; i < pool->handle_count; i++) {
+    pool->handles[i].pool = pool;
   }
   return 1;
 }
+
+void DestroyFramePool(FramePool *pool) {
+  if (!pool->handles) return;
+  pthread_mutex_destroy(&(pool->mutex));
+  free(pool->handles);
+  memset(pool, 0, sizeof(*pool));
+}
+
+FrameBufferState WaitForPoolFrame(FramePool *pool, int64_t timeout_ns) {
+  int queued;
+  // Only the check needs the lock. A buffer released while polling is
+  // picked up by the driver as usual.
+  pthread_mutex_lock(&(pool->mutex));
+  queued = AnyBufferQueued(pool->webcam);
+  pthread_mutex_unlock(&(pool->mutex));
+  if (!queued) {
+    errno = ENOBUFS;
+    return DEVICE_ERROR;
+  }
+  return PollForFrame(pool->webcam, timeout_ns);
+}
+
+FrameBufferState GetFrameHandle(FramePool *pool, FrameHandle **handle) {
+  WebcamFrame frame;
+  FrameBufferState state;
+  FrameHandle *h;
+  pthread_mutex_lock(&(pool->mutex));
+  state = GetFrame(pool->webcam, &frame);
+  if ((state == FRAME_READY) && (frame.index >= pool->handle_count)) {
+    // The buffers changed since the pool was created.
+    ReleaseFrameBuffer(pool->webcam, frame.index);
+    errno = EINVAL;
+    state = DEVICE_ERROR;
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+  if (state != FRAME_READY) return state;
+  // Nobody else can hold a reference to this buffer's handle, since the
+  // buffer was with the driver until now.
+  h = pool->handles + frame.index;
+  h->frame = frame;
+  __atomic_store_n(&(h->references), 1, __ATOMIC_RELAXED);
+  *handle = h;
+  return FRAME_READY;
+}
+
+void RetainFrameHandle(FrameHandle *handle) {
+  __atomic_fetch_add(&(handle->references), 1, __ATOMIC_RELAXED);
+}
+
+int ReleaseFrameHandle(FrameHandle *handle) {
+  FramePool *pool = handle->pool;
+  uint32_t previous;
+  int result;
+  // Releasing makes this thread's use of the frame happen before the buffer
+  // is requeued by whichever thread drops the last reference.
+  previous = __atomic_fetch_sub(&(handle->references), 1, __ATOMIC_ACQ_REL);
+  if (previous == 0) {
+    __atomic_fetch_add(&(handle->references), 1, __ATOMIC_RELAXED);
+    errno = EINVAL;
+    return 0;
+  }
+  if (previous > 1) return 1;
+  pthread_mutex_lock(&(pool->mutex));
+  result = ReleaseFrameBuffer(pool->webcam, handle->frame.index);
+  pthread_mutex_unlock(&(pool->mutex));
+  return result;
+}
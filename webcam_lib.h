@@ -10,7 +10,22 @@
 #ifndef WEBCAM_LIB_H
 #define WEBCAM_LIB_H
 #include <linux/videodev2.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+// The specifier used when requesting the YUYV format from V4L2. This is the
+// default capture format.
+#define YUYV_FORMAT_CODE (v4l2_fourcc('Y', 'U', 'Y', 'V'))
+
+// The specifier for the 4-byte RGBA format produced by the conversion
+// functions, with A = byte 0, B = byte 1, G = byte 2 and R = byte 3. V4L2 calls
+// this byte order BGRA32.
+#define RGBA_FORMAT_CODE (v4l2_fourcc('R', 'A', '2', '4'))
+
+// The maximum number of converters that can be registered using
+// RegisterFrameConverter, not counting the built-in ones.
+#define MAX_REGISTERED_CONVERTERS (32)
 
 // This holds potential return values from GetFrameBuffer. The device may
 // either be currently copying, finished copying, or have an error.
@@ -20,26 +35,262 @@ typedef enum {
   DEVICE_ERROR,
 } FrameBufferState;
 
+// The number of capture buffers requested from the driver if SetBufferCount
+// isn't called.
+#define DEFAULT_BUFFER_COUNT (4)
+
+// Tracks who currently owns one of the capture buffers. Idle buffers are owned
+// by the library and are waiting to be queued, queued buffers are owned by the
+// driver, and dequeued buffers hold a frame that the application hasn't
+// released yet.
+typedef enum {
+  BUFFER_IDLE,
+  BUFFER_QUEUED,
+  BUFFER_DEQUEUED,
+} CaptureBufferState;
+
+// Holds one of the mmap'd buffers in the capture ring. dmabuf_fd is -1 if the
+// driver couldn't export the buffer as a DMABUF.
+typedef struct {
+  void *data;
+  size_t length;
+  int dmabuf_fd;
+  CaptureBufferState state;
+} CaptureBuffer;
+
 // Holds the resolution of a single discrete frame of video.
 typedef struct {
   uint32_t width;
   uint32_t height;
 } WebcamResolution;
 
+// Describes one way the webcam can capture: a pixel format, a resolution and
+// the time between frames, in seconds, as the fraction
+// interval_numerator / interval_denominator (e.g. 1/30 for 30 FPS). Both
+// parts of the interval are 0 if the driver doesn't report its frame rates.
+typedef struct {
+  uint32_t pixel_format;
+  WebcamResolution resolution;
+  uint32_t interval_numerator;
+  uint32_t interval_denominator;
+} WebcamMode;
+
+// One pixel format in a CapabilitySnapshot. flags holds the V4L2_FMT_FLAG_*
+// flags reported by the driver. The format's frame sizes are
+// sizes[first_size] through sizes[first_size + size_count - 1].
+typedef struct {
+  uint32_t pixel_format;
+  uint32_t flags;
+  char description[32];
+  uint32_t first_size;
+  uint32_t size_count;
+} CapabilityFormat;
+
+// One frame size, or range of frame sizes, in a CapabilitySnapshot. type is a
+// V4L2_FRMSIZE_TYPE_* value. For discrete sizes, min and max are the same and
+// step is 0x0. The frame intervals supported at the size are
+// intervals[first_interval] through
+// intervals[first_interval + interval_count - 1]; for ranges of sizes, these
+// are the intervals supported at the maximum size. interval_count is 0 if the
+// driver doesn't report frame intervals.
+typedef struct {
+  uint32_t type;
+  WebcamResolution min;
+  WebcamResolution max;
+  WebcamResolution step;
+  uint32_t first_interval;
+  uint32_t interval_count;
+} CapabilityFrameSize;
+
+// One frame interval, or range of intervals, in a CapabilitySnapshot. type is
+// a V4L2_FRMIVAL_TYPE_* value. Intervals are in seconds, so min is the
+// highest frame rate. For discrete intervals, min and max are the same and
+// step is 0/0.
+typedef struct {
+  uint32_t type;
+  struct v4l2_fract min;
+  struct v4l2_fract max;
+  struct v4l2_fract step;
+} CapabilityFrameInterval;
+
+// Holds every pixel format, frame size and frame interval the webcam
+// supports, in the order the driver lists them. OpenWebcam collects this once,
+// so it can be queried without talking to the driver again (see
+// GetCapabilitySnapshot). from_cache is nonzero if it was read from the
+// capability cache rather than the device (see SetCapabilityCacheDirectory).
+// Do not directly modify the members of this struct.
+typedef struct {
+  CapabilityFormat *formats;
+  uint32_t format_count;
+  CapabilityFrameSize *sizes;
+  uint32_t size_count;
+  CapabilityFrameInterval *intervals;
+  uint32_t interval_count;
+  int from_cache;
+} CapabilitySnapshot;
+
+// The value of the magic field at the start of capability cache files. The
+// number changes whenever the file layout does.
+#define CAPABILITY_CACHE_MAGIC "WCAMCAP1"
+
+// Paths passed to OpenWebcam starting with these prefixes open one of the
+// emulated devices rather than a device file. See OpenSyntheticWebcam,
+// OpenReplayWebcam and OpenRecordingWebcam.
+#define SYNTHETIC_PATH_PREFIX "synthetic:"
+#define REPLAY_PATH_PREFIX "replay:"
+#define RECORDING_PATH_PREFIX "recording:"
+
+// The test patterns that a synthetic webcam can generate. The color bars are
+// static apart from a small square that moves across the frame, while the
+// noise changes every pixel in every frame.
+typedef enum {
+  SYNTHETIC_PATTERN_COLOR_BARS,
+  SYNTHETIC_PATTERN_NOISE,
+} SyntheticPattern;
+
+struct WebcamInfo;
+
+// Holds the operations the library uses to talk to a capture device. The
+// default backend passes these straight to a V4L2 driver, while other
+// backends emulate a V4L2 device, so the rest of the library works the same
+// way regardless of where frames come from. ioctl follows the V4L2 ioctl
+// conventions, including returning -1 and setting errno on error. mmap maps a
+// capture buffer given the offset reported by VIDIOC_QUERYBUF, returning
+// MAP_FAILED on error. close frees the backend's resources, including the fd.
+typedef struct {
+  const char *name;
+  int (*ioctl)(struct WebcamInfo *webcam, unsigned long request, void *arg);
+  void *(*mmap)(struct WebcamInfo *webcam, size_t length, off_t offset);
+  void (*munmap)(struct WebcamInfo *webcam, void *address, size_t length);
+  void (*close)(struct WebcamInfo *webcam);
+} WebcamBackend;
+
+// The matrix relating a YUV format's samples to RGB colors. The standards
+// weigh red, green and blue differently when computing luma, so decoding with
+// the wrong one shifts the colors; BT.601 is used for standard-definition
+// video, and BT.709 for HD.
+typedef enum {
+  COLOR_MATRIX_BT601,
+  COLOR_MATRIX_BT709,
+  COLOR_MATRIX_BT2020,
+  COLOR_MATRIX_COUNT,
+} ColorMatrix;
+
+// The range of values a YUV format's samples use. Limited range puts black at
+// Y = 16 and white at Y = 235, with chroma between 16 and 240, while full
+// range uses all 256 values.
+typedef enum {
+  COLOR_RANGE_LIMITED,
+  COLOR_RANGE_FULL,
+  COLOR_RANGE_COUNT,
+} ColorRange;
+
+// Describes how a YUV format's samples map to RGB colors.
+typedef struct {
+  ColorMatrix matrix;
+  ColorRange range;
+} ColorEncoding;
+
 // Holds information about the webcam, needed by the library functions. Do not
 // directly modify the members of this struct.
-typedef struct {
+typedef struct WebcamInfo {
   int fd;
+  const WebcamBackend *backend;
+  void *backend_data;
   struct v4l2_capability capabilities;
-  struct v4l2_buffer buffer_info;
-  void *image_buffer;
+  CapabilitySnapshot snapshot;
+  CaptureBuffer *buffers;
+  uint32_t buffer_count;
+  uint32_t requested_buffer_count;
+  uint32_t memory_type;
+  void *arena;
+  size_t arena_size;
   WebcamResolution resolution;
+  uint32_t pixel_format;
+  uint32_t bytes_per_line;
+  // The color encoding the driver reported when the format was set.
+  ColorEncoding color_encoding;
+  // The frame interval passed to SetFrameInterval, or 0/0 to leave the
+  // driver's default.
+  struct v4l2_fract frame_interval;
+  // Used to detect frames the driver dropped, from gaps in sequence numbers.
+  int have_sequence;
+  uint32_t last_sequence;
+  uint64_t dropped_frames;
+  // Used to time ReconfigureWebcam. last_capture_ns is the capture time of
+  // the newest frame, and measuring_gap is set until the first frame after a
+  // reconfiguration arrives.
+  int64_t last_capture_ns;
+  int measuring_gap;
+  int64_t reconfigure_call_ns;
+  int64_t reconfigure_gap_ns;
 } WebcamInfo;
 
+// Describes a frame obtained from GetFrame. Timestamps are in nanoseconds,
+// using CLOCK_MONOTONIC (see GetMonotonicTime).
+typedef struct {
+  // The frame's pixel data, and the number of bytes used in the buffer.
+  void *data;
+  size_t size;
+  // The index of the capture buffer holding the frame.
+  uint32_t index;
+  // The driver's frame counter. This increases by one for every frame the
+  // device captures, so gaps mean that the driver dropped frames.
+  uint32_t sequence;
+  // The time the driver captured the frame. Drivers differ on whether this is
+  // at the start or end of the exposure. If the driver doesn't provide a
+  // usable timestamp, this is the same as dequeue_ns.
+  int64_t capture_ns;
+  // The time the library dequeued the frame from the driver.
+  int64_t dequeue_ns;
+} WebcamFrame;
+
+// Converts a w x h frame in one pixel format to another. input_size is the
+// number of bytes of input data, which is needed for compressed formats. The
+// pitches give the number of bytes in a row of each image; for planar formats
+// they refer to the luma plane, and the chroma planes follow the layout V4L2
+// uses for the format. Returns 0 on error.
+typedef int (*FrameConverter)(uint8_t *input, size_t input_size,
+  uint8_t *output, int w, int h, int input_pitch, int output_pitch);
+
 // Takes a device path (e.g. /dev/video0) and a pointer to a WebcamInfo struct
-// to populate. Returns 0 on error.
+// to populate. The path may also describe one of the emulated devices:
+// "synthetic:<width>x<height>@<fps>[:bars|:noise]" opens a synthetic webcam,
+// "replay:<width>x<height>@<fps>:<file path>" opens a replay webcam, and
+// "recording:<fps>:<file path>" plays back a recording.
+// Returns 0 on error.
 int OpenWebcam(char *path, WebcamInfo *webcam);
 
+// Opens a webcam that generates YUYV frames containing the given test pattern
+// at the given resolution, rather than capturing them from hardware. This
+// behaves like a V4L2 device, including pacing frames at the given rate and
+// dropping frames when no buffers are queued. If fps is 0, frames are
+// produced as fast as they're requested, which is useful for benchmarking.
+// Returns 0 on error.
+int OpenSyntheticWebcam(WebcamInfo *webcam, uint32_t width, uint32_t height,
+    uint32_t fps, SyntheticPattern pattern);
+
+// Opens a webcam that replays the raw YUYV frames in the file at path, which
+// contains consecutive width x height frames with no padding, looping back to
+// the first frame at the end of the file. Frames are paced like
+// OpenSyntheticWebcam. Returns 0 on error.
+int OpenReplayWebcam(WebcamInfo *webcam, const char *path, uint32_t width,
+    uint32_t height, uint32_t fps);
+
+// Opens a webcam that plays back a file written by StartRecording, looping
+// back to the first frame at the end, and paced like OpenSyntheticWebcam. Only
+// YUYV recordings without row padding can be played back this way; use
+// OpenRecording to read others. Returns 0 on error.
+int OpenRecordingWebcam(WebcamInfo *webcam, const char *path, uint32_t fps);
+
+// Populates a WebcamInfo struct for a device accessed through the given
+// backend. fd must be a file descriptor that can be polled for frames, as
+// described for GetWebcamFD. The backend takes ownership of fd and
+// backend_data, and its close function is called if this fails. Returns 0 on
+// error.
+int OpenWebcamWithBackend(WebcamInfo *webcam, const WebcamBackend *backend,
+    int fd, void *backend_data);
+
 // Closes the webcam, freeing any allocated resources.
 void CloseWebcam(WebcamInfo *webcam);
 
@@ -50,46 +301,981 @@ int PrintCapabilityDetails(WebcamInfo *webcam);
 // Returns 0 on error.
 int PrintVideoFormatDetails(WebcamInfo *webcam);
 
-// Gets the supported YUYV (4:2:2) resolutions from the webcam. This will only
-// provide resolutions for single-planar, discrete frames. This takes a pointer
+// Returns the formats, frame sizes and frame intervals supported by the
+// webcam, collected when it was opened. The snapshot remains valid until
+// CloseWebcam or RefreshCapabilitySnapshot is called. The functions below
+// that list formats, resolutions and modes all read from it, so none of them
+// need to talk to the driver.
+const CapabilitySnapshot *GetCapabilitySnapshot(WebcamInfo *webcam);
+
+// Collects the webcam's capabilities from the driver again, replacing the
+// snapshot and updating the cache file if there is one. This is only needed
+// if the device's capabilities may have changed without its driver version
+// changing, e.g. after a firmware update. Returns 0 on error, in which case
+// the old snapshot is kept.
+int RefreshCapabilitySnapshot(WebcamInfo *webcam);
+
+// Sets a directory in which OpenWebcam caches the capabilities of V4L2
+// devices, so that processes opening the same camera can skip enumerating
+// every format, frame size and frame interval, which takes a long time on
+// some USB cameras. Each device gets a file named after its driver and bus
+// info, which is only used if the driver, card name, bus info, driver version
+// and capability flags all still match. Files are replaced atomically, so
+// several processes can share the directory. Pass NULL to disable caching,
+// which is the default. This affects every webcam opened afterwards, and
+// mustn't be called while another thread is opening a webcam. Returns 0 on
+// error.
+int SetCapabilityCacheDirectory(const char *path);
+
+// Gets the pixel formats supported by the webcam, in the order the driver
+// lists them. This takes a pointer to an array of V4L2 pixel format codes, and
+// will fill in up to formats_count members. Any entries in the list beyond the
+// number of available formats will be set to 0. This returns 0 on error.
+int GetSupportedFormats(WebcamInfo *webcam, uint32_t *formats,
+    int formats_count);
+
+// Sets the pixel format to capture frames in, which defaults to
+// YUYV_FORMAT_CODE. This affects GetSupportedResolutions and SetResolution,
+// so it must be called before SetResolution. Returns 0 on error.
+int SetPixelFormat(WebcamInfo *webcam, uint32_t pixel_format);
+
+// Returns the pixel format that frames are captured in.
+uint32_t GetPixelFormat(WebcamInfo *webcam);
+
+// Returns the number of bytes in each row of a captured frame, as reported by
+// the driver. This is the input pitch to use when converting frames, and may
+// include padding. For planar formats, this is the pitch of the luma plane.
+// This is 0 until SetResolution succeeds.
+uint32_t GetBytesPerLine(WebcamInfo *webcam);
+
+// Returns the color encoding of captured frames, as reported by the driver in
+// the negotiated format. Drivers that leave it to the default get the
+// encoding V4L2 defines for the format's colorspace; e.g. MJPEG is BT.601 full
+// range, and HD colorspaces are BT.709 limited range. Pass it to
+// GetFrameConverterForEncoding or ConvertYUYVToRGBAWithEncoding to decode
+// frames with the right colors. This is BT.601 limited range until
+// SetResolution succeeds.
+ColorEncoding GetColorEncoding(WebcamInfo *webcam);
+
+// Picks the pixel format to capture in, given the format the application
+// wants frames in. This chooses the first format listed by the driver that
+// has a converter to output_format (see GetFrameConverter), preferring formats
+// the driver supports natively over ones it emulates in software. If the
+// device supports output_format itself (e.g. MJPEG), frames can be used as
+// captured without any conversion. Sets capture_format to the chosen format,
+// and returns 0 on error or if no format can be converted to output_format.
+// This doesn't change the capture format; pass the result to SetPixelFormat.
+int ChooseCaptureFormat(WebcamInfo *webcam, uint32_t output_format,
+    uint32_t *capture_format);
+
+// Gets the supported resolutions in the current pixel format (see
+// SetPixelFormat) from the webcam. This will only provide resolutions for
+// single-planar, discrete frames. This takes a pointer
 // to an array of WebcamResolution structs, and will fill in up to
 // resolutions_count members. Any entries in the list beyond the number of
 // available resolutions will be set to 0. This returns 0 on error.
 int GetSupportedResolutions(WebcamInfo *webcam, WebcamResolution *resolutions,
     int resolutions_count);
 
-// Set the desired resolution for frame outputs. This must be called before
-// BeginLoadingNextFrame or GetFrameBuffer. This returns 0 on error. It will
-// fail if called more than once on a WebcamInfo struct. To change resolutions,
-// first call CloseWebcam() and OpenWebcam() before this.
+// Sets the number of buffers to request from the driver when SetResolution is
+// called. More buffers let the driver keep capturing while the application
+// holds onto earlier frames. The driver may provide a different number of
+// buffers than requested; GetBufferCount returns the actual count once
+// SetResolution succeeds. This must be called before SetResolution, and
+// returns 0 on error.
+int SetBufferCount(WebcamInfo *webcam, uint32_t count);
+
+// Returns the number of capture buffers mapped by SetResolution, or 0 if
+// SetResolution hasn't been called yet.
+uint32_t GetBufferCount(WebcamInfo *webcam);
+
+// Asks the library to capture frames directly into the given arena of memory,
+// which the application owns, rather than into buffers mapped from the driver.
+// Driver buffers are often uncached or write-combined, so reading frames from
+// memory the application allocated can be much faster. The arena must be
+// page-aligned (see AllocateCaptureArena) and large enough for the buffers
+// (see CaptureArenaSize), and it must remain valid until CloseWebcam is
+// called. This must be called before SetResolution. If the driver doesn't
+// support capturing into user memory, SetResolution falls back to mmap'd
+// driver buffers; use UsingCaptureArena to check which happened. Returns 0 on
+// error.
+int SetCaptureArena(WebcamInfo *webcam, void *arena, size_t size);
+
+// Returns nonzero if frames are being captured into the arena provided to
+// SetCaptureArena, or 0 if they're in buffers mapped from the driver.
+int UsingCaptureArena(WebcamInfo *webcam);
+
+// Returns the size of the arena needed to hold buffer_count buffers, each
+// holding frame_size bytes. Each buffer in the arena starts on a page
+// boundary. For YUYV frames, frame_size is normally width * height * 2.
+size_t CaptureArenaSize(size_t frame_size, uint32_t buffer_count);
+
+// Allocates a page-aligned arena of at least the given size, for use with
+// SetCaptureArena. If use_huge_pages is nonzero, this first tries to back the
+// arena with huge pages, then with transparent huge pages if none are
+// reserved. Returns NULL on error.
+void *AllocateCaptureArena(size_t size, int use_huge_pages);
+
+// Frees an arena returned by AllocateCaptureArena. The size and use_huge_pages
+// arguments must be the same as the ones passed to AllocateCaptureArena.
+void FreeCaptureArena(void *arena, size_t size, int use_huge_pages);
+
+// Lists every combination of pixel format, discrete resolution and frame
+// interval the webcam supports, in the order the driver lists them. For
+// drivers that report a range of intervals rather than a list, only the
+// fastest and slowest are included. Stores up to modes_count modes in the
+// array, and returns the total number of modes (which may be more than
+// modes_count). This only reads the capability snapshot, so it can't fail.
+// modes may be NULL if modes_count is 0.
+int GetSupportedModes(WebcamInfo *webcam, WebcamMode *modes, int modes_count);
+
+// Picks the mode with the highest frame rate whose resolution is at least
+// min_width x min_height, and whose pixel format can be converted to
+// output_format (see GetFrameConverter); an output_format of 0 allows any
+// format. Ties go to the mode with the most pixels per second, then to the
+// format the driver lists first. Sets mode to the chosen mode and returns 1,
+// or returns 0 on error or if no mode qualifies (with errno set to ENOENT).
+// To use the mode, pass it to SetPixelFormat, SetFrameInterval and then
+// SetResolution.
+int SelectFastestMode(WebcamInfo *webcam, uint32_t min_width,
+    uint32_t min_height, uint32_t output_format, WebcamMode *mode);
+
+// Requests the given time between frames, in seconds, as a fraction (e.g.
+// 1/60 for 60 FPS). If called before SetResolution, the rate is applied when
+// the format is set, since changing the format resets it on many drivers.
+// Afterwards, it's applied immediately, which not every driver allows while
+// streaming; ReconfigureWebcam briefly stops the stream for such drivers. The
+// driver picks the closest rate it supports; use
+// GetFrameInterval to find out which. Returns 0 on error, with errno set to
+// ENOTSUP if the driver doesn't support setting the frame rate.
+int SetFrameInterval(WebcamInfo *webcam, uint32_t numerator,
+    uint32_t denominator);
+
+// Gets the current time between frames from the driver, as a fraction of a
+// second. Sets both values to 0 if the driver doesn't report it. Returns 0 on
+// error.
+int GetFrameInterval(WebcamInfo *webcam, uint32_t *numerator,
+    uint32_t *denominator);
+
+// Set the desired resolution for frame outputs, using the current pixel
+// format. This must be called before BeginLoadingNextFrame or GetFrameBuffer.
+// This returns 0 on error. It will fail if called more than once on a
+// WebcamInfo struct. To change the resolution afterwards, use
+// ReconfigureWebcam.
 int SetResolution(WebcamInfo *webcam, uint32_t width, uint32_t height);
 
-// Sets width and height to the current resolution of the webcam. They will
-// both be 0 if SetResolution hasn't been called yet.
+// Switches a webcam that's already capturing to a different pixel format,
+// resolution or frame rate, without closing the device. A mode interval of
+// 0/0 keeps the current frame rate request. Changing only the frame rate is
+// tried without stopping the stream, and otherwise only restarts it. Other
+// changes stop the stream, reallocate the capture buffers (in the capture
+// arena, if one is in use) and restart it. Either way, every buffer is queued
+// before streaming restarts, so there's no need to call BeginLoadingNextFrame
+// again. Frame data pointers and DMABUF file descriptors from before the call
+// may no longer be valid, and sequence numbers restart. Check GetResolution
+// and GetBytesPerLine afterwards, since the driver may adjust the resolution.
+// Fails with errno set to EBUSY if any frame hasn't been released, or EINVAL
+// if the webcam doesn't support the pixel format. Returns 0 on error, in
+// which case the previous mode is restored and every buffer is queued, as
+// after a successful call. If restoring the previous mode fails too, the
+// webcam is left stopped with no capture buffers: GetBufferCount and
+// GetResolution return 0, and SetResolution must be called (followed by
+// BeginLoadingNextFrame) before capturing again, as after OpenWebcam. The
+// pixel format and frame interval are still the previous ones.
+int ReconfigureWebcam(WebcamInfo *webcam, const WebcamMode *mode);
+
+// Gets timing information about the most recent successful
+// ReconfigureWebcam call. call_ns is the time spent in the call. gap_ns is the
+// interval between the capture times of the last frame dequeued before the
+// call and the first frame dequeued after it, which is how long the stream
+// was interrupted. gap_ns is 0 until that frame has been dequeued, or if the
+// stream didn't need to be stopped. Both are 0 if ReconfigureWebcam hasn't
+// succeeded yet.
+void GetReconfigureTiming(WebcamInfo *webcam, int64_t *call_ns,
+    int64_t *gap_ns);
+
+// Sets width and height to the current resolution of the webcam. This is the
+// resolution the driver actually chose, which may differ from the one passed
+// to SetResolution. They will both be 0 if SetResolution hasn't been called
+// yet.
 void GetResolution(WebcamInfo *webcam, uint32_t *width, uint32_t *height);
 
-// Starts loading the next frame into a buffer to be retrieved using
-// GetFrameBuffer. This function won't block, but it may return 0 on error,
-// if, for example, SetResolution hasn't been called yet.
+// Hands every capture buffer that isn't already queued to the driver so it
+// can be filled with upcoming frames. This includes any buffers returned by
+// GetFrameBuffer that haven't been released with ReleaseFrameBuffer, so
+// pointers to earlier frames become invalid after calling this. This function
+// won't block, but it may return 0 on error, if, for example, SetResolution
+// hasn't been called yet.
 int BeginLoadingNextFrame(WebcamInfo *webcam);
 
-// Sets buffer to point to the frame buffer containing YUYV pixel data, and
-// size to the number of bytes used for pixel data in the buffer. Do not free
-// the buffer from this function; it will be freed when CloseWebcam is called.
-// BeginLoadingNextFrame() must be called previously for this to succeed. This
-// function will return FRAME_READY on success, FRAME_NOT_READY if data is
-// still being copied (this is non-blocking), and DEVICE_ERROR if the internal
-// API returns an error.
+// Sets buffer to point to the oldest completed frame buffer, holding pixel data
+// in the capture format (see GetPixelFormat), size to the number of bytes used
+// for pixel data in the buffer, and index to the index of the capture buffer
+// holding the frame. Do not free the buffer from this function; it will be
+// freed when CloseWebcam is called. The buffer stays valid, and the driver
+// won't write to it, until it's passed to ReleaseFrameBuffer (or
+// BeginLoadingNextFrame is called). index may be NULL if the caller doesn't
+// need it. BeginLoadingNextFrame() must be called previously for this to
+// succeed. This function will return FRAME_READY on success, FRAME_NOT_READY if
+// no frame has finished yet (this is non-blocking), and DEVICE_ERROR if the
+// internal API returns an error.
 FrameBufferState GetFrameBuffer(WebcamInfo *webcam, void **buffer,
-  size_t *size);
+  size_t *size, uint32_t *index);
+
+// Returns a DMABUF file descriptor referring to the capture buffer with the
+// given index, which can be imported by other devices or passed to another
+// process (e.g. over a UNIX socket with SCM_RIGHTS) to share frames without
+// copying them. SetResolution exports every buffer when the driver supports
+// it. The fd is owned by the library and is closed by CloseWebcam, so dup()
+// it if it needs to outlive the WebcamInfo. As with the mmap'd data, the
+// buffer's contents are only stable while the application holds the frame.
+// Returns -1 on error, with errno set to ENOTSUP if the driver doesn't support
+// exporting buffers.
+int GetBufferDMABUF(WebcamInfo *webcam, uint32_t index);
+
+// The same as GetFrameBuffer, but fills in a WebcamFrame struct, which also
+// includes the frame's sequence number and timestamps.
+FrameBufferState GetFrame(WebcamInfo *webcam, WebcamFrame *frame);
+
+// Returns the number of frames the driver has dropped since SetResolution was
+// called, going by gaps in the sequence numbers of frames passed to GetFrame,
+// GetFrameBuffer or GetFrameDMABUF. This only counts frames the driver
+// couldn't deliver (usually because no buffers were queued), not frames the
+// application dequeued and skipped.
+uint64_t GetDroppedFrameCount(WebcamInfo *webcam);
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds, for comparison
+// with the timestamps in WebcamFrame.
+int64_t GetMonotonicTime(void);
+
+// The same as GetFrameBuffer, but sets dmabuf_fd to the DMABUF file
+// descriptor for the frame's buffer (see GetBufferDMABUF) rather than
+// providing a pointer to its data. Returns DEVICE_ERROR with errno set to
+// ENOTSUP if the buffers couldn't be exported; in this case no frame is
+// dequeued.
+FrameBufferState GetFrameDMABUF(WebcamInfo *webcam, int *dmabuf_fd,
+  size_t *size, uint32_t *index);
+
+// Blocks until a frame can be retrieved using GetFrameBuffer, or until
+// timeout_ns nanoseconds have elapsed. A negative timeout waits indefinitely,
+// and a timeout of 0 just checks whether a frame is ready. Returns FRAME_READY
+// if a frame is ready, FRAME_NOT_READY if the timeout expired or the wait was
+// interrupted by a signal, and DEVICE_ERROR on error. Waiting while no
+// buffers are queued with the driver is an error, with errno set to ENOBUFS.
+// This doesn't dequeue the frame; call GetFrameBuffer afterwards.
+FrameBufferState WaitForFrame(WebcamInfo *webcam, int64_t timeout_ns);
+
+// Returns the file descriptor for the open webcam, so applications can wait
+// on it in their own event loops rather than calling WaitForFrame. The fd
+// becomes readable (POLLIN for poll(), EPOLLIN for epoll) when GetFrameBuffer
+// will return a frame, and reports POLLERR/EPOLLERR on device errors or if no
+// buffers are queued. Do not read from, configure, or close this fd directly.
+int GetWebcamFD(WebcamInfo *webcam);
+
+// Returns the capture buffer with the given index, obtained from
+// GetFrameBuffer, to the driver so it can be filled with a new frame. The
+// buffer's contents must not be used after calling this. Returns 0 on error,
+// including if the buffer isn't currently held by the application.
+int ReleaseFrameBuffer(WebcamInfo *webcam, uint32_t index);
+
+struct FramePool;
+
+// A reference-counted handle to a captured frame, so several consumers (e.g.
+// a display, a recorder and an analyzer) can share the capture buffer without
+// copying it. The frame stays valid while any reference is held, and its
+// buffer goes back to the driver as soon as the last one is released. Handles
+// belong to a FramePool, which has one per capture buffer. Do not directly
+// modify the members of this struct.
+typedef struct {
+  WebcamFrame frame;
+  struct FramePool *pool;
+  uint32_t references;
+} FrameHandle;
+
+// Hands out FrameHandles for a webcam's frames. Handles may be retained and
+// released from any thread; the pool's mutex serializes the library calls
+// that dequeue and requeue buffers. Handles are preallocated, so getting,
+// retaining and releasing them never allocates memory. Do not directly modify
+// the members of this struct.
+typedef struct FramePool {
+  WebcamInfo *webcam;
+  FrameHandle *handles;
+  uint32_t handle_count;
+  pthread_mutex_t mutex;
+} FramePool;
+
+// Initializes a pool for the webcam's capture buffers. Call this after
+// SetResolution. While the pool exists, get frames only through
+// GetFrameHandle and WaitForPoolFrame, rather than GetFrame, WaitForFrame or
+// ReleaseFrameBuffer. The pool must be destroyed and created again after
+// ReconfigureWebcam, since the buffers may change. Returns 0 on error.
+int CreateFramePool(FramePool *pool, WebcamInfo *webcam);
+
+// Frees the pool's resources. Every handle must have been released first.
+void DestroyFramePool(FramePool *pool);
+
+// The same as WaitForFrame, but safe to call while other threads release
+// handles from the pool.
+FrameBufferState WaitForPoolFrame(FramePool *pool, int64_t timeout_ns);
+
+// Dequeues the oldest completed frame, like GetFrame, and sets handle to a
+// handle for it holding one reference. Returns FRAME_READY on success,
+// FRAME_NOT_READY if no frame has finished yet (this is non-blocking), and
+// DEVICE_ERROR on error.
+FrameBufferState GetFrameHandle(FramePool *pool, FrameHandle **handle);
+
+// Adds a reference to a handle the caller already holds a reference to, e.g.
+// before passing the frame to another consumer.
+void RetainFrameHandle(FrameHandle *handle);
+
+// Drops one reference to the handle. Releasing the last reference returns
+// the frame's buffer to the driver, after which the frame's data must not be
+// used. Returns 0 on error, including if the handle held no references.
+int ReleaseFrameHandle(FrameHandle *handle);
+
+// Identifies one of the implementations of the YUYV to RGBA conversion. Every
+// kernel other than the floating-point reference computes in 13-bit fixed
+// point and produces identical output. Compared with the reference, the
+// fixed-point kernels are off by at most 1 in any color channel; for BT.601
+// limited range, 0.46% of the channel values differ across all 2^24 possible
+// Y, U, V combinations. Each kernel is compiled separately for every color
+// encoding, so none of them is slower for any particular encoding.
+// CONVERSION_KERNEL_FIXED_POINT is the portable scalar version, which uses
+// only table lookups and integer adds, so it's suitable for CPUs without a
+// fast FPU. Not every kernel is available on every CPU; use
+// ConversionKernelSupported to check.
+typedef enum {
+  CONVERSION_KERNEL_REFERENCE,
+  CONVERSION_KERNEL_FIXED_POINT,
+  CONVERSION_KERNEL_SSE2,
+  CONVERSION_KERNEL_SSSE3,
+  CONVERSION_KERNEL_AVX2,
+  CONVERSION_KERNEL_NEON,
+  CONVERSION_KERNEL_COUNT,
+} ConversionKernel;
+
+// Returns nonzero if the given conversion kernel can be used on this CPU. This
+// is checked at runtime, so one build can run on CPUs with different features.
+int ConversionKernelSupported(ConversionKernel kernel);
+
+// Returns the fastest conversion kernel supported by this CPU. This is what
+// ConvertYUYVToRGBA uses.
+ConversionKernel GetBestConversionKernel(void);
+
+// Returns a short name for the given conversion kernel, e.g. "avx2".
+const char *ConversionKernelName(ConversionKernel kernel);
 
 // Converts the YUYV buffer pointed to by input to the 4-byte RGBA buffer
 // pointed to by output. Each image is w pixels wide and h pixels tall. The row
 // pitches are the number of bytes in a row for each image. Normally, this will
 // just be 2 * w for the YUYV input pitch and 4 * w for the RGBA output pitch.
 // The byte order for the RGBA colors will be A = output[0], B = output[1], ...
-// Returns 0 on error.
+// This uses the fastest kernel the CPU supports, and decodes the colors as
+// BT.601 limited range, as do the other conversion functions that don't take
+// a ColorEncoding. Returns 0 on error.
 int ConvertYUYVToRGBA(uint8_t *input, uint8_t *output, int w, int h,
     int input_pitch, int output_pitch);
 
+// The same as ConvertYUYVToRGBA, but decodes the colors using the given
+// encoding, e.g. the one from GetColorEncoding. Returns 0 on error, including
+// if the encoding isn't valid.
+int ConvertYUYVToRGBAWithEncoding(const ColorEncoding *encoding,
+    uint8_t *input, uint8_t *output, int w, int h, int input_pitch,
+    int output_pitch);
+
+// Returns a short name for the given color matrix, e.g. "bt709".
+const char *ColorMatrixName(ColorMatrix matrix);
+
+// Returns a short name for the given color range, e.g. "full".
+const char *ColorRangeName(ColorRange range);
+
+// The same as ConvertYUYVToRGBA, but uses the given kernel rather than picking
+// one automatically. Returns 0 on error, including if the kernel isn't
+// supported by this CPU.
+int ConvertYUYVToRGBAWithKernel(ConversionKernel kernel, uint8_t *input,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch);
+
+// The largest number of tile columns or rows FrameStatistics can average luma
+// over.
+#define MAX_STATISTICS_TILES (16)
+
+// Brightness statistics for a frame, for auto-exposure and health monitoring.
+// The caller sets tile_columns and tile_rows to the grid of tiles to average
+// luma over, each between 0 and MAX_STATISTICS_TILES; 0 is treated as 1, so a
+// zeroed struct gets a single tile covering the whole frame. Everything else
+// is filled in by GetYUYVFrameStatistics or ConvertYUYVToRGBAWithStatistics.
+typedef struct {
+  int tile_columns;
+  int tile_rows;
+  // The number of pixels with each Y value.
+  uint32_t histogram[256];
+  uint64_t pixel_count;
+  double mean_luma;
+  // The number of pixels at or below the encoding's black level (Y = 16 for
+  // limited range, 0 for full range), and at or above its white level (235
+  // or 255). These have lost detail to under- or overexposure.
+  uint64_t clipped_dark;
+  uint64_t clipped_bright;
+  // The mean Y value of each tile, row by row, with tile_columns entries per
+  // row. Tiles split the frame as evenly as possible.
+  float tile_means[MAX_STATISTICS_TILES * MAX_STATISTICS_TILES];
+} FrameStatistics;
+
+// Fills in statistics for the Y samples of a YUYV frame, without converting
+// it. encoding may be NULL to use BT.601 limited range; only its range
+// matters, for the clipping levels. Returns 0 on error.
+int GetYUYVFrameStatistics(uint8_t *input, int w, int h, int input_pitch,
+    const ColorEncoding *encoding, FrameStatistics *statistics);
+
+// The same as ConvertYUYVToRGBAWithEncoding, but also fills in statistics in
+// the same pass: each row's Y samples are counted right after that row is
+// converted, while they're still in the CPU's cache, rather than reading the
+// whole frame from memory a second time. That only helps when reading the
+// frame is the bottleneck, as with large frames: the histogram is counted
+// one pixel at a time either way, and costs more than the conversion itself,
+// so on smaller frames this is about as fast as converting and then calling
+// GetYUYVFrameStatistics. encoding may be NULL to use BT.601 limited range,
+// and statistics may be NULL to skip them. The output is byte-identical to
+// ConvertYUYVToRGBAWithEncoding, and the statistics are identical to
+// GetYUYVFrameStatistics. Returns 0 on error.
+int ConvertYUYVToRGBAWithStatistics(const ColorEncoding *encoding,
+    uint8_t *input, uint8_t *output, int w, int h, int input_pitch,
+    int output_pitch, FrameStatistics *statistics);
+
+// A rectangle within a frame, in pixels, with its top-left corner at (x, y).
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+} FrameRegion;
+
+// The largest factor ConvertYUYVToRGBADownscaled can shrink frames by.
+#define MAX_DOWNSCALE_FACTOR (64)
+
+// Converts a region of a YUYV frame to RGBA while shrinking it by an integer
+// factor, in a single pass that never produces the full-resolution RGBA
+// image. Each output pixel is the average of a factor x factor block of input
+// pixels, so the output is region->w / factor by region->h / factor pixels;
+// any leftover columns or rows at the right and bottom of the region are
+// ignored. region may be NULL to use the whole frame. w must be even, and
+// factor must be between 1 and MAX_DOWNSCALE_FACTOR. output_pitch is the
+// number of bytes in a row of the output. Even factors are fastest when
+// region->x is even, since every block is then made of whole YUYV pixel
+// pairs. Odd factors take a general path that can cost more than converting
+// the frame at full resolution. Returns 0 on error.
+int ConvertYUYVToRGBADownscaled(uint8_t *input, int w, int h,
+    int input_pitch, const FrameRegion *region, int factor, uint8_t *output,
+    int output_pitch);
+
+// The same as ConvertYUYVToRGBADownscaled, but decodes the colors using the
+// given encoding. Returns 0 on error, including if the encoding isn't valid.
+int ConvertYUYVToRGBADownscaledWithEncoding(const ColorEncoding *encoding,
+    uint8_t *input, int w, int h, int input_pitch, const FrameRegion *region,
+    int factor, uint8_t *output, int output_pitch);
+
+// Copies the Y samples out of a YUYV frame, producing a GREY
+// (V4L2_PIX_FMT_GREY) image with one byte per pixel, for consumers that only
+// need brightness. output_pitch is the number of bytes in a row of the output,
+// and must be at least w. Uses the fastest kernel the CPU supports. Returns 0
+// on error.
+int ConvertYUYVToGrey(uint8_t *input, uint8_t *output, int w, int h,
+    int input_pitch, int output_pitch);
+
+// Converts a YUYV frame to planar I420 (YU12) for encoders: a full-resolution
+// Y plane, and U and V planes with half the width and height. Each chroma
+// sample is the average of the two YUYV rows it covers, rounded up; the last
+// row of a frame with an odd height keeps its own chroma. w must be even.
+// y_pitch and chroma_pitch are the number of bytes in a row of the Y plane
+// and of each chroma plane, and must be at least w and w / 2. The planes may
+// be anywhere in memory. Uses the fastest kernel the CPU supports. Returns 0
+// on error.
+int ConvertYUYVToI420(uint8_t *input, int w, int h, int input_pitch,
+    uint8_t *y_plane, int y_pitch, uint8_t *u_plane, uint8_t *v_plane,
+    int chroma_pitch);
+
+// The same as ConvertYUYVToI420, but produces NV12, which has a single chroma
+// plane of interleaved U, V samples. uv_pitch is the number of bytes in a row
+// of the chroma plane, and must be at least w.
+int ConvertYUYVToNV12(uint8_t *input, int w, int h, int input_pitch,
+    uint8_t *y_plane, int y_pitch, uint8_t *uv_plane, int uv_pitch);
+
+// Describes where one eye's image goes when splitting a stereo frame. format
+// is either RGBA_FORMAT_CODE or V4L2_PIX_FMT_GREY, which holds the frame's Y
+// samples unchanged with one byte per pixel. pitch is the number of bytes in
+// a row of the output. encoding is used to decode the colors of RGBA output,
+// and may be NULL for BT.601 limited range.
+typedef struct {
+  uint8_t *data;
+  int pitch;
+  uint32_t format;
+  const ColorEncoding *encoding;
+} StereoEyeOutput;
+
+// Splits a side-by-side stereo YUYV frame, like the ones produced by the Zed
+// camera, into separate left and right images in a single pass, converting
+// each to its output's format. w is the width of the whole frame, so each
+// eye is w / 2 pixels wide; w must be a multiple of 4 so both eyes start on a
+// whole YUYV pixel pair. Either output may be NULL (or have NULL data) to
+// skip that eye. Uses the fastest kernel the CPU supports. Returns 0 on
+// error.
+int ConvertStereoYUYV(uint8_t *input, int w, int h, int input_pitch,
+    StereoEyeOutput *left, StereoEyeOutput *right);
+
+// The size, in pixels, of the tiles a DirtyTileTracker compares between
+// frames. Tiles at the right and bottom edges may be smaller.
+#define DIRTY_TILE_WIDTH (64)
+#define DIRTY_TILE_HEIGHT (16)
+
+// Tracks which tiles of a YUYV video stream have changed, so that
+// ConvertYUYVToRGBAIncremental only converts those, for cameras watching
+// mostly static scenes. Use CreateDirtyTileTracker to initialize this. Do not
+// directly modify the members of this struct.
+typedef struct {
+  int w;
+  int h;
+  int tile_columns;
+  int tile_rows;
+  int threshold;
+  ColorEncoding encoding;
+  // The YUYV samples of every tile as of when it was last converted, with
+  // w * 2 bytes per row.
+  uint8_t *reference;
+  // The parts of the output changed by the most recent frame, in pixels.
+  FrameRegion *dirty_regions;
+  int dirty_region_count;
+  // For each tile column, the index of the dirty region starting there in the
+  // previous tile row and in the current one, or -1 if there isn't one. Used
+  // to merge tiles that changed in consecutive tile rows into one region.
+  int *column_regions;
+  // Set if every tile must be converted for the next frame.
+  int convert_all;
+  // The number of frames, and the number of tiles checked and converted in
+  // them, since the tracker was created.
+  uint64_t frame_count;
+  uint64_t tile_count;
+  uint64_t converted_tile_count;
+} DirtyTileTracker;
+
+// Initializes a tracker for w x h frames. A tile counts as changed if the
+// mean absolute difference between its YUYV samples and those it had when it
+// was last converted is more than threshold, so 0 converts every tile with
+// any change at all, and small values like 2 ignore sensor noise. Because
+// unconverted tiles keep their old samples for comparison, slow changes are
+// still picked up once they add up. encoding may be NULL to use BT.601
+// limited range. Returns 0 on error.
+int CreateDirtyTileTracker(DirtyTileTracker *tracker, int w, int h,
+    int threshold, const ColorEncoding *encoding);
+
+// Frees the memory used by the tracker.
+void DestroyDirtyTileTracker(DirtyTileTracker *tracker);
+
+// Makes the next ConvertYUYVToRGBAIncremental call convert every tile, e.g.
+// after the output buffer has been lost or replaced.
+void ResetDirtyTileTracker(DirtyTileTracker *tracker);
+
+// Converts the tiles of a YUYV frame that changed since they were last
+// converted, writing them to the RGBA output, which must hold the output of
+// the previous call: everything else is left alone. The first call, and the
+// first after ResetDirtyTileTracker, converts the whole frame. The frame must
+// have the tracker's size. Afterwards, GetDirtyRegions returns the parts of
+// the output that were rewritten, e.g. to upload only those to a texture.
+// Uses the fastest kernel the CPU supports. Returns 0 on error.
+int ConvertYUYVToRGBAIncremental(DirtyTileTracker *tracker, uint8_t *input,
+    uint8_t *output, int input_pitch, int output_pitch);
+
+// Sets regions to the rectangles of the output rewritten by the most recent
+// ConvertYUYVToRGBAIncremental call, and returns how many there are. Tiles
+// that changed next to each other are merged into larger rectangles, which
+// don't overlap. The array stays valid until the next call.
+int GetDirtyRegions(DirtyTileTracker *tracker, const FrameRegion **regions);
+
+// Returns the fraction of tiles, over every frame the tracker has seen, that
+// didn't need converting, between 0 and 1.
+double GetSkippedTileFraction(DirtyTileTracker *tracker);
+
+// Registers a function to convert frames from input_format to output_format,
+// e.g. to add support for capturing in another format. Converters registered
+// later take precedence over earlier ones, including the built-in converters:
+// YUYV, NV12, YU12 (I420) and GREY to RGBA_FORMAT_CODE, and YUYV to GREY,
+// YU12 and NV12.
+// Returns 0 on error, including if MAX_REGISTERED_CONVERTERS have already been
+// registered.
+int RegisterFrameConverter(uint32_t input_format, uint32_t output_format,
+    FrameConverter converter);
+
+// Returns the function to convert frames from input_format to output_format,
+// or NULL if there isn't one. Every format can be "converted" to itself, which
+// passes frames through untouched, including compressed formats like MJPEG.
+// Unless another converter was registered for the pair, the function
+// returned in this case simply copies input_size bytes from the input to the
+// output; applications can also just use the captured frame as-is.
+FrameConverter GetFrameConverter(uint32_t input_format,
+    uint32_t output_format);
+
+// The same as GetFrameConverter, but the built-in converters from YUV formats
+// to RGBA_FORMAT_CODE decode the colors using the given encoding, rather than
+// BT.601 limited range. Registered converters are returned as they are.
+// Returns NULL if there's no converter or the encoding isn't valid.
+FrameConverter GetFrameConverterForEncoding(uint32_t input_format,
+    uint32_t output_format, const ColorEncoding *encoding);
+
+struct ConversionPool;
+
+// Holds information about one of the worker threads in a ConversionPool.
+typedef struct {
+  pthread_t thread;
+  struct ConversionPool *pool;
+  int stripe;
+} ConversionPoolWorker;
+
+// Holds a persistent set of threads used to convert frames in parallel. Each
+// frame is split into one horizontal stripe of rows per thread, and the
+// calling thread converts the first stripe itself. Do not directly modify the
+// members of this struct, and do not copy or move it after calling
+// CreateConversionPool, since the worker threads refer to it.
+typedef struct ConversionPool {
+  int thread_count;
+  ConversionPoolWorker *workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  uint64_t generation;
+  int stripes_remaining;
+  int quit;
+  void (*job)(void *arg, int start_row, int end_row);
+  void *job_arg;
+  int job_rows;
+} ConversionPool;
+
+// Initializes a ConversionPool struct, starting thread_count - 1 worker
+// threads (the thread calling the conversion functions is the remaining one).
+// If thread_count is 0 or less, one thread per online CPU is used. If
+// pin_threads is nonzero, worker thread i is pinned to CPU i, wrapping around
+// if there are more threads than CPUs; the calling thread is never pinned.
+// Create the pool once and reuse it for every frame. Returns 0 on error.
+int CreateConversionPool(ConversionPool *pool, int thread_count,
+    int pin_threads);
+
+// Stops the pool's worker threads and frees its resources.
+void DestroyConversionPool(ConversionPool *pool);
+
+// Returns the number of threads, including the calling thread, that the pool
+// splits each frame across.
+int GetConversionPoolThreadCount(ConversionPool *pool);
+
+// The same as ConvertYUYVToRGBA, but converts the frame in parallel using the
+// threads in the given pool. The output is byte-identical to
+// ConvertYUYVToRGBA. This blocks until the entire frame is converted. Only one
+// thread may use a pool at a time. Returns 0 on error.
+int ConvertYUYVToRGBAParallel(ConversionPool *pool, uint8_t *input,
+    uint8_t *output, int w, int h, int input_pitch, int output_pitch);
+
+// The same as ConvertYUYVToRGBAWithEncoding, but converts the frame in
+// parallel using the threads in the given pool. Returns 0 on error.
+int ConvertYUYVToRGBAParallelWithEncoding(ConversionPool *pool,
+    const ColorEncoding *encoding, uint8_t *input, uint8_t *output, int w,
+    int h, int input_pitch, int output_pitch);
+
+// The same as ConvertYUYVToRGBADownscaled, but converts the frame in
+// parallel using the threads in the given pool. Returns 0 on error.
+int ConvertYUYVToRGBADownscaledParallel(ConversionPool *pool,
+    uint8_t *input, int w, int h, int input_pitch, const FrameRegion *region,
+    int factor, uint8_t *output, int output_pitch);
+
+// The same as ConvertYUYVToRGBADownscaledWithEncoding, but converts the frame
+// in parallel using the threads in the given pool. Returns 0 on error.
+int ConvertYUYVToRGBADownscaledParallelWithEncoding(ConversionPool *pool,
+    const ColorEncoding *encoding, uint8_t *input, int w, int h,
+    int input_pitch, const FrameRegion *region, int factor, uint8_t *output,
+    int output_pitch);
+
+// The same as ConvertStereoYUYV, but splits the frame in parallel using the
+// threads in the given pool. Returns 0 on error.
+int ConvertStereoYUYVParallel(ConversionPool *pool, uint8_t *input, int w,
+    int h, int input_pitch, StereoEyeOutput *left, StereoEyeOutput *right);
+
+// The number of buckets per power of two in a LatencyHistogram is
+// 2^LATENCY_SUB_BUCKET_BITS, so recorded values are accurate to within
+// 1 / 2^LATENCY_SUB_BUCKET_BITS (12.5%).
+#define LATENCY_SUB_BUCKET_BITS (3)
+#define LATENCY_BUCKET_COUNT ((64 - LATENCY_SUB_BUCKET_BITS + 1) << \
+  LATENCY_SUB_BUCKET_BITS)
+
+// A histogram of latencies with logarithmically sized buckets, so recording
+// a value is only a few instructions. Values are recorded with atomic
+// operations, so one histogram may be shared between threads. Do not
+// directly modify the members of this struct.
+typedef struct {
+  uint64_t counts[LATENCY_BUCKET_COUNT];
+  uint64_t count;
+  uint64_t max_ns;
+} LatencyHistogram;
+
+// The intervals in a frame's journey from the camera to the screen that
+// FrameLatencyStats tracks.
+typedef enum {
+  // From the driver's capture timestamp until the frame was dequeued.
+  LATENCY_CAPTURE_TO_DEQUEUE,
+  // From dequeuing the frame until it was converted for display.
+  LATENCY_DEQUEUE_TO_CONVERT,
+  // From finishing the conversion until the frame was presented.
+  LATENCY_CONVERT_TO_PRESENT,
+  // The total time from capture until the frame was presented.
+  LATENCY_CAPTURE_TO_PRESENT,
+  LATENCY_STAGE_COUNT,
+} LatencyStage;
+
+// Holds a latency histogram for each stage of frame processing.
+typedef struct {
+  LatencyHistogram stages[LATENCY_STAGE_COUNT];
+} FrameLatencyStats;
+
+// Clears every histogram in the stats struct.
+void ResetFrameLatencyStats(FrameLatencyStats *stats);
+
+// Adds a latency, in nanoseconds, to the histogram. Negative latencies (which
+// can only come from mismatched clocks) are recorded as 0.
+void RecordLatency(LatencyHistogram *histogram, int64_t latency_ns);
+
+// Returns the latency below which the given percentage of recorded latencies
+// fall, e.g. 99.0 for the 99th percentile. The result is the upper bound of
+// the bucket containing the percentile, and is never more than the maximum
+// recorded latency. Returns 0 if the histogram is empty.
+uint64_t GetLatencyPercentile(LatencyHistogram *histogram, double percentile);
+
+// Records the latency of every stage for a frame, given the times (from
+// GetMonotonicTime) at which the frame finished being converted and was
+// presented.
+void RecordFrameLatency(FrameLatencyStats *stats, WebcamFrame *frame,
+    int64_t converted_ns, int64_t presented_ns);
+
+// Returns a short human-readable name for the stage.
+const char *LatencyStageName(LatencyStage stage);
+
+// Prints the frame count, median, 99th percentile and maximum latency for
+// every stage.
+void PrintFrameLatencyStats(FrameLatencyStats *stats);
+
+// Selects how a capture group waits for frames once StartCaptureGroup is
+// called. CAPTURE_GROUP_EPOLL uses one thread waiting on every device, which
+// is the cheapest option when frames are handled quickly. With
+// CAPTURE_GROUP_THREAD_PER_DEVICE, a slow callback for one device doesn't
+// delay frames from the others.
+typedef enum {
+  CAPTURE_GROUP_EPOLL,
+  CAPTURE_GROUP_THREAD_PER_DEVICE,
+} CaptureGroupMode;
+
+// A frame obtained from a capture group, tagged with the device it came from.
+// device_id is the device's index in the array passed to CreateCaptureGroup.
+typedef struct {
+  int device_id;
+  WebcamInfo *webcam;
+  WebcamFrame frame;
+} GroupFrame;
+
+// Called by StartCaptureGroup's threads for every frame. The frame is
+// released back to its device when this returns, so copy or convert it
+// before returning. In CAPTURE_GROUP_THREAD_PER_DEVICE mode, this is called
+// concurrently for different devices.
+typedef void (*GroupFrameCallback)(GroupFrame *frame, void *user_data);
+
+struct CaptureGroup;
+
+// Holds the state of one device in a capture group.
+typedef struct {
+  struct CaptureGroup *group;
+  int id;
+  WebcamInfo *webcam;
+  // Set when epoll reports activity on the device, and cleared once it has
+  // no more frames.
+  int ready;
+  // Set if epoll reported an error condition along with the activity.
+  int error_reported;
+  // The number of frames from GetGroupFrame that haven't been released. The
+  // device is removed from the epoll set while this equals its buffer count,
+  // since V4L2 reports an error when no buffers are queued.
+  uint32_t held_frames;
+  int paused;
+  // The errno value from the device's first error, or 0.
+  int error;
+  pthread_t thread;
+  int thread_started;
+} CaptureGroupDevice;
+
+// Waits on several webcams at once, using a single epoll set (or a thread
+// per device), and delivers their frames either through GetGroupFrame or a
+// callback. Do not directly modify the members of this struct, and do not
+// copy or move it after calling CreateCaptureGroup.
+typedef struct CaptureGroup {
+  CaptureGroupDevice *devices;
+  int device_count;
+  int epoll_fd;
+  // Written to in order to wake up the capture threads when stopping.
+  int stop_fd;
+  // The device GetGroupFrame checks first, so devices take turns.
+  int next_device;
+  int running;
+  CaptureGroupMode mode;
+  GroupFrameCallback callback;
+  void *user_data;
+  pthread_t epoll_thread;
+} CaptureGroup;
+
+// Initializes a capture group containing the given webcams, which must have
+// already been set up with SetResolution. The WebcamInfo structs must stay
+// valid until DestroyCaptureGroup, and must only be used through the group in
+// the meantime. This queues every capture buffer with BeginLoadingNextFrame.
+// Returns 0 on error.
+int CreateCaptureGroup(CaptureGroup *group, WebcamInfo **webcams,
+    int device_count);
+
+// Stops the group's threads if it was started, and frees its resources. This
+// doesn't close the webcams.
+void DestroyCaptureGroup(CaptureGroup *group);
+
+// Dequeues the next frame from any device in the group, waiting up to
+// timeout_ns nanoseconds for one to arrive (a negative timeout waits
+// indefinitely). Devices with frames ready take turns, so a fast camera can't
+// starve the others. The frame must be returned with ReleaseGroupFrame. This
+// can't be used while the group is started. Returns FRAME_READY if frame was
+// filled in, FRAME_NOT_READY on timeout, or DEVICE_ERROR on error, in which
+// case frame->device_id is set to the failed device (or -1 if the error
+// wasn't specific to one device).
+FrameBufferState GetGroupFrame(CaptureGroup *group, GroupFrame *frame,
+    int64_t timeout_ns);
+
+// Returns a frame from GetGroupFrame to its device. Returns 0 on error.
+int ReleaseGroupFrame(CaptureGroup *group, GroupFrame *frame);
+
+// Starts delivering every frame from the group's devices to the callback,
+// from background threads arranged according to mode. A device that fails is
+// dropped from the group without affecting the others; see
+// GetCaptureGroupDeviceError. Returns 0 on error.
+int StartCaptureGroup(CaptureGroup *group, CaptureGroupMode mode,
+    GroupFrameCallback callback, void *user_data);
+
+// Stops the threads started by StartCaptureGroup, waiting for any callbacks
+// in progress to return. The group can be started again afterwards.
+void StopCaptureGroup(CaptureGroup *group);
+
+// Returns the errno value for the error that caused the device to be dropped
+// from the group, or 0 if the device hasn't failed.
+int GetCaptureGroupDeviceError(CaptureGroup *group, int device_id);
+
+// Recordings are aligned to this many bytes, so they can be written with
+// O_DIRECT.
+#define RECORDING_ALIGNMENT (4096)
+
+// The value of RecordingHeader.magic.
+#define RECORDING_MAGIC "WCAMREC1"
+
+// The start of a recording file. The header is padded to RECORDING_ALIGNMENT
+// bytes, and is followed by the frames, each in its own frame_stride-byte
+// slot, then by frame_count RecordedFrameInfo structs at index_offset.
+// index_offset is 0 if the recording wasn't finished. All values are in the
+// host's byte order.
+typedef struct {
+  char magic[8];
+  uint32_t header_size;
+  uint32_t width;
+  uint32_t height;
+  uint32_t pixel_format;
+  uint32_t bytes_per_line;
+  uint32_t reserved;
+  uint64_t frame_stride;
+  uint64_t frame_count;
+  uint64_t index_offset;
+} RecordingHeader;
+
+// One entry in a recording's frame index. offset is the frame's position in
+// the file, and size is the number of bytes of frame data there.
+typedef struct {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t sequence;
+  int64_t capture_ns;
+} RecordedFrameInfo;
+
+// Writes frames to a recording file from a background thread. RecordFrame
+// copies each frame into a ring of aligned staging slots, and the writer
+// thread writes runs of consecutive slots to disk in single large writes.
+// Do not directly modify the members of this struct, and do not copy or move
+// it after calling StartRecording.
+typedef struct {
+  int fd;
+  // Set if the file was opened with O_DIRECT, bypassing the page cache.
+  int direct_io;
+  RecordingHeader header;
+  uint8_t *slots;
+  RecordedFrameInfo *slot_info;
+  uint32_t slot_count;
+  // The slot the writer thread will write next, and the number of filled
+  // slots starting from it.
+  uint32_t head;
+  uint32_t count;
+  // The index built up by the writer thread, which has room for
+  // index_capacity entries.
+  RecordedFrameInfo *index;
+  uint64_t index_capacity;
+  uint64_t overflow_count;
+  int stopping;
+  // The errno value for the writer thread's first error, or 0.
+  int error;
+  pthread_mutex_t mutex;
+  pthread_cond_t frames_ready;
+  pthread_t thread;
+} WebcamRecorder;
+
+// Creates a recording file at path, replacing any existing file, and starts
+// the writer thread. The webcam must have been set up with SetResolution; the
+// recording uses its pixel format, resolution and row pitch. Returns 0 on
+// error.
+int StartRecording(WebcamRecorder *recorder, WebcamInfo *webcam,
+    const char *path);
+
+// Copies the frame into the recorder's staging ring, so the frame can be
+// released as soon as this returns. This never waits for the disk: if the
+// writer thread has fallen so far behind that the ring is full, the frame is
+// left out of the recording and counted by GetRecordingOverflowCount. Returns
+// 0 on error, including if the writer thread has failed.
+int RecordFrame(WebcamRecorder *recorder, WebcamFrame *frame);
+
+// Returns the number of frames RecordFrame left out because the ring was
+// full.
+uint64_t GetRecordingOverflowCount(WebcamRecorder *recorder);
+
+// Waits for every recorded frame to be written, writes the frame index, and
+// closes the file and frees the recorder's resources. Returns 0 if an error
+// occurred, either now or at any point while recording.
+int FinishRecording(WebcamRecorder *recorder);
+
+// Provides random access to the frames in a finished recording, which is
+// mmap'd rather than read. Do not directly modify the members of this struct.
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  RecordingHeader *header;
+  RecordedFrameInfo *index;
+} RecordingReader;
+
+// Opens and maps the recording at path. Returns 0 on error, with errno set to
+// EINVAL if the file isn't a finished recording.
+int OpenRecording(RecordingReader *reader, const char *path);
+
+// Unmaps the recording.
+void CloseRecording(RecordingReader *reader);
+
+// Returns the number of frames in the recording.
+uint64_t GetRecordedFrameCount(RecordingReader *reader);
+
+// Fills in frame with the recorded frame with the given number, counting from
+// 0. frame->data points into the mapped file and stays valid until
+// CloseRecording is called. frame->index is set to frame_number (modulo
+// 2^32), and both timestamps are set to the original capture time. Returns 0
+// on error.
+int GetRecordedFrame(RecordingReader *reader, uint64_t frame_number,
+    WebcamFrame *frame);
+
 #endif  // WEBCAM_LIB_H
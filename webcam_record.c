@@ -0,0 +1,416 @@
+// This file implements the recorder and recording reader declared in
+// webcam_lib.h.
+//
+// Every frame is stored in a slot of the same size, rounded up to
+// RECORDING_ALIGNMENT bytes, and the staging ring in memory uses the same
+// layout as the file. So the writer thread can write any run of consecutive
+// filled slots with a single aligned write, which is what O_DIRECT requires,
+// and the frame index only needs to be written once, when recording finishes.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "webcam_lib.h"
+
+// The approximate amount of memory to use for the staging ring. This is
+// enough to absorb a few hundred milliseconds of disk stalls at high
+// resolutions.
+#define STAGING_BYTES (64 * 1024 * 1024)
+
+// Limits on the number of slots in the staging ring.
+#define MIN_STAGING_SLOTS (4)
+#define MAX_STAGING_SLOTS (64)
+
+// Rounds size up to a multiple of RECORDING_ALIGNMENT.
+static uint64_t AlignSize(uint64_t size) {
+  return (size + RECORDING_ALIGNMENT - 1) & ~((uint64_t) RECORDING_ALIGNMENT -
+    1);
+}
+
+// Writes the whole buffer to the file at the given offset. Returns 0 on error.
+static int WriteFully(int fd, uint8_t *data, size_t size, uint64_t offset) {
+  ssize_t written;
+  while (size > 0) {
+    written = pwrite(fd, data, size, offset);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    if (written == 0) {
+      errno = EIO;
+      return 0;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return 1;
+}
+
+// Writes the header, which must be padded to a full aligned block for
+// O_DIRECT. Returns 0 on error.
+static int WriteHeader(WebcamRecorder *recorder) {
+  uint8_t *block = NULL;
+  int result;
+  if (posix_memalign((void **) &block, RECORDING_ALIGNMENT,
+    RECORDING_ALIGNMENT) != 0) {
+    errno = ENOMEM;
+    return 0;
+  }
+  memset(block, 0, RECORDING_ALIGNMENT);
+  memcpy(block, &(recorder->header), sizeof(recorder->header));
+  result = WriteFully(recorder->fd, block, RECORDING_ALIGNMENT, 0);
+  free(block);
+  return result;
+}
+
+// Adds index entries for the given slots, which have just been written
+// starting at the given file offset. Returns 0 on error.
+static int AddIndexEntries(WebcamRecorder *recorder, uint32_t first_slot,
+    uint32_t slot_count, uint64_t offset) {
+  RecordingHeader *header = &(recorder->header);
+  RecordedFrameInfo *new_index, *entry;
+  uint64_t new_capacity;
+  uint32_t i;
+  if ((header->frame_count + slot_count) > recorder->index_capacity) {
+    new_capacity = recorder->index_capacity * 2;
+    if (new_capacity < (header->frame_count + slot_count)) {
+      new_capacity = header->frame_count + slot_count;
+    }
+    new_index = (RecordedFrameInfo *) realloc(recorder->index,
+      new_capacity * sizeof(RecordedFrameInfo));
+    if (!new_index) return 0;
+    recorder->index = new_index;
+    recorder->index_capacity = new_capacity;
+  }
+  for (i = 0; i < slot_count; i++) {
+    entry = recorder->index + header->frame_count;
+    *entry = recorder->slot_info[first_slot + i];
+    entry->offset = offset + i * header->frame_stride;
+    header->frame_count++;
+  }
+  return 1;
+}
+
+// Writes a run of consecutive filled slots to the end of the recording.
+// Returns 0 on error.
+static int WriteSlots(WebcamRecorder *recorder, uint32_t first_slot,
+    uint32_t slot_count) {
+  RecordingHeader *header = &(recorder->header);
+  uint64_t offset = header->header_size + header->frame_count *
+    header->frame_stride;
+  if (!WriteFully(recorder->fd, recorder->slots + first_slot *
+    header->frame_stride, slot_count * header->frame_stride, offset)) {
+    return 0;
+  }
+  return AddIndexEntries(recorder, first_slot, slot_count, offset);
+}
+
+// The writer thread's main loop. Writes filled slots until FinishRecording
+// is called and the ring is empty. After an error, frames are discarded
+// rather than written, so RecordFrame can report the error.
+static void *WriterThread(void *arg) {
+  WebcamRecorder *recorder = (WebcamRecorder *) arg;
+  uint32_t head, run;
+  int error;
+  pthread_mutex_lock(&(recorder->mutex));
+  while (1) {
+    while ((recorder->count == 0) && !recorder->stopping) {
+      pthread_cond_wait(&(recorder->frames_ready), &(recorder->mutex));
+    }
+    if (recorder->count == 0) break;
+    // A run can't wrap around the end of the ring, since it has to be
+    // contiguous in memory.
+    head = recorder->head;
+    run = recorder->count;
+    if ((head + run) > recorder->slot_count) run = recorder->slot_count - head;
+    error = recorder->error;
+    pthread_mutex_unlock(&(recorder->mutex));
+    if (!error && !WriteSlots(recorder, head, run)) error = errno;
+    pthread_mutex_lock(&(recorder->mutex));
+    recorder->error = error;
+    recorder->head = (head + run) % recorder->slot_count;
+    recorder->count -= run;
+  }
+  pthread_mutex_unlock(&(recorder->mutex));
+  return NULL;
+}
+
+// Opens the file, with O_DIRECT if the filesystem supports it. Returns 0 on
+// error.
+static int OpenRecordingFile(WebcamRecorder *recorder, const char *path) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  recorder->fd = open(path, flags | O_DIRECT, 0644);
+  if (recorder->fd >= 0) {
+    recorder->direct_io = 1;
+    return 1;
+  }
+  // Some filesystems, such as tmpfs, don't support O_DIRECT. The writes are
+  // still large and aligned without it.
+  if (errno != EINVAL) return 0;
+  recorder->fd = open(path, flags, 0644);
+  return recorder->fd >= 0;
+}
+
+int StartRecording(WebcamRecorder *recorder, WebcamInfo *webcam,
+    const char *path) {
+  RecordingHeader *header = &(recorder->header);
+  uint64_t largest_buffer = 0, staging_size;
+  uint32_t i;
+  int result;
+  memset(recorder, 0, sizeof(*recorder));
+  recorder->fd = -1;
+  if (!webcam->buffers) {
+    errno = EINVAL;
+    return 0;
+  }
+  // Slots need to fit the largest frame the driver can produce, which for
+  // compressed formats isn't determined by the resolution.
+  for (i = 0; i < webcam->buffer_count; i++) {
+    if (webcam->buffers[i].length > largest_buffer) {
+      largest_buffer = webcam->buffers[i].length;
+    }
+  }
+  memcpy(header->magic, RECORDING_MAGIC, sizeof(header->magic));
+  header->header_size = RECORDING_ALIGNMENT;
+  header->width = webcam->resolution.width;
+  header->height = webcam->resolution.height;
+  header->pixel_format = webcam->pixel_format;
+  header->bytes_per_line = webcam->bytes_per_line;
+  header->frame_stride = AlignSize(largest_buffer);
+  recorder->slot_count = STAGING_BYTES / header->frame_stride;
+  if (recorder->slot_count < MIN_STAGING_SLOTS) {
+    recorder->slot_count = MIN_STAGING_SLOTS;
+  }
+  if (recorder->slot_count > MAX_STAGING_SLOTS) {
+    recorder->slot_count = MAX_STAGING_SLOTS;
+  }
+  staging_size = recorder->slot_count * header->frame_stride;
+  if (posix_memalign((void **) &(recorder->slots), RECORDING_ALIGNMENT,
+    staging_size) != 0) {
+    recorder->slots = NULL;
+    errno = ENOMEM;
+    goto error_exit;
+  }
+  // Slot padding is written to the file, so don't leave old heap contents in
+  // it.
+  memset(recorder->slots, 0, staging_size);
+  recorder->slot_info = (RecordedFrameInfo *) calloc(recorder->slot_count,
+    sizeof(RecordedFrameInfo));
+  if (!recorder->slot_info) goto error_exit;
+  if (!OpenRecordingFile(recorder, path)) goto error_exit;
+  // The header is written again with the index location when the recording
+  // is finished. Until then, index_offset is 0, marking it as incomplete.
+  if (!WriteHeader(recorder)) goto error_exit;
+  result = pthread_mutex_init(&(recorder->mutex), NULL);
+  if (result != 0) {
+    errno = result;
+    goto error_exit;
+  }
+  result = pthread_cond_init(&(recorder->frames_ready), NULL);
+  if (result != 0) {
+    pthread_mutex_destroy(&(recorder->mutex));
+    errno = result;
+    goto error_exit;
+  }
+  result = pthread_create(&(recorder->thread), NULL, WriterThread, recorder);
+  if (result != 0) {
+    pthread_cond_destroy(&(recorder->frames_ready));
+    pthread_mutex_destroy(&(recorder->mutex));
+    errno = result;
+    goto error_exit;
+  }
+  return 1;
+error_exit:
+  if (recorder->fd >= 0) close(recorder->fd);
+  free(recorder->slot_info);
+  free(recorder->slots);
+  memset(recorder, 0, sizeof(*recorder));
+  recorder->fd = -1;
+  return 0;
+}
+
+int RecordFrame(WebcamRecorder *recorder, WebcamFrame *frame) {
+  RecordedFrameInfo *info;
+  uint32_t slot;
+  int error;
+  if (frame->size > recorder->header.frame_stride) {
+    errno = EINVAL;
+    return 0;
+  }
+  pthread_mutex_lock(&(recorder->mutex));
+  error = recorder->error;
+  if (!error && (recorder->count == recorder->slot_count)) {
+    recorder->overflow_count++;
+    pthread_mutex_unlock(&(recorder->mutex));
+    return 1;
+  }
+  slot = (recorder->head + recorder->count) % recorder->slot_count;
+  pthread_mutex_unlock(&(recorder->mutex));
+  if (error) {
+    errno = error;
+    return 0;
+  }
+  // The writer thread doesn't touch the slot until count includes it, so it
+  // can be filled in without holding the lock.
+  memcpy(recorder->slots + slot * recorder->header.frame_stride, frame->data,
+    frame->size);
+  info = recorder->slot_info + slot;
+  info->offset = 0;
+  info->size = frame->size;
+  info->sequence = frame->sequence;
+  info->capture_ns = frame->capture_ns;
+  pthread_mutex_lock(&(recorder->mutex));
+  recorder->count++;
+  pthread_cond_signal(&(recorder->frames_ready));
+  pthread_mutex_unlock(&(recorder->mutex));
+  return 1;
+}
+
+uint64_t GetRecordingOverflowCount(WebcamRecorder *recorder) {
+  uint64_t count;
+  pthread_mutex_lock(&(recorder->mutex));
+  count = recorder->overflow_count;
+  pthread_mutex_unlock(&(recorder->mutex));
+  return count;
+}
+
+// Writes the frame index after the last frame, and points the header at it.
+// Returns 0 on error.
+static int WriteIndex(WebcamRecorder *recorder) {
+  RecordingHeader *header = &(recorder->header);
+  uint64_t index_size = header->frame_count * sizeof(RecordedFrameInfo);
+  uint64_t padded_size = AlignSize(index_size);
+  uint8_t *block = NULL;
+  header->index_offset = header->header_size + header->frame_count *
+    header->frame_stride;
+  if (padded_size > 0) {
+    if (posix_memalign((void **) &block, RECORDING_ALIGNMENT, padded_size)
+      != 0) {
+      errno = ENOMEM;
+      return 0;
+    }
+    memset(block + index_size, 0, padded_size - index_size);
+    memcpy(block, recorder->index, index_size);
+    if (!WriteFully(recorder->fd, block, padded_size, header->index_offset)) {
+      free(block);
+      return 0;
+    }
+    free(block);
+  }
+  // Drop the padding that O_DIRECT required.
+  if (ftruncate(recorder->fd, header->index_offset + index_size) < 0) {
+    return 0;
+  }
+  return WriteHeader(recorder);
+}
+
+int FinishRecording(WebcamRecorder *recorder) {
+  int error;
+  pthread_mutex_lock(&(recorder->mutex));
+  recorder->stopping = 1;
+  pthread_cond_signal(&(recorder->frames_ready));
+  pthread_mutex_unlock(&(recorder->mutex));
+  pthread_join(recorder->thread, NULL);
+  error = recorder->error;
+  if (!error && !WriteIndex(recorder)) error = errno;
+  if ((close(recorder->fd) < 0) && !error) error = errno;
+  pthread_cond_destroy(&(recorder->frames_ready));
+  pthread_mutex_destroy(&(recorder->mutex));
+  free(recorder->index);
+  free(recorder->slot_info);
+  free(recorder->slots);
+  memset(recorder, 0, sizeof(*recorder));
+  recorder->fd = -1;
+  if (error) {
+    errno = error;
+    return 0;
+  }
+  return 1;
+}
+
+int OpenRecording(RecordingReader *reader, const char *path) {
+  struct stat file_info;
+  RecordingHeader *header;
+  uint64_t index_end;
+  int fd;
+  memset(reader, 0, sizeof(*reader));
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  if (fstat(fd, &file_info) < 0) goto error_exit;
+  if (file_info.st_size < sizeof(RecordingHeader)) {
+    errno = EINVAL;
+    goto error_exit;
+  }
+  reader->size = file_info.st_size;
+  reader->data = (uint8_t *) mmap(NULL, reader->size, PROT_READ, MAP_SHARED,
+    fd, 0);
+  if (reader->data == MAP_FAILED) {
+    reader->data = NULL;
+    goto error_exit;
+  }
+  close(fd);
+  fd = -1;
+  header = (RecordingHeader *) reader->data;
+  if (memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0) {
+    errno = EINVAL;
+    goto error_exit;
+  }
+  // Unfinished recordings have no index. The index must also be aligned for
+  // the RecordedFrameInfo structs, and contained in the file.
+  index_end = header->index_offset + header->frame_count *
+    sizeof(RecordedFrameInfo);
+  if ((header->index_offset == 0) ||
+    ((header->index_offset % sizeof(uint64_t)) != 0) ||
+    (header->frame_count > (reader->size / sizeof(RecordedFrameInfo))) ||
+    (index_end > reader->size) || (index_end < header->index_offset)) {
+    errno = EINVAL;
+    goto error_exit;
+  }
+  reader->header = header;
+  reader->index = (RecordedFrameInfo *) (reader->data + header->index_offset);
+  return 1;
+error_exit:
+  if (fd >= 0) close(fd);
+  CloseRecording(reader);
+  return 0;
+}
+
+void CloseRecording(RecordingReader *reader) {
+  if (reader->data) munmap(reader->data, reader->size);
+  memset(reader, 0, sizeof(*reader));
+}
+
+uint64_t GetRecordedFrameCount(RecordingReader *reader) {
+  return reader->header->frame_count;
+}
+
+int GetRecordedFrame(RecordingReader *reader, uint64_t frame_number,
+    WebcamFrame *frame) {
+  RecordedFrameInfo *info;
+  if (frame_number >= reader->header->frame_count) {
+    errno = EINVAL;
+    return 0;
+  }
+  info = reader->index + frame_number;
+  // The index is only checked when it's used, so opening a long recording
+  // doesn't have to read all of it.
+  if ((info->offset > reader->size) ||
+    (info->size > (reader->size - info->offset))) {
+    errno = EINVAL;
+    return 0;
+  }
+  frame->data = reader->data + info->offset;
+  frame->size = info->size;
+  frame->index = (uint32_t) frame_number;
+  frame->sequence = info->sequence;
+  frame->capture_ns = info->capture_ns;
+  frame->dequeue_ns = info->capture_ns;
+  return 1;
+}
@@ -0,0 +1,777 @@
+// This file implements the synthetic, replay and recording webcams declared
+// in webcam_lib.h. All of them are backends that emulate a V4L2 capture
+// device, so the rest of the library (and any program using it) can run
+// without a camera.
+//
+// The emulated device completes one frame per tick of its frame clock. A tick
+// fills the oldest queued buffer, or is counted as a dropped frame if no
+// buffers are queued, in the same way a driver skips sequence numbers when it
+// runs out of buffers. Ticks are processed lazily whenever the library calls
+// into the backend, and the file descriptor returned by GetWebcamFD is a
+// timerfd armed for the next time a frame will be ready, so it can be polled
+// like a real device.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "webcam_lib.h"
+
+// The maximum number of buffers the emulated device will provide.
+#define MAX_EMULATED_BUFFERS (32)
+
+// The number of distinct bars in the color bar pattern.
+#define COLOR_BAR_COUNT (8)
+
+typedef enum {
+  EMULATED_BUFFER_IDLE,
+  EMULATED_BUFFER_QUEUED,
+  EMULATED_BUFFER_DONE,
+} EmulatedBufferState;
+
+typedef struct {
+  uint8_t *data;
+  size_t length;
+  EmulatedBufferState state;
+  uint32_t sequence;
+  uint64_t timestamp_ns;
+} EmulatedBuffer;
+
+// A FIFO of buffer indices.
+typedef struct {
+  uint32_t indices[MAX_EMULATED_BUFFERS];
+  uint32_t start;
+  uint32_t count;
+} BufferQueue;
+
+typedef struct {
+  const char *driver_name;
+  SyntheticPattern pattern;
+  // Holds the file being replayed, or NULL for a synthetic webcam.
+  uint8_t *replay_data;
+  size_t replay_size;
+  uint32_t replay_frame_count;
+  // The recording being played back, whose data is NULL if there isn't one.
+  RecordingReader recording;
+  uint32_t width;
+  uint32_t height;
+  // The current frame rate, which VIDIOC_S_PARM can lower to anywhere from 1
+  // up to max_fps, the rate the device was opened with.
+  uint32_t fps;
+  uint32_t max_fps;
+  size_t frame_size;
+  // The static part of the color bar pattern, generated once.
+  uint8_t *pattern_frame;
+  uint64_t noise_state;
+  uint32_t memory_type;
+  uint32_t buffer_count;
+  // The memory backing V4L2_MEMORY_MMAP buffers, split into slots of
+  // slot_size bytes.
+  uint8_t *mapped_memory;
+  size_t slot_size;
+  EmulatedBuffer buffers[MAX_EMULATED_BUFFERS];
+  BufferQueue queued;
+  BufferQueue done;
+  int streaming;
+  uint64_t start_ns;
+  // The index of the next tick of the frame clock, counted from start_ns.
+  uint64_t next_tick;
+  // Only used when fps is 0, since sequence numbers are derived from the tick
+  // otherwise.
+  uint32_t next_sequence;
+} EmulatedDevice;
+
+// The colors of the standard 75% color bars, as Y, U and V values.
+static const uint8_t color_bars[COLOR_BAR_COUNT][3] = {
+  {180, 128, 128},
+  {162, 44, 142},
+  {131, 156, 44},
+  {112, 72, 58},
+  {84, 184, 198},
+  {65, 100, 212},
+  {35, 212, 114},
+  {16, 128, 128},
+};
+
+static uint64_t CurrentNanoseconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static EmulatedDevice *GetDevice(WebcamInfo *webcam) {
+  return (EmulatedDevice *) webcam->backend_data;
+}
+
+static void PushBuffer(BufferQueue *queue, uint32_t index) {
+  queue->indices[(queue->start + queue->count) % MAX_EMULATED_BUFFERS] =
+    index;
+  queue->count++;
+}
+
+static uint32_t PopBuffer(BufferQueue *queue) {
+  uint32_t index = queue->indices[queue->start];
+  queue->start = (queue->start + 1) % MAX_EMULATED_BUFFERS;
+  queue->count--;
+  return index;
+}
+
+// Returns the time at which the given tick of the frame clock occurs.
+static uint64_t TickTime(EmulatedDevice *device, uint64_t tick) {
+  return device->start_ns + (tick * 1000000000ULL) / device->fps;
+}
+
+// Fills in the static part of the color bar pattern. Returns 0 on error.
+static int GeneratePatternFrame(EmulatedDevice *device) {
+  uint8_t *row;
+  uint32_t x, y, bar;
+  device->pattern_frame = (uint8_t *) malloc(device->frame_size);
+  if (!device->pattern_frame) return 0;
+  row = device->pattern_frame;
+  for (x = 0; x < device->width; x += 2) {
+    bar = (x * COLOR_BAR_COUNT) / device->width;
+    row[x * 2] = color_bars[bar][0];
+    row[x * 2 + 1] = color_bars[bar][1];
+    row[x * 2 + 2] = color_bars[bar][0];
+    row[x * 2 + 3] = color_bars[bar][2];
+  }
+  for (y = 1; y < device->height; y++) {
+    memcpy(row + y * device->width * 2, row, device->width * 2);
+  }
+  return 1;
+}
+
+// Draws the color bars, with a white square whose position depends on the
+// frame's sequence number.
+static void DrawColorBars(EmulatedDevice *device, uint8_t *output,
+    uint32_t sequence) {
+  uint32_t box_size = device->height / 8;
+  uint32_t travel, box_x, box_y, x, y;
+  uint8_t *row;
+  memcpy(output, device->pattern_frame, device->frame_size);
+  if ((box_size < 2) || (box_size >= device->width)) return;
+  box_size &= ~1;
+  travel = device->width - box_size;
+  box_x = ((sequence * 4) % travel) & ~1;
+  box_y = (device->height - box_size) / 2;
+  for (y = box_y; y < (box_y + box_size); y++) {
+    row = output + (y * device->width + box_x) * 2;
+    for (x = 0; x < box_size * 2; x += 2) {
+      row[x] = 235;
+      row[x + 1] = 128;
+    }
+  }
+}
+
+// Fills the frame with pseudorandom bytes, using an xorshift generator.
+static void DrawNoise(EmulatedDevice *device, uint8_t *output) {
+  uint64_t state = device->noise_state;
+  size_t i;
+  for (i = 0; (i + 8) <= device->frame_size; i += 8) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    memcpy(output + i, &state, 8);
+  }
+  for (; i < device->frame_size; i++) {
+    output[i] = (uint8_t) state;
+    state >>= 8;
+  }
+  device->noise_state = state;
+}
+
+// Writes the frame with the given sequence number into a buffer.
+static void FillFrame(EmulatedDevice *device, uint8_t *output,
+    uint32_t sequence) {
+  WebcamFrame recorded;
+  size_t offset;
+  if (device->recording.data) {
+    // The index was checked when the device was opened, so this can't fail.
+    GetRecordedFrame(&(device->recording), sequence %
+      GetRecordedFrameCount(&(device->recording)), &recorded);
+    memcpy(output, recorded.data, device->frame_size);
+    return;
+  }
+  if (device->replay_data) {
+    offset = (sequence % device->replay_frame_count) * device->frame_size;
+    memcpy(output, device->replay_data + offset, device->frame_size);
+    return;
+  }
+  if (device->pattern == SYNTHETIC_PATTERN_NOISE) {
+    DrawNoise(device, output);
+    return;
+  }
+  DrawColorBars(device, output, sequence);
+}
+
+// Fills the oldest queued buffer and moves it to the done queue.
+static void CompleteBuffer(EmulatedDevice *device, uint32_t sequence,
+    uint64_t timestamp_ns) {
+  EmulatedBuffer *buffer = device->buffers + PopBuffer(&device->queued);
+  FillFrame(device, buffer->data, sequence);
+  buffer->sequence = sequence;
+  buffer->timestamp_ns = timestamp_ns;
+  buffer->state = EMULATED_BUFFER_DONE;
+  PushBuffer(&device->done, buffer - device->buffers);
+}
+
+// Processes every tick of the frame clock up to the current time.
+static void AdvanceFrameClock(EmulatedDevice *device) {
+  uint64_t now, tick_time, current_tick;
+  if (!device->streaming) return;
+  now = CurrentNanoseconds();
+  if (device->fps == 0) {
+    while (device->queued.count != 0) {
+      CompleteBuffer(device, device->next_sequence, now);
+      device->next_sequence++;
+    }
+    return;
+  }
+  while (device->queued.count != 0) {
+    tick_time = TickTime(device, device->next_tick);
+    if (tick_time > now) return;
+    // Ticks are numbered from 1, since the first frame is ready one period
+    // after streaming starts.
+    CompleteBuffer(device, device->next_tick - 1, tick_time);
+    device->next_tick++;
+  }
+  // Any ticks that passed with nothing queued are dropped frames.
+  current_tick = ((now - device->start_ns) * device->fps) / 1000000000ULL;
+  if (current_tick >= device->next_tick) device->next_tick = current_tick + 1;
+}
+
+// Arms the timerfd so it becomes readable when a frame can be dequeued.
+static void UpdateTimer(WebcamInfo *webcam) {
+  EmulatedDevice *device = GetDevice(webcam);
+  struct itimerspec timer;
+  uint64_t expirations, ready_ns = 0;
+  // Clear any expiration that has already been reported.
+  if (read(webcam->fd, &expirations, sizeof(expirations)) < 0) {
+    // EAGAIN just means the timer hadn't expired.
+  }
+  memset(&timer, 0, sizeof(timer));
+  // Any time in the past makes the timer expire immediately, and a time of 0
+  // disarms it.
+  if (device->streaming) {
+    if (device->done.count != 0) {
+      ready_ns = 1;
+    } else if (device->queued.count != 0) {
+      ready_ns = device->fps ? TickTime(device, device->next_tick) : 1;
+    }
+  }
+  timer.it_value.tv_sec = ready_ns / 1000000000ULL;
+  timer.it_value.tv_nsec = ready_ns % 1000000000ULL;
+  timerfd_settime(webcam->fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+// Frees the buffers, returning the device to the state it was in before
+// VIDIOC_REQBUFS.
+static void FreeEmulatedBuffers(EmulatedDevice *device) {
+  if (device->mapped_memory) {
+    munmap(device->mapped_memory, device->slot_size * device->buffer_count);
+  }
+  device->mapped_memory = NULL;
+  device->buffer_count = 0;
+  device->streaming = 0;
+  memset(device->buffers, 0, sizeof(device->buffers));
+  memset(&(device->queued), 0, sizeof(device->queued));
+  memset(&(device->done), 0, sizeof(device->done));
+}
+
+static int QueryCapabilities(EmulatedDevice *device,
+    struct v4l2_capability *info) {
+  memset(info, 0, sizeof(*info));
+  snprintf((char *) info->driver, sizeof(info->driver), "%s",
+    device->driver_name);
+  snprintf((char *) info->card, sizeof(info->card), "Emulated %s webcam",
+    device->driver_name);
+  snprintf((char *) info->bus_info, sizeof(info->bus_info), "platform:%s",
+    device->driver_name);
+  info->version = 1;
+  info->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+  info->capabilities = info->device_caps | V4L2_CAP_DEVICE_CAPS;
+  return 0;
+}
+
+static int EnumerateFormats(struct v4l2_fmtdesc *info) {
+  if ((info->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) || (info->index != 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memset(info->description, 0, sizeof(info->description));
+  snprintf((char *) info->description, sizeof(info->description),
+    "YUYV 4:2:2");
+  info->flags = 0;
+  info->pixelformat = YUYV_FORMAT_CODE;
+  return 0;
+}
+
+static int EnumerateFrameSizes(EmulatedDevice *device,
+    struct v4l2_frmsizeenum *info) {
+  if ((info->index != 0) || (info->pixel_format != YUYV_FORMAT_CODE)) {
+    errno = EINVAL;
+    return -1;
+  }
+  info->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+  info->discrete.width = device->width;
+  info->discrete.height = device->height;
+  return 0;
+}
+
+static int EnumerateFrameIntervals(EmulatedDevice *device,
+    struct v4l2_frmivalenum *info) {
+  if ((info->index != 0) || (info->pixel_format != YUYV_FORMAT_CODE) ||
+    (info->width != device->width) || (info->height != device->height) ||
+    (device->max_fps == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  info->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;
+  info->stepwise.min.numerator = 1;
+  info->stepwise.min.denominator = device->max_fps;
+  info->stepwise.max.numerator = 1;
+  info->stepwise.max.denominator = 1;
+  info->stepwise.step.numerator = 1;
+  info->stepwise.step.denominator = 1;
+  return 0;
+}
+
+// Handles VIDIOC_G_FMT, VIDIOC_S_FMT and VIDIOC_TRY_FMT. The emulated device
+// only has one format, so all of them report it.
+static int GetFormat(EmulatedDevice *device, struct v4l2_format *format) {
+  if (format->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+    errno = EINVAL;
+    return -1;
+  }
+  memset(&(format->fmt.pix), 0, sizeof(format->fmt.pix));
+  format->fmt.pix.width = device->width;
+  format->fmt.pix.height = device->height;
+  format->fmt.pix.pixelformat = YUYV_FORMAT_CODE;
+  format->fmt.pix.field = V4L2_FIELD_NONE;
+  format->fmt.pix.bytesperline = device->width * 2;
+  format->fmt.pix.sizeimage = device->frame_size;
+  format->fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
+  return 0;
+}
+
+// Handles VIDIOC_G_PARM, and reports the current settings for VIDIOC_S_PARM.
+static int GetStreamParameters(EmulatedDevice *device,
+    struct v4l2_streamparm *parameters) {
+  if (parameters->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+    errno = EINVAL;
+    return -1;
+  }
+  memset(&(parameters->parm.capture), 0, sizeof(parameters->parm.capture));
+  if (device->fps == 0) return 0;
+  parameters->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+  parameters->parm.capture.timeperframe.numerator = 1;
+  parameters->parm.capture.timeperframe.denominator = device->fps;
+  return 0;
+}
+
+// Handles VIDIOC_S_PARM. Like a real driver, this rounds the requested frame
+// rate to the nearest supported one rather than failing. Unpaced devices
+// ignore the request.
+static int SetStreamParameters(EmulatedDevice *device,
+    struct v4l2_streamparm *parameters) {
+  struct v4l2_fract *interval = &(parameters->parm.capture.timeperframe);
+  uint32_t fps;
+  if (parameters->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+    errno = EINVAL;
+    return -1;
+  }
+  // The frame clock's ticks are counted from start_ns at a fixed rate.
+  if (device->streaming) {
+    errno = EBUSY;
+    return -1;
+  }
+  if ((device->max_fps != 0) && (interval->numerator != 0)) {
+    fps = (interval->denominator + interval->numerator / 2) /
+      interval->numerator;
+    if (fps < 1) fps = 1;
+    if (fps > device->max_fps) fps = device->max_fps;
+    device->fps = fps;
+  }
+  return GetStreamParameters(device, parameters);
+}
+
+static int RequestEmulatedBuffers(EmulatedDevice *device,
+    struct v4l2_requestbuffers *request) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  uint32_t i;
+  if ((request->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) ||
+    ((request->memory != V4L2_MEMORY_MMAP) &&
+    (request->memory != V4L2_MEMORY_USERPTR))) {
+    errno = EINVAL;
+    return -1;
+  }
+  FreeEmulatedBuffers(device);
+  if (request->count == 0) return 0;
+  if (request->count > MAX_EMULATED_BUFFERS) {
+    request->count = MAX_EMULATED_BUFFERS;
+  }
+  device->memory_type = request->memory;
+  if (request->memory == V4L2_MEMORY_MMAP) {
+    device->slot_size = ((device->frame_size + page_size - 1) / page_size) *
+      page_size;
+    device->mapped_memory = (uint8_t *) mmap(NULL,
+      device->slot_size * request->count, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (device->mapped_memory == MAP_FAILED) {
+      device->mapped_memory = NULL;
+      request->count = 0;
+      return 0;
+    }
+    for (i = 0; i < request->count; i++) {
+      device->buffers[i].data = device->mapped_memory + i * device->slot_size;
+      device->buffers[i].length = device->slot_size;
+    }
+  }
+  device->buffer_count = request->count;
+  return 0;
+}
+
+// Fills in the parts of a v4l2_buffer struct describing the buffer's
+// current state.
+static void DescribeBuffer(EmulatedDevice *device, uint32_t index,
+    struct v4l2_buffer *info) {
+  EmulatedBuffer *buffer = device->buffers + index;
+  info->index = index;
+  info->memory = device->memory_type;
+  info->length = buffer->length;
+  info->field = V4L2_FIELD_NONE;
+  info->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+  if (device->memory_type == V4L2_MEMORY_MMAP) {
+    info->m.offset = index * device->slot_size;
+  } else {
+    info->m.userptr = (unsigned long) buffer->data;
+  }
+  if (buffer->state == EMULATED_BUFFER_QUEUED) {
+    info->flags |= V4L2_BUF_FLAG_QUEUED;
+  } else if (buffer->state == EMULATED_BUFFER_DONE) {
+    info->flags |= V4L2_BUF_FLAG_DONE;
+  }
+}
+
+static int QueryEmulatedBuffer(EmulatedDevice *device,
+    struct v4l2_buffer *info) {
+  if ((info->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) ||
+    (info->index >= device->buffer_count)) {
+    errno = EINVAL;
+    return -1;
+  }
+  DescribeBuffer(device, info->index, info);
+  return 0;
+}
+
+static int QueueEmulatedBuffer(EmulatedDevice *device,
+    struct v4l2_buffer *info) {
+  EmulatedBuffer *buffer;
+  if ((info->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) ||
+    (info->memory != device->memory_type) ||
+    (info->index >= device->buffer_count)) {
+    errno = EINVAL;
+    return -1;
+  }
+  buffer = device->buffers + info->index;
+  if (buffer->state != EMULATED_BUFFER_IDLE) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (device->memory_type == V4L2_MEMORY_USERPTR) {
+    if (!info->m.userptr || (info->length < device->frame_size)) {
+      errno = EINVAL;
+      return -1;
+    }
+    buffer->data = (uint8_t *) info->m.userptr;
+    buffer->length = info->length;
+  }
+  // Ticks that passed while nothing was queued mustn't fill this buffer.
+  AdvanceFrameClock(device);
+  buffer->state = EMULATED_BUFFER_QUEUED;
+  PushBuffer(&(device->queued), info->index);
+  DescribeBuffer(device, info->index, info);
+  return 0;
+}
+
+static int DequeueEmulatedBuffer(EmulatedDevice *device,
+    struct v4l2_buffer *info) {
+  EmulatedBuffer *buffer;
+  uint32_t index;
+  if ((info->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) ||
+    (info->memory != device->memory_type)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!device->streaming) {
+    errno = EINVAL;
+    return -1;
+  }
+  AdvanceFrameClock(device);
+  if (device->done.count == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  index = PopBuffer(&(device->done));
+  buffer = device->buffers + index;
+  buffer->state = EMULATED_BUFFER_IDLE;
+  DescribeBuffer(device, index, info);
+  info->bytesused = device->frame_size;
+  info->sequence = buffer->sequence;
+  info->timestamp.tv_sec = buffer->timestamp_ns / 1000000000ULL;
+  info->timestamp.tv_usec = (buffer->timestamp_ns % 1000000000ULL) / 1000;
+  return 0;
+}
+
+static int StartStreaming(EmulatedDevice *device) {
+  if (device->buffer_count == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (device->streaming) return 0;
+  device->streaming = 1;
+  device->start_ns = CurrentNanoseconds();
+  device->next_tick = 1;
+  device->next_sequence = 0;
+  return 0;
+}
+
+// Stops streaming, which returns every buffer to the application.
+static void StopStreaming(EmulatedDevice *device) {
+  uint32_t i;
+  device->streaming = 0;
+  for (i = 0; i < device->buffer_count; i++) {
+    device->buffers[i].state = EMULATED_BUFFER_IDLE;
+  }
+  memset(&(device->queued), 0, sizeof(device->queued));
+  memset(&(device->done), 0, sizeof(device->done));
+}
+
+static int HandleIoctl(EmulatedDevice *device, unsigned long request,
+    void *arg) {
+  switch (request) {
+  case VIDIOC_QUERYCAP:
+    return QueryCapabilities(device, (struct v4l2_capability *) arg);
+  case VIDIOC_ENUM_FMT:
+    return EnumerateFormats((struct v4l2_fmtdesc *) arg);
+  case VIDIOC_ENUM_FRAMESIZES:
+    return EnumerateFrameSizes(device, (struct v4l2_frmsizeenum *) arg);
+  case VIDIOC_ENUM_FRAMEINTERVALS:
+    return EnumerateFrameIntervals(device, (struct v4l2_frmivalenum *) arg);
+  case VIDIOC_G_FMT:
+  case VIDIOC_S_FMT:
+  case VIDIOC_TRY_FMT:
+    if ((request == VIDIOC_S_FMT) && device->buffer_count) {
+      errno = EBUSY;
+      return -1;
+    }
+    return GetFormat(device, (struct v4l2_format *) arg);
+  case VIDIOC_G_PARM:
+    return GetStreamParameters(device, (struct v4l2_streamparm *) arg);
+  case VIDIOC_S_PARM:
+    return SetStreamParameters(device, (struct v4l2_streamparm *) arg);
+  case VIDIOC_REQBUFS:
+    return RequestEmulatedBuffers(device, (struct v4l2_requestbuffers *) arg);
+  case VIDIOC_QUERYBUF:
+    return QueryEmulatedBuffer(device, (struct v4l2_buffer *) arg);
+  case VIDIOC_QBUF:
+    return QueueEmulatedBuffer(device, (struct v4l2_buffer *) arg);
+  case VIDIOC_DQBUF:
+    return DequeueEmulatedBuffer(device, (struct v4l2_buffer *) arg);
+  case VIDIOC_STREAMON:
+    return StartStreaming(device);
+  case VIDIOC_STREAMOFF:
+    StopStreaming(device);
+    return 0;
+  }
+  // This includes VIDIOC_EXPBUF, since the buffers aren't DMABUFs.
+  errno = ENOTTY;
+  return -1;
+}
+
+static int EmulatedIoctl(WebcamInfo *webcam, unsigned long request,
+    void *arg) {
+  int result = HandleIoctl(GetDevice(webcam), request, arg);
+  int saved_errno = errno;
+  UpdateTimer(webcam);
+  errno = saved_errno;
+  return result;
+}
+
+static void *EmulatedMmap(WebcamInfo *webcam, size_t length, off_t offset) {
+  EmulatedDevice *device = GetDevice(webcam);
+  if (!device->mapped_memory || (offset < 0) ||
+    ((offset % device->slot_size) != 0) ||
+    ((offset / device->slot_size) >= device->buffer_count) ||
+    (length > device->slot_size)) {
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+  return device->mapped_memory + offset;
+}
+
+static void EmulatedMunmap(WebcamInfo *webcam, void *address, size_t length) {
+  // The buffer memory belongs to the device, and is freed when it's closed.
+}
+
+// Frees the device and everything it holds other than its buffers.
+static void FreeEmulatedDevice(EmulatedDevice *device) {
+  if (device->replay_data) munmap(device->replay_data, device->replay_size);
+  if (device->recording.data) CloseRecording(&(device->recording));
+  free(device->pattern_frame);
+  free(device);
+}
+
+static void EmulatedClose(WebcamInfo *webcam) {
+  EmulatedDevice *device = GetDevice(webcam);
+  FreeEmulatedBuffers(device);
+  FreeEmulatedDevice(device);
+  close(webcam->fd);
+}
+
+static const WebcamBackend synthetic_backend = {
+  "synthetic",
+  EmulatedIoctl,
+  EmulatedMmap,
+  EmulatedMunmap,
+  EmulatedClose,
+};
+
+static const WebcamBackend replay_backend = {
+  "replay",
+  EmulatedIoctl,
+  EmulatedMmap,
+  EmulatedMunmap,
+  EmulatedClose,
+};
+
+static const WebcamBackend recording_backend = {
+  "recording",
+  EmulatedIoctl,
+  EmulatedMmap,
+  EmulatedMunmap,
+  EmulatedClose,
+};
+
+// Allocates an EmulatedDevice for the given resolution. Returns NULL on error.
+static EmulatedDevice *CreateEmulatedDevice(uint32_t width, uint32_t height,
+    uint32_t fps) {
+  EmulatedDevice *device;
+  // YUYV can't represent odd widths.
+  if ((width < 2) || ((width % 2) != 0) || (height == 0) ||
+    (width > 16384) || (height > 16384)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  device = (EmulatedDevice *) calloc(1, sizeof(*device));
+  if (!device) return NULL;
+  device->width = width;
+  device->height = height;
+  device->fps = fps;
+  device->max_fps = fps;
+  device->frame_size = ((size_t) width) * height * 2;
+  device->memory_type = V4L2_MEMORY_MMAP;
+  device->noise_state = 0x2545f4914f6cdd1dULL;
+  return device;
+}
+
+// Creates the timerfd and passes the device to OpenWebcamWithBackend. Frees
+// the device on error. Returns 0 on error.
+static int OpenEmulatedDevice(WebcamInfo *webcam, const WebcamBackend *backend,
+    EmulatedDevice *device) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    FreeEmulatedDevice(device);
+    return 0;
+  }
+  device->driver_name = backend->name;
+  return OpenWebcamWithBackend(webcam, backend, fd, device);
+}
+
+int OpenSyntheticWebcam(WebcamInfo *webcam, uint32_t width, uint32_t height,
+    uint32_t fps, SyntheticPattern pattern) {
+  EmulatedDevice *device = CreateEmulatedDevice(width, height, fps);
+  if (!device) return 0;
+  device->pattern = pattern;
+  if ((pattern == SYNTHETIC_PATTERN_COLOR_BARS) &&
+    !GeneratePatternFrame(device)) {
+    free(device);
+    return 0;
+  }
+  return OpenEmulatedDevice(webcam, &synthetic_backend, device);
+}
+
+int OpenReplayWebcam(WebcamInfo *webcam, const char *path, uint32_t width,
+    uint32_t height, uint32_t fps) {
+  EmulatedDevice *device = CreateEmulatedDevice(width, height, fps);
+  struct stat file_info;
+  int fd;
+  if (!device) return 0;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) goto error_exit;
+  if (fstat(fd, &file_info) < 0) goto error_exit;
+  // The file must contain a whole number of frames.
+  if ((file_info.st_size < device->frame_size) ||
+    ((file_info.st_size % device->frame_size) != 0)) {
+    errno = EINVAL;
+    goto error_exit;
+  }
+  device->replay_size = file_info.st_size;
+  device->replay_frame_count = device->replay_size / device->frame_size;
+  device->replay_data = (uint8_t *) mmap(NULL, device->replay_size,
+    PROT_READ, MAP_PRIVATE, fd, 0);
+  if (device->replay_data == MAP_FAILED) {
+    device->replay_data = NULL;
+    goto error_exit;
+  }
+  close(fd);
+  return OpenEmulatedDevice(webcam, &replay_backend, device);
+error_exit:
+  if (fd >= 0) close(fd);
+  free(device);
+  return 0;
+}
+
+int OpenRecordingWebcam(WebcamInfo *webcam, const char *path, uint32_t fps) {
+  RecordingReader recording;
+  RecordingHeader *header;
+  EmulatedDevice *device;
+  WebcamFrame frame;
+  uint64_t i;
+  if (!OpenRecording(&recording, path)) return 0;
+  header = recording.header;
+  // The emulated device only produces tightly packed YUYV frames.
+  if ((header->pixel_format != YUYV_FORMAT_CODE) ||
+    (header->bytes_per_line != (header->width * 2)) ||
+    (GetRecordedFrameCount(&recording) == 0)) {
+    CloseRecording(&recording);
+    errno = EINVAL;
+    return 0;
+  }
+  device = CreateEmulatedDevice(header->width, header->height, fps);
+  if (!device) {
+    CloseRecording(&recording);
+    return 0;
+  }
+  // Check every frame up front, so a truncated recording can't cause an
+  // error in the middle of playback.
+  for (i = 0; i < GetRecordedFrameCount(&recording); i++) {
+    if (!GetRecordedFrame(&recording, i, &frame) ||
+      (frame.size < device->frame_size)) {
+      CloseRecording(&recording);
+      free(device);
+      errno = EINVAL;
+      return 0;
+    }
+  }
+  device->recording = recording;
+  return OpenEmulatedDevice(webcam, &recording_backend, device);
+}